@@ -12,11 +12,17 @@
 
 #define CL_TARGET_OPENCL_VERSION 120
 #define MAX 256
-#define MAX_TRIANGLES 512
 #define MAX_LIGHTS 5
+#define SAMPLES 64	//Must match bidirectionalpathtracer.ocl
+#define MAX_VLP_SAMPLES 8
 
 #include "../ocl_boiler.h"
+#include "../bvh.h"
+#include "../lighttree.h"
 #include "../pamalign.h"
+#include "../scenebin.h"
+#include "../specialize.h"
+#include "../tiles.h"
 
 typedef struct{
 	cl_float4 v0;
@@ -74,13 +80,30 @@ int parseArrayFromFile(char * fileName, cl_int * arr){
 	return 1;
 }
 
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
 //Method to retrieve vertices from triangles.txt
-int parseTrianglesFromFile(char * fileName, cl_Triangle * arr){
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles){
 	FILE * textFile;
 	char x[MAX], y[MAX], z[MAX];
 	int curr_triangle = 0;
 	textFile = fopen(fileName, "r");
-	while(!feof(textFile) && curr_triangle < MAX_TRIANGLES){
+	while(!feof(textFile) && curr_triangle < ntriangles){
 		fgets(x, MAX, textFile);
 		fgets(y, MAX, textFile);
 		fgets(z, MAX, textFile);
@@ -139,9 +162,43 @@ int parseLightsFromFile(char * fileName, cl_float4 * arr){
 	return curr_light;
 }
 
+//Virtual lights sampled per hit from OCL_VLP_SAMPLES, a comma-separated list, 0 summing them all:
+//with more than one the frame is rendered with each, to compare them. Returns how many
+int parseVLPSamples(cl_int * samples){
+	const char * env = getenv("OCL_VLP_SAMPLES");
+	int nsamples = 0;
+	if(!env || env[0] == '\0') samples[nsamples++] = 4;
+	else while(nsamples < MAX_VLP_SAMPLES){
+		samples[nsamples++] = atoi(env);
+		env = strchr(env, ',');
+		if(!env) break;
+		++env;
+	}
+	for(int c = 0; c < nsamples; ++c)
+		if(samples[c] < 0) samples[c] = 0;
+	return nsamples;
+}
+
+//Rendering time of the frame and shadow rays traced with each K, against the smallest K
+void vlpSamplesReport(const cl_int * samples, const double * samples_ms, const cl_ulong * shadow_rays, int nsamples, int npixels){
+	if(nsamples < 2) return;
+	int smallest = 0;
+	for(int c = 1; c < nsamples; ++c)
+		if(samples[c] < samples[smallest]) smallest = c;
+	for(int c = 0; c < nsamples; ++c){
+		if(shadow_rays)
+			printf("virtual light samples K = %d : %d pixels in %gms, %llu shadow rays: %g Mrays/s, %.2fx the time of K = %d\n",
+				samples[c], npixels, samples_ms[c], (unsigned long long)shadow_rays[c], shadow_rays[c]/1.0e3/samples_ms[c],
+				samples_ms[c]/samples_ms[smallest], samples[smallest]);
+		else
+			printf("virtual light samples K = %d : %d pixels in %gms, %.2fx the time of K = %d\n",
+				samples[c], npixels, samples_ms[c], samples_ms[c]/samples_ms[smallest], samples[smallest]);
+	}
+}
+
 //Setting up the kernel to compute virtual light points
 cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que, 
-	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, cl_mem d_BVHNodes, cl_mem d_BVHIndices, 
 	cl_mem d_scenelights, cl_int nlights, cl_mem d_virtual_lights, int N_VLP, cl_uint4 seeds){
 
 	const size_t gws[] = { N_VLP };
@@ -158,6 +215,10 @@ cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que,
 	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(ntriangles), &ntriangles);
 	ocl_check(err, "set light tracer arg %d", i-1);
+	err = clSetKernelArg(lighttracer_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set light tracer arg %d", i-1);
+	err = clSetKernelArg(lighttracer_k, i++, sizeof(d_BVHIndices), &d_BVHIndices);
+	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(d_scenelights), &d_scenelights);
 	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(nlights), &nlights);
@@ -170,7 +231,7 @@ cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que,
 	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(cl_int)*9, NULL);	//lSquares
 	ocl_check(err, "set light tracer arg %d", i-1);
-	err = clSetKernelArg(lighttracer_k, i++, sizeof(cl_Triangle)*ntriangles , NULL);	//lTriangles
+	err = clSetKernelArg(lighttracer_k, i++, sizeof(cl_Triangle)*(d_BVHNodes ? 1 : ntriangles), NULL);	//lTriangles, unused with the BVH
 	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(cl_float4)*nlights , NULL);	//lScenelights
 	ocl_check(err, "set light tracer arg %d", i-1);
@@ -184,11 +245,13 @@ cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que,
 
 //Setting up the kernel to render the image
 cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_render, 
-	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
-	cl_mem d_virtual_lights, int N_VLP, cl_mem d_scenelights, cl_int nlights, cl_uint4 seeds, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, cl_mem d_BVHNodes, cl_mem d_BVHIndices, 
+	cl_mem d_virtual_lights, int N_VLP, cl_mem d_LightTree, cl_int nlightnodes, cl_mem d_vlp_stats, cl_int vlp_tile,
+	cl_mem d_scenelights, cl_int nlights, cl_uint4 seeds, 
 	cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, cl_float4 eye_offset, 
-	cl_int renderWidth, cl_int renderHeight, cl_event lighttracer_evt){
+	cl_int tileX, cl_int tileY, cl_int renderWidth, cl_int renderHeight, cl_event lighttracer_evt){
 
+	const size_t gwo[] = { tileX, tileY };
 	const size_t gws[] = { renderWidth, renderHeight };
 
 	cl_int nvirtuallights = N_VLP * nlights;
@@ -207,10 +270,20 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(ntriangles), &ntriangles);
 	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_BVHIndices), &d_BVHIndices);
+	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_virtual_lights), &d_virtual_lights);
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(nvirtuallights), &nvirtuallights);
 	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_LightTree), &d_LightTree);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(nlightnodes), &nlightnodes);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_vlp_stats), &d_vlp_stats);
+	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_scenelights), &d_scenelights);
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(nlights), &nlights);
@@ -229,12 +302,14 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_int)*9 , NULL);	//lSquares
 	ocl_check(err, "set path tracer arg %d", i-1);
-	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_Triangle)*ntriangles, NULL);	//lTriangles
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_Triangle)*(d_BVHNodes ? 1 : ntriangles), NULL);	//lTriangles, unused with the BVH
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*nlights, NULL);	//lScenelights
 	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*(vlp_tile > 0 ? vlp_tile : 1), NULL);	//lVLP
+	ocl_check(err, "set path tracer arg %d", i-1);
 
-	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, NULL, gws, NULL,
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, gwo, gws, NULL,
 		1, &lighttracer_evt, &pathtracer_evt);
 	ocl_check(err, "enqueue path tracer");
 
@@ -244,7 +319,7 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 int main(int argc, char* argv[]){
 
 	int img_width = 512, img_height = 512, N_VLP = 512;
-	printf("Usage: %s [img_width] [img_height] [N_VLP_per_light]\nLoads data from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
+	printf("Usage: %s [img_width] [img_height] [N_VLP_per_light]\nLoads data from scene.bin if present, otherwise from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
 
 	if(argc > 1){
 		img_width = atoi(argv[1]);
@@ -260,24 +335,12 @@ int main(int argc, char* argv[]){
 	cl_device_id d = select_device(p);
 	cl_context ctx = create_context(p, d);
 	cl_command_queue que = create_queue(ctx, d);
-	cl_program prog = create_program("bidirectionalpathtracer.ocl", ctx, d);
 	cl_int err;
-
-	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
-	ocl_check(err, "create kernel pathtracer_k");
-
-	cl_kernel lighttracer_k = clCreateKernel(prog, "lightTracer", &err);
-	ocl_check(err, "create kernel lighttracer_k");
 	
 	//seeds for the edited MWC64X
 	cl_uint4 seeds = {.x = time(0) & 134217727, .y = (getpid() * getpid() * getpid()) & 134217727, .z = (clock()*clock()) & 134217727, .w = rdtsc() & 134217727};
 
 	printf("Seeds: %d, %d, %d, %d\n", seeds.x, seeds.y, seeds.z, seeds.w);
-
-	size_t lws_max;
-	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
-		sizeof(lws_max), &lws_max, NULL);
-	ocl_check(err, "Max lws for pathtracer");
 	
 	const char *imageName = "result.ppm";
 	struct imgInfo resultInfo;
@@ -290,11 +353,20 @@ int main(int argc, char* argv[]){
 	resultInfo.data = malloc(resultInfo.data_size);
 	printf("Processing image %dx%d with data size %ld bytes\n", resultInfo.width, resultInfo.height, resultInfo.data_size);
 
-	cl_mem d_render = clCreateBuffer(ctx,
-		CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		resultInfo.data_size, NULL,
-		&err);
-	ocl_check(err, "create buffer d_render");
+	//Big frames are rendered in tiles streamed back into resultInfo.data (see ../tiles.h)
+	const double tile_ms = tile_target_ms(d, resultInfo.data_size);
+	cl_mem d_render = NULL;
+	cl_command_queue read_que = NULL;
+	if(tile_ms > 0){
+		read_que = create_queue(ctx, d);
+	}
+	else{
+		d_render = clCreateBuffer(ctx,
+			CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+			resultInfo.data_size, NULL,
+			&err);
+		ocl_check(err, "create buffer d_render");
+	}
 
 	cl_float4 zVect = { .x = 0, .y = 0, .z = -1, .w = 0 };
 
@@ -319,19 +391,136 @@ int main(int argc, char* argv[]){
 	//Geometries
 	cl_int * Spheres = malloc(sizeof(cl_int)*9);
 	cl_int * Squares = malloc(sizeof(cl_int)*9);
-	cl_Triangle * Triangles = malloc(sizeof(cl_float4)*3*MAX_TRIANGLES);
+	cl_Triangle * Triangles = NULL;
+	cl_int ntriangles, nlights;
+
+	//Prefer the memory-mapped binary scene (see ../SceneConverter), fall back to the text files
+	SceneFile scene;
+	const int use_scene_bin = (load_scene_bin("scene.bin", &scene) == 0);
+	if(use_scene_bin){
+		memcpy(Spheres, scene.header->Spheres, sizeof(cl_int)*9);
+		memcpy(Squares, scene.header->Squares, sizeof(cl_int)*9);
+		Triangles = scene.triangles;
+		ntriangles = scene.header->ntriangles;
+		nlights = scene.header->nlights < MAX_LIGHTS ? scene.header->nlights : MAX_LIGHTS;
+		memcpy(scenelights, scene.lights, sizeof(cl_float4)*nlights);
+	}
+	else{
+		//Size the triangles array from the file contents
+		ntriangles = countTrianglesInFile("triangles.txt");
+		Triangles = malloc(sizeof(cl_Triangle)*ntriangles);
+		parseArrayFromFile("spheres.txt", Spheres);
+		parseArrayFromFile("squares.txt", Squares);
+		ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles);
+		nlights = parseLightsFromFile("lights.txt", scenelights);
+	}
 
-	parseArrayFromFile("spheres.txt", Spheres);
-	parseArrayFromFile("squares.txt", Squares);
+	//Triangles are traced through a BVH built on the host (see ../bvh.h), its depth sizes the traversal stack
+	//OCL_BVH=0 tests all of them from local memory instead, as many as fit in a work-group
+	const char * const bvh_env = getenv("OCL_BVH");
+	const int use_bvh = ntriangles > 0 && !(bvh_env && strcmp(bvh_env, "0") == 0);
+
+	//Virtual point lights sampled through the light tree at each hit, OCL_VLP_SAMPLES=0 sums them all
+	cl_int vlp_samples_list[MAX_VLP_SAMPLES];
+	int nvlp_samples = parseVLPSamples(vlp_samples_list);
+	const int vlp_samples = vlp_samples_list[0];
+	if(vlp_samples > 0) printf("Light tree sampling: %d virtual lights per hit\n", vlp_samples);
+	else printf("Light tree sampling: off, all the virtual lights per hit\n");
+	//OCL_LIGHTCUTS=<relative error> shades them through light cuts instead (see LightCut)
+	const char * const lightcuts_env = getenv("OCL_LIGHTCUTS");
+	const float lightcut_error = lightcuts_env ? atof(lightcuts_env) : 0;
+	if(!isfinite(lightcut_error)){
+		fprintf(stderr, "invalid light cuts error %s\n", lightcuts_env);
+		exit(1);
+	}
+	//OCL_VLP_SHADOWS=1 casts a shadow ray to each of them
+	const char * const vlp_shadows_env = getenv("OCL_VLP_SHADOWS");
+	const int vlp_shadows = vlp_samples > 0 && vlp_shadows_env && atoi(vlp_shadows_env) != 0;
+	//OCL_VLP_TILE=<VLPs per chunk> sums them all, streamed by the work-groups through local memory (see Sample)
+	const char * const vlp_tile_env = getenv("OCL_VLP_TILE");
+	cl_int vlp_tile = vlp_tile_env && lightcut_error <= 0 ? atoi(vlp_tile_env) : 0;
+	if(vlp_tile > 0){
+		//A chunk gets the local memory left by the bitmasks, the lights and the triangles,
+		//at most a work-group of them without the BVH
+		cl_ulong local_mem_size;
+		err = clGetDeviceInfo(d, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL);
+		ocl_check(err, "local memory size");
+		size_t max_wg_size;
+		err = clGetDeviceInfo(d, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wg_size), &max_wg_size, NULL);
+		ocl_check(err, "max work-group size");
+		const size_t local_triangles = use_bvh ? 1 : (ntriangles < max_wg_size ? ntriangles : max_wg_size);
+		const size_t local_used = sizeof(cl_int)*2*9 + sizeof(cl_float4)*nlights + sizeof(cl_Triangle)*local_triangles;
+		const cl_int max_tile = local_mem_size > local_used ? (local_mem_size - local_used)/sizeof(cl_float4) : 0;
+		if(max_tile == 0)
+			printf("No local memory left for virtual light tiles: tiles off\n");
+		else if(vlp_tile > max_tile)
+			printf("Virtual light tile of %d too big for local memory: reducing to %d\n", vlp_tile, max_tile);
+		if(vlp_tile > max_tile) vlp_tile = max_tile;
+	}
+	//All the virtual lights are shaded at each hit, their loads counted by the kernel
+	const int vlp_all = lightcut_error <= 0 && (vlp_samples <= 0 || vlp_tile > 0);
+	//The other K of the list are only compared while sampling through the light tree
+	if(nvlp_samples > 1){
+		int sweep = vlp_samples > 0 && lightcut_error <= 0 && vlp_tile <= 0;
+		for(int c = 1; c < nvlp_samples; ++c)
+			if(vlp_samples_list[c] <= 0) sweep = 0;
+		if(!sweep){
+			printf("Virtual light samples: comparing K only with light tree sampling and K > 0, using K = %d\n", vlp_samples);
+			nvlp_samples = 1;
+		}
+		else printf("Virtual light samples: rendering with %d values of K\n", nvlp_samples);
+	}
+	//VLP_SAMPLES goes in front of these for each K (see below)
+	char build_options[BUFSIZE] = "";
+	if(vlp_shadows && lightcut_error <= 0 && vlp_tile <= 0){
+		printf("Light tree sampling: with shadow rays\n");
+		snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DVLP_SHADOWS");
+	}
+	if(lightcut_error > 0){
+		printf("Light cuts: relative error %g\n", lightcut_error);
+		//%#g keeps the decimal point, 1f would not be a float literal
+		snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DUSE_LIGHTCUTS -DLIGHTCUT_ERROR=%#gf", lightcut_error);
+	}
+	else if(vlp_tile > 0){
+		printf("Virtual light tiles: all the virtual lights per hit, %d per local memory chunk\n", vlp_tile);
+		snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DVLP_TILE=%d", vlp_tile);
+	}
+
+	BVH bvh;
+	memset(&bvh, 0, sizeof(bvh));
+	double runtime_bvh_ms = 0;
+	if(use_bvh){
+		clock_t start_bvh = clock();
+		if(build_bvh((const cl_float4*)Triangles, ntriangles, &bvh) != 0){
+			exit(1);
+		}
+		runtime_bvh_ms = (clock() - start_bvh)*1.0e3/CLOCKS_PER_SEC;
+		printf("Triangles BVH: %d nodes, depth %d\n", bvh.nnodes, bvh.depth);
+		snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DUSE_BVH -DBVH_STACK_SIZE=%d", bvh.depth);
+	}
+
+	//The kernels are built once the scene is known, specialized on it (see ../specialize.h)
+	//but not on the number of triangles, that depends on the local memory the kernel gets
+	char vlp_options[BUFSIZE];
+	snprintf(vlp_options, BUFSIZE, "-DVLP_SAMPLES=%d%s", vlp_samples > 0 && vlp_tile <= 0 ? vlp_samples : 0, build_options);
+	cl_program prog = create_program_specialized("bidirectionalpathtracer.ocl", ctx, d, vlp_options, Spheres, Squares, nlights, -1);
+
+	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
+	ocl_check(err, "create kernel pathtracer_k");
+
+	cl_kernel lighttracer_k = clCreateKernel(prog, "lightTracer", &err);
+	ocl_check(err, "create kernel lighttracer_k");
+
+	size_t lws_max;
+	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
+		sizeof(lws_max), &lws_max, NULL);
+	ocl_check(err, "Max lws for pathtracer");
 
-	cl_int ntriangles = parseTrianglesFromFile("triangles.txt", Triangles);
-	if(ntriangles > lws_max){
+	if(!use_bvh && ntriangles > lws_max){
 		printf("Too many triangles for local memory: reducing from %d to to %ld\n", ntriangles, lws_max);
 		ntriangles = lws_max;
 	}
 
-	cl_int nlights = parseLightsFromFile("lights.txt", scenelights);
-
 	printf("Number of triangles: %d\n", ntriangles);
 	printf("Number of lights: %d\n", nlights);
 
@@ -347,12 +536,28 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_Squares");
 
+	//Triangles from scene.bin are used in place, without a copy
 	cl_mem d_Triangles = clCreateBuffer(ctx,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		CL_MEM_READ_ONLY | (use_scene_bin ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
 		sizeof(cl_float4)*3*ntriangles, Triangles,
 		&err);
 	ocl_check(err, "create buffer d_Triangles");
 
+	//BVH nodes and triangle indices, NULL arguments without the BVH
+	cl_mem d_BVHNodes = NULL, d_BVHIndices = NULL;
+	if(use_bvh){
+		d_BVHNodes = clCreateBuffer(ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_BVHNode)*bvh.nnodes, bvh.nodes,
+			&err);
+		ocl_check(err, "create buffer d_BVHNodes");
+		d_BVHIndices = clCreateBuffer(ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_uint)*ntriangles, bvh.indices,
+			&err);
+		ocl_check(err, "create buffer d_BVHIndices");
+	}
+
 	cl_mem d_scenelights = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 		sizeof(cl_float4)*nlights, scenelights,
@@ -366,21 +571,111 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_virtual_lights");
 
-	cl_event lighttracer_evt = lightTracer(lighttracer_k, que, d_Spheres, d_Squares, d_Triangles, ntriangles, d_scenelights, nlights, d_virtual_lights, N_VLP, seeds);
-
-	cl_event pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
-	d_Spheres, d_Squares, d_Triangles, ntriangles, 
-	d_virtual_lights, N_VLP, d_scenelights, nlights, seeds, 
-	cam_forward, cam_up, cam_right, eye_offset, 
-	resultInfo.width, resultInfo.height, lighttracer_evt);
+	cl_event lighttracer_evt = lightTracer(lighttracer_k, que, d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, d_scenelights, nlights, d_virtual_lights, N_VLP, seeds);
+
+	//Light tree over the virtual lights, built on the host (see ../lighttree.h)
+	cl_float4 * virtual_lights = malloc(sizeof(cl_float4)*N_VLP*nlights);
+	cl_event readLights_evt;
+	err = clEnqueueReadBuffer(que, d_virtual_lights, CL_TRUE, 0, sizeof(cl_float4)*N_VLP*nlights, virtual_lights,
+		1, &lighttracer_evt, &readLights_evt);
+	ocl_check(err, "read virtual lights");
+	LightTree light_tree;
+	clock_t start_light_tree = clock();
+	if(build_light_tree(virtual_lights, N_VLP*nlights, &light_tree) != 0) exit(1);
+	double runtime_light_tree_ms = (clock() - start_light_tree)*1.0e3/CLOCKS_PER_SEC;
+	free(virtual_lights);
+
+	//A tree without lights still needs a buffer to bind
+	cl_mem d_LightTree = clCreateBuffer(ctx,
+		CL_MEM_READ_ONLY | (light_tree.nnodes ? CL_MEM_COPY_HOST_PTR : 0),
+		sizeof(cl_LightNode)*(light_tree.nnodes ? light_tree.nnodes : 1), light_tree.nnodes ? light_tree.nodes : NULL,
+		&err);
+	ocl_check(err, "create buffer d_LightTree");
+
+	//Light cut sizes and count, VLP shadow rays and hits, or VLPs shaded and loaded from global memory,
+	//as 64-bit counters split in two uints
+	cl_uint vlp_stats[4] = { 0, 0, 0, 0 };
+	cl_mem d_vlp_stats = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(vlp_stats), vlp_stats,
+		&err);
+	ocl_check(err, "create buffer d_vlp_stats");
+
+	//The frame is rendered once for each K, the path tracer rebuilt for all but the first
+	cl_event pathtracer_evt = NULL;
+	cl_program pass_prog = prog;
+	double vlp_samples_ms[MAX_VLP_SAMPLES];
+	cl_ulong vlp_shadow_rays[MAX_VLP_SAMPLES];
+	TileScheduler ts;
+	for(int c = 0; c < nvlp_samples; ++c){
+		if(c > 0){
+			if(tile_ms == 0) clReleaseEvent(pathtracer_evt);
+			clReleaseKernel(pathtracer_k);
+			if(pass_prog != prog) clReleaseProgram(pass_prog);
+			snprintf(vlp_options, BUFSIZE, "-DVLP_SAMPLES=%d%s", vlp_samples_list[c], build_options);
+			pass_prog = create_program_specialized("bidirectionalpathtracer.ocl", ctx, d, vlp_options, Spheres, Squares, nlights, -1);
+
+			pathtracer_k = clCreateKernel(pass_prog, "pathTracer", &err);
+			ocl_check(err, "create kernel pathtracer_k");
+
+			memset(vlp_stats, 0, sizeof(vlp_stats));
+			err = clEnqueueWriteBuffer(que, d_vlp_stats, CL_TRUE, 0, sizeof(vlp_stats), vlp_stats,
+				0, NULL, NULL);
+			ocl_check(err, "reset virtual light stats");
+		}
+
+		if(tile_ms > 0){
+			//Tiles of whole 16x16 blocks, so the work-groups stay big enough for the local memory copies
+			tile_scheduler_init(&ts, img_width, img_height, 16, 16, tile_max_pixels(d, sizeof(cl_uchar4)), tile_ms);
+			TileRing ring;
+			tile_ring_init(&ring, ctx, sizeof(cl_uchar4)*ts.max_pixels);
+			Tile tile;
+			cl_mem d_tile;
+			while((d_tile = tile_begin(&ring, &ts, &tile))){
+				cl_event tile_evt = pathTracer(pathtracer_k, que, d_tile, 
+					d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, 
+					d_virtual_lights, N_VLP, d_LightTree, light_tree.nnodes, d_vlp_stats, vlp_tile, d_scenelights, nlights, seeds, 
+					cam_forward, cam_up, cam_right, eye_offset, 
+					tile.x, tile.y, tile.w, tile.h, lighttracer_evt);
+				tile_end(&ring, &ts, &tile, que, tile_evt, tile_evt, read_que, resultInfo.data, sizeof(cl_uchar4));
+			}
+			tile_ring_finish(&ring, &ts);
+			vlp_samples_ms[c] = ts.render_ms;
+		}
+		else{
+			pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
+			d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, 
+			d_virtual_lights, N_VLP, d_LightTree, light_tree.nnodes, d_vlp_stats, vlp_tile, d_scenelights, nlights, seeds, 
+			cam_forward, cam_up, cam_right, eye_offset, 
+			0, 0, resultInfo.width, resultInfo.height, lighttracer_evt);
+			err = clWaitForEvents(1, &pathtracer_evt);
+			ocl_check(err, "wait path tracer");
+			vlp_samples_ms[c] = runtime_ms(pathtracer_evt);
+		}
+
+		if(vlp_shadows && nvlp_samples > 1){
+			err = clEnqueueReadBuffer(que, d_vlp_stats, CL_TRUE, 0, sizeof(vlp_stats), vlp_stats,
+				0, NULL, NULL);
+			ocl_check(err, "read virtual light stats");
+			vlp_shadow_rays[c] = vlp_stats[0] | (cl_ulong)vlp_stats[1] << 32;
+		}
+	}
 
-	cl_event getRender_evt;
+	cl_event getRender_evt = NULL;
 	
-	resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
-		CL_MAP_READ,
-		0, resultInfo.data_size,
-		1, &pathtracer_evt, &getRender_evt, &err);
-	ocl_check(err, "enqueue map d_render");
+	if(tile_ms == 0){
+		resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
+			CL_MAP_READ,
+			0, resultInfo.data_size,
+			1, &pathtracer_evt, &getRender_evt, &err);
+		ocl_check(err, "enqueue map d_render");
+	}
+
+	if(lightcut_error > 0 || vlp_shadows || vlp_all){
+		err = clEnqueueReadBuffer(que, d_vlp_stats, CL_TRUE, 0, sizeof(vlp_stats), vlp_stats,
+			0, NULL, NULL);
+		ocl_check(err, "read virtual light stats");
+	}
 
 	err = save_pam(imageName, &resultInfo);
 	if (err != 0) {
@@ -390,33 +685,83 @@ int main(int argc, char* argv[]){
 	else printf("\nSuccessfully created render image %s in the current directory\n\n", imageName);
 
 	double runtime_lighttracer_ms = runtime_ms(lighttracer_evt);
-	double runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
-	double runtime_getRender_ms = runtime_ms(getRender_evt);
-	double total_time_ms = runtime_lighttracer_ms + runtime_pathtracer_ms + runtime_getRender_ms;
+	double runtime_pathtracer_ms = tile_ms > 0 ? ts.render_ms : runtime_ms(pathtracer_evt);
+	double runtime_getRender_ms = tile_ms > 0 ? ts.read_ms : runtime_ms(getRender_evt);
+	double runtime_readLights_ms = runtime_ms(readLights_evt);
+	double total_time_ms = runtime_lighttracer_ms + runtime_readLights_ms + runtime_light_tree_ms + runtime_pathtracer_ms + runtime_getRender_ms;
 
 	double getRender_bw_gbs = resultInfo.data_size/1.0e6/runtime_getRender_ms;
 	double lighttracer_bw_gbs = N_VLP*nlights*sizeof(cl_float4)/1.0e6/runtime_lighttracer_ms;
 	double pathtracer_bw_gbs = resultInfo.data_size/1.0e6/runtime_pathtracer_ms;
+	double readLights_bw_gbs = N_VLP*nlights*sizeof(cl_float4)/1.0e6/runtime_readLights_ms;
 
 	printf("virtual light sampling : %d virtual lights in %gms: %g GB/s\n",
 		N_VLP*nlights, runtime_lighttracer_ms, lighttracer_bw_gbs);
+	printf("read virtual lights : %d virtual lights in %gms: %g GB/s\n",
+		N_VLP*nlights, runtime_readLights_ms, readLights_bw_gbs);
+	printf("build light tree : %d nodes over %d lit virtual lights, depth %d, in %gms (host)\n",
+		light_tree.nnodes, light_tree.nlights, light_tree.depth, runtime_light_tree_ms);
+	if(use_bvh) printf("build triangles BVH : %d nodes in %gms (host)\n", bvh.nnodes, runtime_bvh_ms);
 	printf("rendering : %d pixels in %gms: %g GB/s\n",
 		img_width*img_height, runtime_pathtracer_ms, pathtracer_bw_gbs);
 	printf("read render data : %ld uchar in %gms: %g GB/s\n",
 		resultInfo.data_size, runtime_getRender_ms, getRender_bw_gbs);
+	if(vlp_shadows && lightcut_error <= 0 && vlp_tile <= 0){
+		const cl_ulong shadow_rays = vlp_stats[0] | (cl_ulong)vlp_stats[1] << 32;
+		const cl_ulong hits = vlp_stats[2] | (cl_ulong)vlp_stats[3] << 32;
+		printf("virtual light shadows : %llu shadow rays for %llu hits (K = %d) in %gms: %g Mrays/s\n",
+			(unsigned long long)shadow_rays, (unsigned long long)hits, vlp_samples_list[nvlp_samples-1],
+			runtime_pathtracer_ms, shadow_rays/1.0e3/runtime_pathtracer_ms);
+	}
+	if(vlp_all){
+		//Virtual lights shaded by the work-items (effective, from local memory with tiles)
+		//and loaded from global memory (by the whole work-group with tiles), as counted by the kernel
+		const cl_ulong shaded = vlp_stats[0] | (cl_ulong)vlp_stats[1] << 32;
+		const cl_ulong loaded = vlp_stats[2] | (cl_ulong)vlp_stats[3] << 32;
+		printf("virtual light shading : %llu virtual lights shaded in %gms: %g GB/s effective (%s)\n",
+			(unsigned long long)shaded, runtime_pathtracer_ms, shaded*sizeof(cl_float4)/1.0e6/runtime_pathtracer_ms,
+			vlp_tile > 0 ? "work-group tiles" : "loop per work-item");
+		printf("virtual light loads : %llu virtual lights from global memory in %gms: %g GB/s\n",
+			(unsigned long long)loaded, runtime_pathtracer_ms, loaded*sizeof(cl_float4)/1.0e6/runtime_pathtracer_ms);
+	}
+	if(lightcut_error > 0){
+		const cl_ulong cut_lights = vlp_stats[0] | (cl_ulong)vlp_stats[1] << 32;
+		const cl_ulong cuts = vlp_stats[2] | (cl_ulong)vlp_stats[3] << 32;
+		printf("light cuts : %llu cuts, %g nodes per cut on average, over %d virtual lights\n",
+			(unsigned long long)cuts, cuts ? (double)cut_lights/cuts : 0, light_tree.nlights);
+	}
+	vlpSamplesReport(vlp_samples_list, vlp_samples_ms, vlp_shadows ? vlp_shadow_rays : NULL, nvlp_samples, img_width*img_height);
+	if(tile_ms > 0) tile_report(&ts);
 	printf("\nTotal time: %g ms.\n", total_time_ms);
 
-	err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
-	ocl_check(err, "unmap render");
-	clReleaseMemObject(d_render);
+	if(tile_ms > 0){
+		free(resultInfo.data);
+		clReleaseCommandQueue(read_que);
+	}
+	else{
+		err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
+		ocl_check(err, "unmap render");
+		clReleaseMemObject(d_render);
+	}
 
 	free(Spheres);
 	free(Squares);
-	free(Triangles);
+	clReleaseMemObject(d_Triangles);
+	if(use_bvh){
+		clReleaseMemObject(d_BVHNodes);
+		clReleaseMemObject(d_BVHIndices);
+		free_bvh(&bvh);
+	}
+	clReleaseMemObject(d_LightTree);
+	clReleaseMemObject(d_vlp_stats);
+	free_light_tree(&light_tree);
+	if(use_scene_bin) unload_scene_bin(&scene);
+	else free(Triangles);
 	free(scenelights);
 
 	clReleaseKernel(lighttracer_k);
 	clReleaseKernel(pathtracer_k);
+	if(pass_prog != prog) clReleaseProgram(pass_prog);
 	clReleaseProgram(prog);
 	clReleaseCommandQueue(que);
 	clReleaseContext(ctx);
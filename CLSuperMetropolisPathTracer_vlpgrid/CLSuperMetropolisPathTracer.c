@@ -13,12 +13,15 @@
 
 #define CL_TARGET_OPENCL_VERSION 120
 #define MAX 256
-#define MAX_TRIANGLES 512
 #define MAX_LIGHTS 5
 #define MAX_NELS_PER_CELL 62 //Should be a power of two minus two for better alignment
 
 #include "../ocl_boiler.h"
+#include "../bvh.h"
 #include "../pamalign.h"
+#include "../scenebin.h"
+#include "../specialize.h"
+#include "../tiles.h"
 
 typedef struct{
 	cl_float4 v0;
@@ -41,6 +44,12 @@ typedef struct{
 	cl_ushort elem_index[MAX_NELS_PER_CELL];
 } cl_Cell;
 
+//Cell layout used when there can be more than 65536 VLPs (kernels built with -DCELL_INDEX_32)
+typedef struct{
+	cl_uint nels;
+	cl_uint elem_index[MAX_NELS_PER_CELL];
+} cl_Cell32;
+
 int max(int x, int y){
 	if(x > y) return x;
 	return y;
@@ -111,13 +120,30 @@ int parseArrayFromFile(char * fileName, cl_int * arr){
 	return 1;
 }
 
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
 //Method to retrieve vertices from triangles.txt
-int parseTrianglesFromFile(char * fileName, cl_Triangle * arr){
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles){
 	FILE * textFile;
 	char x[MAX], y[MAX], z[MAX];
 	int curr_triangle = 0;
 	textFile = fopen(fileName, "r");
-	while(!feof(textFile) && curr_triangle < MAX_TRIANGLES){
+	while(!feof(textFile) && curr_triangle < ntriangles){
 		fgets(x, MAX, textFile);
 		fgets(y, MAX, textFile);
 		fgets(z, MAX, textFile);
@@ -178,7 +204,7 @@ int parseLightsFromFile(char * fileName, cl_float4 * arr){
 
 //Setting up the kernel to compute seed paths
 cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que, 
-	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, cl_mem d_BVHNodes, cl_mem d_BVHIndices, 
 	cl_mem d_scenelights, cl_int nlights, cl_mem d_seedpaths, int nseedpaths, cl_uint4 seeds){
 
 	const size_t gws[] = { nseedpaths };
@@ -195,6 +221,10 @@ cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que,
 	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(ntriangles), &ntriangles);
 	ocl_check(err, "set light tracer arg %d", i-1);
+	err = clSetKernelArg(lighttracer_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set light tracer arg %d", i-1);
+	err = clSetKernelArg(lighttracer_k, i++, sizeof(d_BVHIndices), &d_BVHIndices);
+	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(d_scenelights), &d_scenelights);
 	ocl_check(err, "set light tracer arg %d", i-1);
 	err = clSetKernelArg(lighttracer_k, i++, sizeof(nlights), &nlights);
@@ -219,7 +249,7 @@ cl_event lightTracer(cl_kernel lighttracer_k, cl_command_queue que,
 
 //Setting up the kernel to compute light paths from seed paths
 cl_event MetropolisLightTracer(cl_kernel metrolighttracer_k, cl_command_queue que, 
-	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, cl_mem d_BVHNodes, cl_mem d_BVHIndices, 
 	cl_mem d_scenelights, cl_int nlights, cl_mem d_seedpaths, int nseedpaths,
 	cl_mem d_virtual_point_lights, cl_uint4 seeds, cl_int mutation_rounds){
 
@@ -237,6 +267,10 @@ cl_event MetropolisLightTracer(cl_kernel metrolighttracer_k, cl_command_queue qu
 	ocl_check(err, "set metropolis light tracer arg %d", i-1);
 	err = clSetKernelArg(metrolighttracer_k, i++, sizeof(ntriangles), &ntriangles);
 	ocl_check(err, "set metropolis light tracer arg %d", i-1);
+	err = clSetKernelArg(metrolighttracer_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set metropolis light tracer arg %d", i-1);
+	err = clSetKernelArg(metrolighttracer_k, i++, sizeof(d_BVHIndices), &d_BVHIndices);
+	ocl_check(err, "set metropolis light tracer arg %d", i-1);
 	err = clSetKernelArg(metrolighttracer_k, i++, sizeof(d_scenelights), &d_scenelights);
 	ocl_check(err, "set metropolis light tracer arg %d", i-1);
 	err = clSetKernelArg(metrolighttracer_k, i++, sizeof(nlights), &nlights);
@@ -324,13 +358,14 @@ cl_event initVLPsGrid(cl_kernel initVLPsGrid_k, cl_command_queue que, cl_mem d_V
 
 //Setting up the kernel to render the image
 cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_render, 
-	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, cl_mem d_BVHNodes, cl_mem d_BVHIndices, 
 	cl_mem d_virtual_lights, int N_VLP, cl_mem d_VLPsGrid, cl_float4 VLPsBoxMin,
 	cl_float4 cell_size, cl_int4 grid_res,
 	cl_mem d_scenelights, cl_int nlights, cl_uint4 seeds, 
 	cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, cl_float4 eye_offset, 
-	cl_int renderWidth, cl_int renderHeight, cl_event prev_evt){
+	cl_int tileX, cl_int tileY, cl_int renderWidth, cl_int renderHeight, cl_event prev_evt){
 
+	const size_t gwo[] = { tileX, tileY };
 	const size_t gws[] = { renderWidth, renderHeight };
 
 	cl_int nvirtuallights = N_VLP * nlights;
@@ -349,6 +384,10 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(ntriangles), &ntriangles);
 	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_BVHIndices), &d_BVHIndices);
+	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_virtual_lights), &d_virtual_lights);
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(nvirtuallights), &nvirtuallights);
@@ -382,7 +421,7 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*nlights, NULL);	//lScenelights
 	ocl_check(err, "set path tracer arg %d", i-1);
 
-	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, NULL, gws, NULL,
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, gwo, gws, NULL,
 		1, &prev_evt, &pathtracer_evt);
 	ocl_check(err, "enqueue path tracer");
 
@@ -432,7 +471,7 @@ int main(int argc, char* argv[]){
 	cl_int mutation_rounds = 8;
 	float CELL_SIZE_MODIFIER = 3.0f;
 
-	printf("Usage: %s [img_width] [img_height] [N_seedpaths_per_light] [mutation_rounds] [CELL_SIZE_MODIFIER]\nLoads data from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
+	printf("Usage: %s [img_width] [img_height] [N_seedpaths_per_light] [mutation_rounds] [CELL_SIZE_MODIFIER]\nLoads data from scene.bin if present, otherwise from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
 
 	if(argc > 1){
 		img_width = atoi(argv[1]);
@@ -454,36 +493,12 @@ int main(int argc, char* argv[]){
 	cl_device_id d = select_device(p);
 	cl_context ctx = create_context(p, d);
 	cl_command_queue que = create_queue(ctx, d);
-	cl_program prog = create_program("metropolispathtracer.ocl", ctx, d);
 	cl_int err;
-
-	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
-	ocl_check(err, "create kernel pathtracer_k");
-
-	cl_kernel lighttracer_k = clCreateKernel(prog, "lightTracer", &err);
-	ocl_check(err, "create kernel lighttracer_k");
-
-	cl_kernel metrolighttracer_k = clCreateKernel(prog, "MetropolisLightTracer", &err);
-	ocl_check(err, "create kernel metrolighttracer_k");
-
-	cl_kernel initVLPsGrid_k = clCreateKernel(prog, "initVLPsGrid", &err);
-	ocl_check(err, "create kernel initVLPsGrid");
-
-	cl_kernel reduce4_k = clCreateKernel(prog, "reduceMinAndMax_lmem", &err);
-	ocl_check(err, "create kernel reduceMinAndMax_lmem");
-
-	cl_kernel reduce4_nwg_k = clCreateKernel(prog, "reduceMinAndMax_lmem_nwg", &err);
-	ocl_check(err, "create kernel reduceMinAndMax_lmem_nwg");
 	
 	//seeds for the edited MWC64X
 	cl_uint4 seeds = {.x = time(0) & 134217727, .y = (getpid() * getpid() * getpid()) & 134217727, .z = (clock()*clock()) & 134217727, .w = rdtsc() & 134217727};
 
 	printf("Seeds: %d, %d, %d, %d\n", seeds.x, seeds.y, seeds.z, seeds.w);
-
-	size_t lws_max;
-	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
-		sizeof(lws_max), &lws_max, NULL);
-	ocl_check(err, "Max lws for pathtracer");
 	
 	const char *imageName = "result.ppm";
 	struct imgInfo resultInfo;
@@ -496,11 +511,20 @@ int main(int argc, char* argv[]){
 	resultInfo.data = malloc(resultInfo.data_size);
 	printf("Processing image %dx%d with data size %ld bytes\n", resultInfo.width, resultInfo.height, resultInfo.data_size);
 
-	cl_mem d_render = clCreateBuffer(ctx,
-		CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		resultInfo.data_size, NULL,
-		&err);
-	ocl_check(err, "create buffer d_render");
+	//Big frames are rendered in tiles streamed back into resultInfo.data (see ../tiles.h)
+	const double tile_ms = tile_target_ms(d, resultInfo.data_size);
+	cl_mem d_render = NULL;
+	cl_command_queue read_que = NULL;
+	if(tile_ms > 0){
+		read_que = create_queue(ctx, d);
+	}
+	else{
+		d_render = clCreateBuffer(ctx,
+			CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+			resultInfo.data_size, NULL,
+			&err);
+		ocl_check(err, "create buffer d_render");
+	}
 
 	cl_float4 zVect = { .x = 0, .y = 0, .z = -1, .w = 0 };
 
@@ -525,20 +549,82 @@ int main(int argc, char* argv[]){
 	//Geometries
 	cl_int * Spheres = malloc(sizeof(cl_int)*9);
 	cl_int * Squares = malloc(sizeof(cl_int)*9);
-	cl_Triangle * Triangles = malloc(sizeof(cl_float4)*3*MAX_TRIANGLES);
-
-	parseArrayFromFile("spheres.txt", Spheres);
-	parseArrayFromFile("squares.txt", Squares);
-
-	cl_int ntriangles = parseTrianglesFromFile("triangles.txt", Triangles);
-
-	cl_int nlights = parseLightsFromFile("lights.txt", scenelights);
+	cl_Triangle * Triangles = NULL;
+	cl_int ntriangles, nlights;
+
+	//Prefer the memory-mapped binary scene (see ../SceneConverter), fall back to the text files
+	SceneFile scene;
+	const int use_scene_bin = (load_scene_bin("scene.bin", &scene) == 0);
+	if(use_scene_bin){
+		memcpy(Spheres, scene.header->Spheres, sizeof(cl_int)*9);
+		memcpy(Squares, scene.header->Squares, sizeof(cl_int)*9);
+		Triangles = scene.triangles;
+		ntriangles = scene.header->ntriangles;
+		nlights = scene.header->nlights < MAX_LIGHTS ? scene.header->nlights : MAX_LIGHTS;
+		memcpy(scenelights, scene.lights, sizeof(cl_float4)*nlights);
+	}
+	else{
+		//Size the triangles array from the file contents
+		ntriangles = countTrianglesInFile("triangles.txt");
+		Triangles = malloc(sizeof(cl_Triangle)*ntriangles);
+		parseArrayFromFile("spheres.txt", Spheres);
+		parseArrayFromFile("squares.txt", Squares);
+		ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles);
+		nlights = parseLightsFromFile("lights.txt", scenelights);
+	}
 	const cl_int N_VLP = nseedpaths*nlights*4;	//Total number of VLPs
 
 	printf("Number of triangles: %d\n", ntriangles);
 	printf("Number of lights: %d\n", nlights);
 	printf("Mutation rounds: %d\n", mutation_rounds);
 
+	//Triangles are traced through a BVH built on the host (see ../bvh.h), its depth sizes the traversal stack
+	//OCL_BVH=0 tests all of them for every ray instead
+	char build_options[BUFSIZE] = "";
+	const char * const bvh_env = getenv("OCL_BVH");
+	const int use_bvh = ntriangles > 0 && !(bvh_env && strcmp(bvh_env, "0") == 0);
+	BVH bvh;
+	memset(&bvh, 0, sizeof(bvh));
+	double runtime_bvh_ms = 0;
+	if(use_bvh){
+		clock_t start_bvh = clock();
+		if(build_bvh((const cl_float4*)Triangles, ntriangles, &bvh) != 0){
+			exit(1);
+		}
+		runtime_bvh_ms = (clock() - start_bvh)*1.0e3/CLOCKS_PER_SEC;
+		printf("Triangles BVH: %d nodes, depth %d\n", bvh.nnodes, bvh.depth);
+		snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DUSE_BVH -DBVH_STACK_SIZE=%d", bvh.depth);
+	}
+
+	//The kernels are built once the scene is known, specialized on it (see ../specialize.h)
+	//VLP cells keep 16 bit indices unless there are too many VLPs for them
+	const int use_index32 = N_VLP > CL_USHRT_MAX + 1;
+	if(use_index32) snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DCELL_INDEX_32");
+	cl_program prog = create_program_specialized("metropolispathtracer.ocl", ctx, d, build_options, Spheres, Squares, nlights, ntriangles);
+
+	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
+	ocl_check(err, "create kernel pathtracer_k");
+
+	cl_kernel lighttracer_k = clCreateKernel(prog, "lightTracer", &err);
+	ocl_check(err, "create kernel lighttracer_k");
+
+	cl_kernel metrolighttracer_k = clCreateKernel(prog, "MetropolisLightTracer", &err);
+	ocl_check(err, "create kernel metrolighttracer_k");
+
+	cl_kernel initVLPsGrid_k = clCreateKernel(prog, "initVLPsGrid", &err);
+	ocl_check(err, "create kernel initVLPsGrid");
+
+	cl_kernel reduce4_k = clCreateKernel(prog, "reduceMinAndMax_lmem", &err);
+	ocl_check(err, "create kernel reduceMinAndMax_lmem");
+
+	cl_kernel reduce4_nwg_k = clCreateKernel(prog, "reduceMinAndMax_lmem_nwg", &err);
+	ocl_check(err, "create kernel reduceMinAndMax_lmem_nwg");
+
+	size_t lws_max;
+	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
+		sizeof(lws_max), &lws_max, NULL);
+	ocl_check(err, "Max lws for pathtracer");
+
 	cl_mem d_Spheres = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 		sizeof(cl_int)*9, Spheres,
@@ -551,12 +637,28 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_Squares");
 
+	//Triangles from scene.bin are used in place, without a copy
 	cl_mem d_Triangles = clCreateBuffer(ctx,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		CL_MEM_READ_ONLY | (use_scene_bin ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
 		sizeof(cl_float4)*3*ntriangles, Triangles,
 		&err);
 	ocl_check(err, "create buffer d_Triangles");
 
+	//BVH nodes and triangle indices, NULL arguments without the BVH
+	cl_mem d_BVHNodes = NULL, d_BVHIndices = NULL;
+	if(use_bvh){
+		d_BVHNodes = clCreateBuffer(ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_BVHNode)*bvh.nnodes, bvh.nodes,
+			&err);
+		ocl_check(err, "create buffer d_BVHNodes");
+		d_BVHIndices = clCreateBuffer(ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_uint)*ntriangles, bvh.indices,
+			&err);
+		ocl_check(err, "create buffer d_BVHIndices");
+	}
+
 	cl_mem d_scenelights = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 		sizeof(cl_float4)*nlights, scenelights,
@@ -576,9 +678,9 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_virtual_lights1");
 
-	cl_event lighttracer_evt = lightTracer(lighttracer_k, que, d_Spheres, d_Squares, d_Triangles, ntriangles, d_scenelights, nlights, d_virtual_lights1, nseedpaths, seeds);
+	cl_event lighttracer_evt = lightTracer(lighttracer_k, que, d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, d_scenelights, nlights, d_virtual_lights1, nseedpaths, seeds);
 
-	cl_event metrolighttracer_evt = MetropolisLightTracer(metrolighttracer_k, que, d_Spheres, d_Squares, d_Triangles, ntriangles, d_scenelights, nlights, d_seedpaths, nseedpaths, d_virtual_lights1, seeds, mutation_rounds);
+	cl_event metrolighttracer_evt = MetropolisLightTracer(metrolighttracer_k, que, d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, d_scenelights, nlights, d_seedpaths, nseedpaths, d_virtual_lights1, seeds, mutation_rounds);
 
 	size_t lws;
 	err = clGetKernelWorkGroupInfo(reduce4_k, d, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(lws), &lws, NULL);
@@ -634,8 +736,8 @@ int main(int argc, char* argv[]){
 		grid_res.s[i] = max(1, min(grid_res.s[i], 128));
 	}
 	cl_float4 cell_size = VectorDivisionFloatInt(grid_size, grid_res);
-	size_t grid_memsize = sizeof(cl_Cell) * grid_res.x * grid_res.y * grid_res.z;
-	cl_Cell * VLPsGrid = calloc(1, grid_memsize);
+	size_t grid_memsize = (use_index32 ? sizeof(cl_Cell32) : sizeof(cl_Cell)) * grid_res.x * grid_res.y * grid_res.z;
+	void * VLPsGrid = calloc(1, grid_memsize);
 	printf("VLPs grid size: %d x %d x %d\n", grid_res.x, grid_res.y, grid_res.z);
 
 	cl_mem d_VLPsGrid = clCreateBuffer(ctx,
@@ -648,20 +750,44 @@ int main(int argc, char* argv[]){
 	//cl_int4 OneVec = {.x = 1, .y = 1, .z = 1, .w = 0};
 	//grid_res = VectorDifference(grid_res, OneVec);
 
-	cl_event pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
-	d_Spheres, d_Squares, d_Triangles, ntriangles, 
-	d_virtual_lights1, N_VLP, d_VLPsGrid, VLPsBox.vmin, cell_size, grid_res,
-	d_scenelights, nlights, seeds, 
-	cam_forward, cam_up, cam_right, eye_offset, 
-	resultInfo.width, resultInfo.height, initVLPsGrid_evt);
+	cl_event pathtracer_evt = NULL;
+	TileScheduler ts;
+	if(tile_ms > 0){
+		//Tiles of whole 16x16 blocks, so the work-groups stay big enough for the local memory copies
+		tile_scheduler_init(&ts, img_width, img_height, 16, 16, tile_max_pixels(d, sizeof(cl_uchar4)), tile_ms);
+		TileRing ring;
+		tile_ring_init(&ring, ctx, sizeof(cl_uchar4)*ts.max_pixels);
+		Tile tile;
+		cl_mem d_tile;
+		while((d_tile = tile_begin(&ring, &ts, &tile))){
+			cl_event tile_evt = pathTracer(pathtracer_k, que, d_tile, 
+				d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, 
+				d_virtual_lights1, N_VLP, d_VLPsGrid, VLPsBox.vmin, cell_size, grid_res,
+				d_scenelights, nlights, seeds, 
+				cam_forward, cam_up, cam_right, eye_offset, 
+				tile.x, tile.y, tile.w, tile.h, initVLPsGrid_evt);
+			tile_end(&ring, &ts, &tile, que, tile_evt, tile_evt, read_que, resultInfo.data, sizeof(cl_uchar4));
+		}
+		tile_ring_finish(&ring, &ts);
+	}
+	else{
+		pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
+		d_Spheres, d_Squares, d_Triangles, ntriangles, d_BVHNodes, d_BVHIndices, 
+		d_virtual_lights1, N_VLP, d_VLPsGrid, VLPsBox.vmin, cell_size, grid_res,
+		d_scenelights, nlights, seeds, 
+		cam_forward, cam_up, cam_right, eye_offset, 
+		0, 0, resultInfo.width, resultInfo.height, initVLPsGrid_evt);
+	}
 
-	cl_event getRender_evt;
+	cl_event getRender_evt = NULL;
 	
-	resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
-		CL_MAP_READ,
-		0, resultInfo.data_size,
-		1, &pathtracer_evt, &getRender_evt, &err);
-	ocl_check(err, "enqueue map d_render");
+	if(tile_ms == 0){
+		resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
+			CL_MAP_READ,
+			0, resultInfo.data_size,
+			1, &pathtracer_evt, &getRender_evt, &err);
+		ocl_check(err, "enqueue map d_render");
+	}
 
 	err = save_pam(imageName, &resultInfo);
 	if (err != 0) {
@@ -675,8 +801,8 @@ int main(int argc, char* argv[]){
 	double runtime_reduce_ms = total_runtime_ms(reduce_evt[0], reduce_evt[1]);
 	double runtime_readBox_ms = runtime_ms(readBox_evt);
 	double runtime_initVLPsGrid_ms = runtime_ms(initVLPsGrid_evt);
-	double runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
-	double runtime_getRender_ms = runtime_ms(getRender_evt);
+	double runtime_pathtracer_ms = tile_ms > 0 ? ts.render_ms : runtime_ms(pathtracer_evt);
+	double runtime_getRender_ms = tile_ms > 0 ? ts.read_ms : runtime_ms(getRender_evt);
 	double total_time_ms = runtime_lighttracer_ms + runtime_metrolighttracer_ms + runtime_reduce_ms + runtime_initVLPsGrid_ms + runtime_pathtracer_ms + runtime_getRender_ms;
 	//double total_time_ms = runtime_lighttracer_ms + runtime_metrolighttracer_ms + runtime_initVLPsGrid_ms + runtime_pathtracer_ms + runtime_getRender_ms;
 
@@ -698,19 +824,34 @@ int main(int argc, char* argv[]){
 		runtime_readBox_ms, readBox_bw_gbs);
 	printf("init VLPs grid : %d cells in %gms: %g GB/s\n",
 		grid_res.x*grid_res.y*grid_res.z, runtime_initVLPsGrid_ms, initVLPsGrid_bw_gbs);
+	if(use_bvh) printf("build triangles BVH : %d nodes in %gms (host)\n", bvh.nnodes, runtime_bvh_ms);
 	printf("rendering : %d pixels in %gms: %g GB/s\n",
 		img_width*img_height, runtime_pathtracer_ms, pathtracer_bw_gbs);
 	printf("read render data : %ld uchar in %gms: %g GB/s\n",
 		resultInfo.data_size, runtime_getRender_ms, getRender_bw_gbs);
+	if(tile_ms > 0) tile_report(&ts);
 	printf("\nTotal time: %g ms.\n", total_time_ms);
 
-	err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
-	ocl_check(err, "unmap render");
-	clReleaseMemObject(d_render);
+	if(tile_ms > 0){
+		free(resultInfo.data);
+		clReleaseCommandQueue(read_que);
+	}
+	else{
+		err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
+		ocl_check(err, "unmap render");
+		clReleaseMemObject(d_render);
+	}
 
 	free(Spheres);
 	free(Squares);
-	free(Triangles);
+	clReleaseMemObject(d_Triangles);
+	if(use_bvh){
+		clReleaseMemObject(d_BVHNodes);
+		clReleaseMemObject(d_BVHIndices);
+		free_bvh(&bvh);
+	}
+	if(use_scene_bin) unload_scene_bin(&scene);
+	else free(Triangles);
 	free(VLPsGrid);
 	free(scenelights);
 
@@ -11,11 +11,14 @@
 
 #define CL_TARGET_OPENCL_VERSION 120
 #define MAX 256
-#define MAX_TRIANGLES 512
 #define MAX_LIGHTS 5
 
 #include "../ocl_boiler.h"
 #include "../pamalign.h"
+#include "../scenebin.h"
+#include "../specialize.h"
+#include "../tiles.h"
+#include "../multidevice.h"
 
 typedef struct{
 	cl_float4 v0;
@@ -73,13 +76,30 @@ int parseArrayFromFile(char * fileName, cl_int * arr){
 	return 1;
 }
 
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
 //Method to retrieve vertices from triangles.txt
-int parseTrianglesFromFile(char * fileName, cl_Triangle * arr){
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles){
 	FILE * textFile;
 	char x[MAX], y[MAX], z[MAX];
 	int curr_triangle = 0;
 	textFile = fopen(fileName, "r");
-	while(!feof(textFile) && curr_triangle < MAX_TRIANGLES){
+	while(!feof(textFile) && curr_triangle < ntriangles){
 		fgets(x, MAX, textFile);
 		fgets(y, MAX, textFile);
 		fgets(z, MAX, textFile);
@@ -138,13 +158,14 @@ int parseLightsFromFile(char * fileName, cl_float4 * arr){
 	return curr_light;
 }
 
-//Setting up the kernel to render the image
+//Setting up the kernel to render the image, or the renderWidth x renderHeight tile at tileX, tileY
 cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_render, 
 	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
 	cl_mem d_scenelights, cl_int nlights,
 	cl_uint4 seeds, cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, 
-	cl_float4 eye_offset, cl_int renderWidth, cl_int renderHeight){
+	cl_float4 eye_offset, cl_int tileX, cl_int tileY, cl_int renderWidth, cl_int renderHeight){
 
+	const size_t gwo[] = { tileX, tileY };
 	const size_t gws[] = { renderWidth, renderHeight };
 
 	cl_event pathtracer_evt;
@@ -176,17 +197,177 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(seeds), &seeds);
 	ocl_check(err, "set path tracer arg %d", i-1);
 
-	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, NULL, gws, NULL,
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, gwo, gws, NULL,
 		0, NULL, &pathtracer_evt);
 	ocl_check(err, "enqueue path tracer");
 
 	return pathtracer_evt;	
 }
 
+//Progressive mode: add nsamples samples per pixel to d_accum, sample_offset are the ones already in it
+cl_event pathTracerProgressive(cl_kernel progressive_k, cl_command_queue que, cl_mem d_accum, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles, 
+	cl_mem d_scenelights, cl_int nlights,
+	cl_uint4 seeds, cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, 
+	cl_float4 eye_offset, cl_int renderWidth, cl_int renderHeight,
+	cl_uint sample_offset, cl_int nsamples){
+
+	const size_t gws[] = { renderWidth, renderHeight };
+
+	cl_event progressive_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(progressive_k, i++, sizeof(d_accum), &d_accum);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(d_Spheres), &d_Spheres);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(d_Squares), &d_Squares);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(d_scenelights), &d_scenelights);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(nlights), &nlights);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(cam_forward), &cam_forward);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(cam_up), &cam_up);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(cam_right), &cam_right);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(eye_offset), &eye_offset);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(seeds), &seeds);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(sample_offset), &sample_offset);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+	err = clSetKernelArg(progressive_k, i++, sizeof(nsamples), &nsamples);
+	ocl_check(err, "set progressive path tracer arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, progressive_k, 2, NULL, gws, NULL,
+		0, NULL, &progressive_evt);
+	ocl_check(err, "enqueue progressive path tracer");
+
+	return progressive_evt;
+}
+
+//Progressive mode: convert the total_samples samples per pixel in d_accum to the 8-bit render
+cl_event resolveAccumulation(cl_kernel resolve_k, cl_command_queue que, cl_mem d_render, 
+	cl_mem d_accum, cl_int npixels, cl_int total_samples){
+
+	const size_t gws[] = { npixels };
+
+	cl_event resolve_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(resolve_k, i++, sizeof(d_render), &d_render);
+	ocl_check(err, "set resolve arg %d", i-1);
+	err = clSetKernelArg(resolve_k, i++, sizeof(d_accum), &d_accum);
+	ocl_check(err, "set resolve arg %d", i-1);
+	err = clSetKernelArg(resolve_k, i++, sizeof(total_samples), &total_samples);
+	ocl_check(err, "set resolve arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, resolve_k, 1, NULL, gws, NULL,
+		0, NULL, &resolve_evt);
+	ocl_check(err, "enqueue resolve");
+
+	return resolve_evt;
+}
+
+//Program, kernel and scene buffers of one device in multi-device mode (see ../multidevice.h)
+typedef struct{
+	cl_program prog;
+	cl_kernel pathtracer_k;
+	cl_mem d_Spheres, d_Squares, d_Triangles, d_scenelights;
+	cl_int ntriangles, nlights;
+	cl_uint4 seeds;
+	cl_float4 cam_forward, cam_up, cam_right, eye_offset;
+} DeviceScene;
+
+void pathTracerTile(RenderDevice *rd, cl_mem d_tile, const Tile *tile, cl_event *first_evt, cl_event *last_evt){
+	DeviceScene *sc = rd->data;
+	*first_evt = *last_evt = pathTracer(sc->pathtracer_k, rd->que, d_tile, 
+		sc->d_Spheres, sc->d_Squares, sc->d_Triangles, sc->ntriangles, 
+		sc->d_scenelights, sc->nlights, sc->seeds, 
+		sc->cam_forward, sc->cam_up, sc->cam_right, sc->eye_offset, 
+		tile->x, tile->y, tile->w, tile->h);
+}
+
+//Render the frame on all the devices, pulling tiles from a shared queue
+//Returns the wall-clock time in ms
+double pathTracerMultiDevice(RenderDevice *rd, cl_uint ndevs, 
+	cl_int * Spheres, cl_int * Squares, cl_Triangle * Triangles, cl_int ntriangles, cl_mem_flags triangles_flags,
+	cl_float4 * scenelights, cl_int nlights,
+	cl_uint4 seeds, cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, 
+	cl_float4 eye_offset, cl_int renderWidth, cl_int renderHeight, double tile_ms, void * img){
+
+	DeviceScene scenes[MAX_RENDER_DEVICES];
+	cl_int err;
+
+	for(cl_uint k = 0; k < ndevs; ++k){
+		DeviceScene *sc = scenes + k;
+		printf("device %u: %s\n", k, rd[k].name);
+		sc->prog = create_program_specialized("pathtracer.ocl", rd[k].ctx, rd[k].dev, NULL, Spheres, Squares, nlights, ntriangles);
+		sc->pathtracer_k = clCreateKernel(sc->prog, "pathTracer", &err);
+		ocl_check(err, "create kernel pathtracer_k on device %u", k);
+
+		sc->d_Spheres = clCreateBuffer(rd[k].ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_int)*9, Spheres,
+			&err);
+		ocl_check(err, "create buffer d_Spheres on device %u", k);
+		sc->d_Squares = clCreateBuffer(rd[k].ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_int)*9, Squares,
+			&err);
+		ocl_check(err, "create buffer d_Squares on device %u", k);
+		sc->d_Triangles = clCreateBuffer(rd[k].ctx,
+			triangles_flags,
+			sizeof(cl_float4)*3*ntriangles, Triangles,
+			&err);
+		ocl_check(err, "create buffer d_Triangles on device %u", k);
+		sc->d_scenelights = clCreateBuffer(rd[k].ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_float4)*nlights, scenelights,
+			&err);
+		ocl_check(err, "create buffer d_scenelights on device %u", k);
+
+		sc->ntriangles = ntriangles;
+		sc->nlights = nlights;
+		sc->seeds = seeds;
+		sc->cam_forward = cam_forward;
+		sc->cam_up = cam_up;
+		sc->cam_right = cam_right;
+		sc->eye_offset = eye_offset;
+		rd[k].data = sc;
+	}
+
+	const double wall_ms = render_multidevice(rd, ndevs, renderWidth, renderHeight, 1, 1,
+		sizeof(cl_uchar4), tile_ms, img, sizeof(cl_uchar4), pathTracerTile);
+
+	for(cl_uint k = 0; k < ndevs; ++k){
+		clReleaseMemObject(scenes[k].d_Spheres);
+		clReleaseMemObject(scenes[k].d_Squares);
+		clReleaseMemObject(scenes[k].d_Triangles);
+		clReleaseMemObject(scenes[k].d_scenelights);
+		clReleaseKernel(scenes[k].pathtracer_k);
+		clReleaseProgram(scenes[k].prog);
+	}
+	return wall_ms;
+}
+
 int main(int argc, char* argv[]){
 
 	int img_width = 512, img_height = 512;
-	printf("Usage: %s [img_width] [img_height]\nLoads data from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
+	//Progressive mode, off with 0 samples per launch: launches of samples_per_launch samples
+	//until max_samples samples per pixel or max_ms milliseconds (0: no time limit)
+	int samples_per_launch = 0, max_samples = 64;
+	double max_ms = 0;
+	printf("Usage: %s [img_width] [img_height] [samples_per_launch] [max_samples] [max_ms]\nLoads data from scene.bin if present, otherwise from triangles.txt, lights.txt, spheres.txt and squares.txt\nA samples_per_launch greater than 0 renders progressively, until max_samples samples per pixel or max_ms milliseconds\n", argv[0]);
 
 	if(argc > 1){
 		img_width = atoi(argv[1]);
@@ -194,26 +375,34 @@ int main(int argc, char* argv[]){
 	if (argc > 2){
 		img_height = atoi(argv[2]);
 	}
+	if (argc > 3){
+		samples_per_launch = atoi(argv[3]);
+	}
+	if (argc > 4){
+		max_samples = atoi(argv[4]);
+	}
+	if (argc > 5){
+		max_ms = atof(argv[5]);
+	}
+	if (samples_per_launch < 0 || max_samples < 1){
+		fprintf(stderr, "samples_per_launch must be at least 0 and max_samples at least 1\n");
+		exit(1);
+	}
+	const int progressive = samples_per_launch > 0;
+	//Multi-device rendering, with OCL_MULTIDEVICE=1 (see ../multidevice.h)
+	const int multidevice = !progressive && use_multidevice();
 
 	cl_platform_id p = select_platform();
 	cl_device_id d = select_device(p);
 	cl_context ctx = create_context(p, d);
 	cl_command_queue que = create_queue(ctx, d);
-	cl_program prog = create_program("pathtracer.ocl", ctx, d);
 	cl_int err;
-
-	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
-	ocl_check(err, "create kernel pathtracer_k");
 	
 	//seeds for the edited MWC64X
 	cl_uint4 seeds = {.x = time(0) & 134217727, .y = (getpid() * getpid() * getpid()) & 134217727, .z = (clock()*clock()) & 134217727, .w = rdtsc() & 134217727};
 
 	printf("Seeds: %d, %d, %d, %d\n", seeds.x, seeds.y, seeds.z, seeds.w);
 
-	size_t lws_max;
-	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
-		sizeof(lws_max), &lws_max, NULL);
-	ocl_check(err, "Max lws for pathtracer");
 	size_t gws_max = 131072;
 
 	const char *imageName = "result.ppm";
@@ -227,11 +416,22 @@ int main(int argc, char* argv[]){
 	resultInfo.data = malloc(resultInfo.data_size);
 	printf("Processing image %dx%d with data size %ld bytes\n", resultInfo.width, resultInfo.height, resultInfo.data_size);
 
-	cl_mem d_render = clCreateBuffer(ctx,
-		CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		resultInfo.data_size, NULL,
-		&err);
-	ocl_check(err, "create buffer d_render");
+	//Big frames are rendered in tiles streamed back into resultInfo.data (see ../tiles.h)
+	double tile_ms = progressive ? 0 : tile_target_ms(d, resultInfo.data_size);
+	//Multi-device rendering always goes through tiles
+	if(multidevice && tile_ms == 0) tile_ms = TILE_TARGET_MS;
+	cl_mem d_render = NULL;
+	cl_command_queue read_que = NULL;
+	if(tile_ms > 0){
+		read_que = create_queue(ctx, d);
+	}
+	else{
+		d_render = clCreateBuffer(ctx,
+			CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+			resultInfo.data_size, NULL,
+			&err);
+		ocl_check(err, "create buffer d_render");
+	}
 
 	cl_float4 zVect = { .x = 0, .y = 0, .z = -1, .w = 0 };
 
@@ -256,16 +456,80 @@ int main(int argc, char* argv[]){
 	//Geometries
 	cl_int * Spheres = malloc(sizeof(cl_int)*9);
 	cl_int * Squares = malloc(sizeof(cl_int)*9);
-	cl_Triangle * Triangles = malloc(sizeof(cl_float4)*3*MAX_TRIANGLES);
-
-	parseArrayFromFile("spheres.txt", Spheres);
-	parseArrayFromFile("squares.txt", Squares);
-	cl_int ntriangles = parseTrianglesFromFile("triangles.txt", Triangles);
-	cl_int nlights = parseLightsFromFile("lights.txt", scenelights);
+	cl_Triangle * Triangles = NULL;
+	cl_int ntriangles, nlights;
+
+	//Prefer the memory-mapped binary scene (see ../SceneConverter), fall back to the text files
+	SceneFile scene;
+	const int use_scene_bin = (load_scene_bin("scene.bin", &scene) == 0);
+	if(use_scene_bin){
+		memcpy(Spheres, scene.header->Spheres, sizeof(cl_int)*9);
+		memcpy(Squares, scene.header->Squares, sizeof(cl_int)*9);
+		Triangles = scene.triangles;
+		ntriangles = scene.header->ntriangles;
+		nlights = scene.header->nlights < MAX_LIGHTS ? scene.header->nlights : MAX_LIGHTS;
+		memcpy(scenelights, scene.lights, sizeof(cl_float4)*nlights);
+	}
+	else{
+		//Size the triangles array from the file contents
+		ntriangles = countTrianglesInFile("triangles.txt");
+		Triangles = malloc(sizeof(cl_Triangle)*ntriangles);
+		parseArrayFromFile("spheres.txt", Spheres);
+		parseArrayFromFile("squares.txt", Squares);
+		ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles);
+		nlights = parseLightsFromFile("lights.txt", scenelights);
+	}
 
 	printf("Number of triangles: %d\n", ntriangles);
 	printf("Number of lights: %d\n", nlights);
 
+	if(multidevice){
+		RenderDevice rd[MAX_RENDER_DEVICES];
+		const cl_uint ndevs = create_render_devices(p, rd, MAX_RENDER_DEVICES);
+		const double wall_ms = pathTracerMultiDevice(rd, ndevs, Spheres, Squares, Triangles, ntriangles,
+			CL_MEM_READ_ONLY | (use_scene_bin ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
+			scenelights, nlights, seeds, 
+			cam_forward, cam_up, cam_right, eye_offset, 
+			resultInfo.width, resultInfo.height, tile_ms, resultInfo.data);
+
+		err = save_pam(imageName, &resultInfo);
+		if (err != 0) {
+			fprintf(stderr, "error writing %s\n", imageName);
+			exit(1);
+		}
+		else printf("\nSuccessfully created render image %s in the current directory\n\n", imageName);
+
+		multidevice_report(rd, ndevs, wall_ms);
+		release_render_devices(rd, ndevs);
+
+		free(resultInfo.data);
+		free(Spheres);
+		free(Squares);
+		if(use_scene_bin) unload_scene_bin(&scene);
+		else free(Triangles);
+		clReleaseCommandQueue(read_que);
+		clReleaseCommandQueue(que);
+		clReleaseContext(ctx);
+		return 0;
+	}
+
+	//The kernels are built once the scene is known, specialized on it (see ../specialize.h)
+	cl_program prog = create_program_specialized("pathtracer.ocl", ctx, d, NULL, Spheres, Squares, nlights, ntriangles);
+
+	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
+	ocl_check(err, "create kernel pathtracer_k");
+
+	cl_kernel progressive_k = clCreateKernel(prog, "pathTracerProgressive", &err);
+	ocl_check(err, "create kernel progressive_k");
+
+	cl_kernel resolve_k = clCreateKernel(prog, "resolveAccumulation", &err);
+	ocl_check(err, "create kernel resolve_k");
+
+	size_t lws_max;
+	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
+		sizeof(lws_max), &lws_max, NULL);
+	ocl_check(err, "Max lws for pathtracer");
+
 	cl_mem d_Spheres = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 		sizeof(cl_int)*9, Spheres,
@@ -278,8 +542,9 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_Squares");
 
+	//Triangles from scene.bin are used in place, without a copy
 	cl_mem d_Triangles = clCreateBuffer(ctx,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		CL_MEM_READ_ONLY | (use_scene_bin ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
 		sizeof(cl_float4)*3*ntriangles, Triangles,
 		&err);
 	ocl_check(err, "create buffer d_Triangles");
@@ -290,19 +555,78 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_scenelights");
 
-	cl_event pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
-	d_Spheres, d_Squares, d_Triangles, ntriangles, 
-	d_scenelights, nlights, seeds, 
-	cam_forward, cam_up, cam_right, eye_offset, 
-	resultInfo.width, resultInfo.height);
+	const cl_int npixels = img_width*img_height;
+	cl_event pathtracer_evt = NULL, resolve_evt = NULL;
+	cl_mem d_accum = NULL;
+	double runtime_pathtracer_ms = 0, wall_pathtracer_ms = 0;
+	int total_samples = 0, nlaunches = 0;
+	TileScheduler ts;
+	if(progressive){
+		//Float framebuffer with the running sum of the samples of every pixel
+		d_accum = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_float4)*npixels, NULL,
+			&err);
+		ocl_check(err, "create buffer d_accum");
+
+		const cl_float4 zero = { .x = 0, .y = 0, .z = 0, .w = 0 };
+		err = clEnqueueFillBuffer(que, d_accum, &zero, sizeof(zero), 0, sizeof(cl_float4)*npixels,
+			0, NULL, NULL);
+		ocl_check(err, "clear d_accum");
+
+		//Short launches keep the device responsive; the budget is checked after each one
+		const double start_ms = wtime_ms();
+		do{
+			const int nsamples = samples_per_launch < max_samples - total_samples ? samples_per_launch : max_samples - total_samples;
+			cl_event progressive_evt = pathTracerProgressive(progressive_k, que, d_accum, 
+				d_Spheres, d_Squares, d_Triangles, ntriangles, 
+				d_scenelights, nlights, seeds, 
+				cam_forward, cam_up, cam_right, eye_offset, 
+				resultInfo.width, resultInfo.height, total_samples, nsamples);
+			err = clWaitForEvents(1, &progressive_evt);
+			ocl_check(err, "wait for progressive path tracer");
+			runtime_pathtracer_ms += runtime_ms(progressive_evt);
+			clReleaseEvent(progressive_evt);
+			total_samples += nsamples;
+			++nlaunches;
+			wall_pathtracer_ms = wtime_ms() - start_ms;
+		}while(total_samples < max_samples && (max_ms <= 0 || wall_pathtracer_ms < max_ms));
+
+		resolve_evt = resolveAccumulation(resolve_k, que, d_render, d_accum, npixels, total_samples);
+	}
+	else if(tile_ms > 0){
+		tile_scheduler_init(&ts, img_width, img_height, 1, 1, tile_max_pixels(d, sizeof(cl_uchar4)), tile_ms);
+		TileRing ring;
+		tile_ring_init(&ring, ctx, sizeof(cl_uchar4)*ts.max_pixels);
+		Tile tile;
+		cl_mem d_tile;
+		while((d_tile = tile_begin(&ring, &ts, &tile))){
+			cl_event tile_evt = pathTracer(pathtracer_k, que, d_tile, 
+				d_Spheres, d_Squares, d_Triangles, ntriangles, 
+				d_scenelights, nlights, seeds, 
+				cam_forward, cam_up, cam_right, eye_offset, 
+				tile.x, tile.y, tile.w, tile.h);
+			tile_end(&ring, &ts, &tile, que, tile_evt, tile_evt, read_que, resultInfo.data, sizeof(cl_uchar4));
+		}
+		tile_ring_finish(&ring, &ts);
+	}
+	else{
+		pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
+		d_Spheres, d_Squares, d_Triangles, ntriangles, 
+		d_scenelights, nlights, seeds, 
+		cam_forward, cam_up, cam_right, eye_offset, 
+		0, 0, resultInfo.width, resultInfo.height);
+	}
 
-	cl_event getRender_evt;
+	cl_event getRender_evt = NULL;
 	
-	resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
-		CL_MAP_READ,
-		0, resultInfo.data_size,
-		1, &pathtracer_evt, &getRender_evt, &err);
-	ocl_check(err, "enqueue map d_render");
+	if(tile_ms == 0){
+		resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
+			CL_MAP_READ,
+			0, resultInfo.data_size,
+			1, progressive ? &resolve_evt : &pathtracer_evt, &getRender_evt, &err);
+		ocl_check(err, "enqueue map d_render");
+	}
 
 	err = save_pam(imageName, &resultInfo);
 	if (err != 0) {
@@ -311,28 +635,47 @@ int main(int argc, char* argv[]){
 	}
 	else printf("\nSuccessfully created render image %s in the current directory\n\n", imageName);
 
-	double runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
-	double runtime_getRender_ms = runtime_ms(getRender_evt);
-	double total_time_ms = runtime_pathtracer_ms + runtime_getRender_ms;
+	if(!progressive) runtime_pathtracer_ms = tile_ms > 0 ? ts.render_ms : runtime_ms(pathtracer_evt);
+	double runtime_resolve_ms = progressive ? runtime_ms(resolve_evt) : 0;
+	double runtime_getRender_ms = tile_ms > 0 ? ts.read_ms : runtime_ms(getRender_evt);
+	double total_time_ms = runtime_pathtracer_ms + runtime_resolve_ms + runtime_getRender_ms;
 
 	double getRender_bw_gbs = resultInfo.data_size/1.0e6/runtime_getRender_ms;
 	double pathtracer_bw_gbs = resultInfo.data_size/1.0e6/runtime_pathtracer_ms;
 
 	printf("rendering : %d pixels in %gms: %g GB/s\n",
 		img_width*img_height, runtime_pathtracer_ms, pathtracer_bw_gbs);
+	if(progressive){
+		printf("progressive : %d samples per pixel in %d launches, %gms wall clock: %g samples/s\n",
+			total_samples, nlaunches, wall_pathtracer_ms, (double)npixels*total_samples/wall_pathtracer_ms*1.0e3);
+		printf("resolve : %d pixels in %gms: %g GB/s\n",
+			npixels, runtime_resolve_ms, (sizeof(cl_float4) + 4)*npixels/1.0e6/runtime_resolve_ms);
+	}
 	printf("read render data : %ld uchar in %gms: %g GB/s\n",
 		resultInfo.data_size, runtime_getRender_ms, getRender_bw_gbs);
+	if(tile_ms > 0) tile_report(&ts);
 	printf("\nTotal time: %g ms.\n", total_time_ms);
 
-	err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
-	ocl_check(err, "unmap render");
-	clReleaseMemObject(d_render);
+	if(tile_ms > 0){
+		free(resultInfo.data);
+		clReleaseCommandQueue(read_que);
+	}
+	else{
+		err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
+		ocl_check(err, "unmap render");
+		clReleaseMemObject(d_render);
+	}
+	if(d_accum) clReleaseMemObject(d_accum);
 
 	free(Spheres);
 	free(Squares);
-	free(Triangles);
+	clReleaseMemObject(d_Triangles);
+	if(use_scene_bin) unload_scene_bin(&scene);
+	else free(Triangles);
 
 	clReleaseKernel(pathtracer_k);
+	clReleaseKernel(progressive_k);
+	clReleaseKernel(resolve_k);
 	clReleaseProgram(prog);
 	clReleaseCommandQueue(que);
 	clReleaseContext(ctx);
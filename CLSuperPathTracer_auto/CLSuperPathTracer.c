@@ -0,0 +1,558 @@
+//More complex path tracer in OpenCL based on https://fabiensanglard.net/rayTracing_back_of_business_card/
+//Supports spheres, squares and triangles
+//Four materials (checkerboard texture, sky, diffusive, specular)
+//The scene data is placed in constant, local or global memory depending on the device (see placeScene)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#define MAX 256
+#define MAX_LIGHTS 5
+#define TRIANGLE_CHUNK 128	//Largest number of triangles per local memory chunk
+
+//Memory spaces of the scene data, as in pathtracer.ocl
+#define MEM_CONSTANT 0
+#define MEM_LOCAL 1
+#define MEM_GLOBAL 2
+
+#include "../ocl_boiler.h"
+#include "../pamalign.h"
+#include "../scenebin.h"
+#include "../specialize.h"
+#include "../tiles.h"
+
+typedef struct{
+	cl_float4 v0;
+	cl_float4 v1;
+	cl_float4 v2;
+} cl_Triangle;
+
+typedef struct{
+	cl_int scene;	//MEM_* of the sphere and square bitmasks
+	cl_int lights;
+	cl_int triangles;
+	cl_int triangle_chunk;	//Triangles per local memory chunk, with local triangles
+} ScenePlacement;
+
+cl_float4 VectorSum(cl_float4 x, cl_float4 y){
+	cl_float4 value = { .x = x.s0 + y.s0, .y = x.s1 + y.s1, .z = x.s2 + y.s2, .w = 0};
+	return value;
+}
+
+cl_float4 ScalarTimesVector(float scalar, cl_float4 x){
+	cl_float4 value = { .x = scalar * x.s0, .y = scalar * x.s1, .z = scalar * x.s2, .w = 0};
+	return value;
+}
+
+//Defined as operator% in the simple CPU tracer
+float ScalarProduct(cl_float4 x, cl_float4 y){
+	return x.s0 * y.s0 + x.s1 * y.s1 + x.s2 * y.s2;
+}
+
+//Defined as operator^ in the simple CPU tracer
+cl_float4 CrossProduct(cl_float4 x, cl_float4 y){
+	cl_float4 value = { .x = x.s1 * y.s2 - x.s2 * y.s1, .y = x.s2 * y.s0 - x.s0 * y.s2, .z = x.s0 * y.s1 - x.s1 * y.s0, .w = 0};
+	return value;
+}
+
+//Defined as operator! in the simple CPU tracer
+cl_float4 Normalize(cl_float4 x){
+	return ScalarTimesVector((1/sqrt(ScalarProduct(x, x))), x);
+}
+
+static inline uint64_t rdtsc(void)
+{
+	uint64_t val;
+	uint32_t h, l;
+    __asm__ __volatile__("rdtsc" : "=a" (l), "=d" (h));
+        val = ((uint64_t)l) | (((uint64_t)h) << 32);
+        return val;
+}
+
+//Method to retrieve spheres/squares information from file
+int parseArrayFromFile(char * fileName, cl_int * arr){
+	FILE * textFile;
+	char str[MAX];
+	int linectr = 0;
+	textFile = fopen(fileName, "r");
+	do{
+		fgets(str, MAX, textFile);
+		arr[linectr] = atoi(str);
+		linectr++;
+	}while(!feof(textFile) && linectr < 9);
+	fclose(textFile);
+	return 1;
+}
+
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
+//Method to retrieve vertices from triangles.txt
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles){
+	FILE * textFile;
+	char x[MAX], y[MAX], z[MAX];
+	int curr_triangle = 0;
+	textFile = fopen(fileName, "r");
+	while(!feof(textFile) && curr_triangle < ntriangles){
+		fgets(x, MAX, textFile);
+		fgets(y, MAX, textFile);
+		fgets(z, MAX, textFile);
+		arr[curr_triangle].v0.x = atof(x);
+		arr[curr_triangle].v0.y = atof(y);
+		arr[curr_triangle].v0.z = atof(z);
+		arr[curr_triangle].v0.w = 0.0f;
+
+		fgets(x, MAX, textFile);	//read END_VERTEX and ignore
+
+		fgets(x, MAX, textFile);
+		fgets(y, MAX, textFile);
+		fgets(z, MAX, textFile);
+		arr[curr_triangle].v1.x = atof(x);
+		arr[curr_triangle].v1.y = atof(y);
+		arr[curr_triangle].v1.z = atof(z);
+		arr[curr_triangle].v1.w = 0.0f;
+
+		fgets(x, MAX, textFile);	//read END_VERTEX and ignore
+
+		fgets(x, MAX, textFile);
+		fgets(y, MAX, textFile);
+		fgets(z, MAX, textFile);
+		arr[curr_triangle].v2.x = atof(x);
+		arr[curr_triangle].v2.y = atof(y);
+		arr[curr_triangle].v2.z = atof(z);
+		arr[curr_triangle].v2.w = 0.0f;
+
+		fgets(x, MAX, textFile);	//read END_VERTEX and ignore
+		fgets(x, MAX, textFile);	//read END_TRIANGLE and ignore
+
+		curr_triangle++;
+	}
+	fclose(textFile);
+	return curr_triangle;
+}
+
+//Method to retrieve point lights from lights.txt
+int parseLightsFromFile(char * fileName, cl_float4 * arr){
+	FILE * textFile;
+	char x[MAX], y[MAX], z[MAX], w[MAX];
+	int curr_light = 0;
+	textFile = fopen(fileName, "r");
+	while(!feof(textFile) && curr_light < MAX_LIGHTS){
+		fgets(x, MAX, textFile);
+		fgets(y, MAX, textFile);
+		fgets(z, MAX, textFile);
+		fgets(w, MAX, textFile);
+		arr[curr_light].x = atof(x);
+		arr[curr_light].y = atof(y);
+		arr[curr_light].z = atof(z);
+		arr[curr_light].w = atof(w);
+		printf("Light %d: %f %f %f %f\n", curr_light, arr[curr_light].x, arr[curr_light].y, arr[curr_light].z, arr[curr_light].w);
+		curr_light++;
+	}
+	fclose(textFile);
+	return curr_light;
+}
+
+//Memory for bytes of scene data in nargs kernel arguments, read at the same index by all the
+//work-items: constant memory (broadcast through its cache) if it fits in what is left of the constant
+//buffer, local memory if the device has it dedicated and local_bytes of it are left, global memory
+//otherwise. Copies to emulated local memory would only add barriers.
+//A forced MEM_* (-1 for none) is followed when it fits. The reason goes to why
+int placeData(size_t bytes, cl_uint nargs, size_t local_bytes, int forced,
+	cl_ulong * constant_left, cl_uint * constant_args, cl_ulong * local_left, int dedicated_local, char * why){
+	const char * const mem_names[] = { "constant", "local", "global" };
+	const int constant_ok = bytes <= *constant_left && nargs <= *constant_args;
+	const int local_ok = local_bytes <= *local_left;
+	int mem, n = 0;
+	if((forced == MEM_CONSTANT && constant_ok) || (forced == MEM_LOCAL && local_ok) || forced == MEM_GLOBAL){
+		snprintf(why, BUFSIZE, "forced by OCL_MEMORY");
+		mem = forced;
+	}
+	else{
+		if(forced >= 0)
+			n = snprintf(why, BUFSIZE, "OCL_MEMORY=%s does not fit, ", mem_names[forced]);
+		if(constant_ok){
+			snprintf(why + n, BUFSIZE - n, "%lu bytes fit in the %lu bytes of constant buffer left",
+				(unsigned long)bytes, (unsigned long)*constant_left);
+			mem = MEM_CONSTANT;
+		}
+		else if(dedicated_local && local_ok){
+			snprintf(why + n, BUFSIZE - n, "%lu bytes exceed the %lu bytes of constant buffer left, the device has dedicated local memory",
+				(unsigned long)bytes, (unsigned long)*constant_left);
+			mem = MEM_LOCAL;
+		}
+		else{
+			snprintf(why + n, BUFSIZE - n, "%lu bytes exceed the %lu bytes of constant buffer left, %s",
+				(unsigned long)bytes, (unsigned long)*constant_left,
+				dedicated_local ? "no local memory left" : "the local memory of the device is emulated in global memory");
+			mem = MEM_GLOBAL;
+		}
+	}
+	if(mem == MEM_CONSTANT){
+		*constant_left -= bytes;
+		*constant_args -= nargs;
+	}
+	else if(mem == MEM_LOCAL) *local_left -= local_bytes;
+	return mem;
+}
+
+//Choose where the bitmasks, the lights and the triangles of the scene are read from on device d,
+//the smaller first, and print the choice with its reason. Specialized kernels have the bitmasks
+//compiled in (see ../specialize.h): their arguments are left in global memory, unused.
+//OCL_MEMORY=constant|local|global in the environment forces the same memory for all of them
+void placeScene(cl_device_id d, cl_int ntriangles, cl_int nlights, int specialized, ScenePlacement * placement){
+	cl_int err;
+	cl_ulong constant_size, local_size;
+	cl_uint constant_args;
+	cl_device_local_mem_type local_type;
+	err = clGetDeviceInfo(d, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(constant_size), &constant_size, NULL);
+	ocl_check(err, "max constant buffer size");
+	err = clGetDeviceInfo(d, CL_DEVICE_MAX_CONSTANT_ARGS, sizeof(constant_args), &constant_args, NULL);
+	ocl_check(err, "max constant args");
+	err = clGetDeviceInfo(d, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_size), &local_size, NULL);
+	ocl_check(err, "local memory size");
+	err = clGetDeviceInfo(d, CL_DEVICE_LOCAL_MEM_TYPE, sizeof(local_type), &local_type, NULL);
+	ocl_check(err, "local memory type");
+	printf("Device memory: %lu bytes of constant buffer (%u arguments), %lu bytes of %s local memory\n",
+		(unsigned long)constant_size, constant_args, (unsigned long)local_size,
+		local_type == CL_LOCAL ? "dedicated" : "emulated");
+
+	const char * const mem_names[] = { "constant", "local", "global" };
+	const char * const env = getenv("OCL_MEMORY");
+	int forced = -1;
+	for(int m = MEM_CONSTANT; env && m <= MEM_GLOBAL; ++m)
+		if(strcmp(env, mem_names[m]) == 0) forced = m;
+
+	//The constant arguments share the constant buffer. The local copy of the lights is an argument
+	//of the kernel whatever their placement, that of the bitmasks only when they are local (see pathTracer):
+	//the triangles get what is left
+	const size_t scene_bytes = sizeof(cl_int)*2*9;
+	const size_t lights_bytes = sizeof(cl_float4)*nlights;
+	cl_ulong constant_left = constant_size;
+	cl_ulong local_left = local_size > lights_bytes ? local_size - lights_bytes : 0;
+	const int dedicated_local = (local_type == CL_LOCAL);
+	char why[BUFSIZE];
+
+	if(specialized){
+		placement->scene = MEM_GLOBAL;
+		printf("Spheres and squares: compiled into the program (specialized)\n");
+	}
+	else{
+		placement->scene = placeData(scene_bytes, 2, scene_bytes, forced, &constant_left, &constant_args, &local_left, dedicated_local, why);
+		printf("Spheres and squares: %s memory (%s)\n", mem_names[placement->scene], why);
+	}
+
+	placement->lights = placeData(lights_bytes, 1, 0, forced, &constant_left, &constant_args, &local_left, dedicated_local, why);
+	printf("Lights: %s memory (%s)\n", mem_names[placement->lights], why);
+
+	//Local triangles are streamed in chunks: any number of them fits, a chunk at a time
+	cl_ulong chunk = local_left/sizeof(cl_Triangle);
+	if(chunk > TRIANGLE_CHUNK) chunk = TRIANGLE_CHUNK;
+	if(chunk > (cl_ulong)ntriangles) chunk = ntriangles;
+	if(chunk == 0) chunk = 1;
+	placement->triangles = placeData(sizeof(cl_Triangle)*ntriangles, 1, sizeof(cl_Triangle)*chunk, forced, &constant_left, &constant_args, &local_left, dedicated_local, why);
+	placement->triangle_chunk = 0;
+	if(placement->triangles == MEM_LOCAL){
+		placement->triangle_chunk = chunk;
+		printf("Triangles: local memory in chunks of %d (%s)\n", placement->triangle_chunk, why);
+	}
+	else printf("Triangles: %s memory (%s)\n", mem_names[placement->triangles], why);
+}
+
+//Setting up the kernel to render the image
+cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_render, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_int scene_mem, cl_mem d_Triangles, cl_int ntriangles, cl_int triangle_chunk, 
+	cl_mem d_scenelights, cl_int nlights,
+	cl_uint4 seeds, cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, 
+	cl_float4 eye_offset, cl_int tileX, cl_int tileY, cl_int renderWidth, cl_int renderHeight){
+
+	const size_t gwo[] = { tileX, tileY };
+	const size_t gws[] = { renderWidth, renderHeight };
+
+	cl_event pathtracer_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_render), &d_render);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Spheres), &d_Spheres);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Squares), &d_Squares);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_scenelights), &d_scenelights);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(nlights), &nlights);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cam_forward), &cam_forward);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cam_up), &cam_up);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cam_right), &cam_right);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(eye_offset), &eye_offset);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(seeds), &seeds);
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_int)*(scene_mem == MEM_LOCAL ? 9 : 1) , NULL);	//lSpheres
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_int)*(scene_mem == MEM_LOCAL ? 9 : 1) , NULL);	//lSquares
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_Triangle)*(triangle_chunk > 0 ? triangle_chunk : 1) , NULL);	//lTriangles
+	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*nlights , NULL);	//lScenelights
+	ocl_check(err, "set path tracer arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, gwo, gws, NULL,
+		0, NULL, &pathtracer_evt);
+	ocl_check(err, "enqueue path tracer");
+
+	return pathtracer_evt;	
+}
+
+int main(int argc, char* argv[]){
+
+	int img_width = 512, img_height = 512;
+	printf("Usage: %s [img_width] [img_height]\nLoads data from scene.bin if present, otherwise from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
+
+	if(argc > 1){
+		img_width = atoi(argv[1]);
+	}
+	if (argc > 2){
+		img_height = atoi(argv[2]);
+	}
+
+	cl_platform_id p = select_platform();
+	cl_device_id d = select_device(p);
+	cl_context ctx = create_context(p, d);
+	cl_command_queue que = create_queue(ctx, d);
+	cl_int err;
+	
+	//seeds for the edited MWC64X
+	cl_uint4 seeds = {.x = time(0) & 134217727, .y = (getpid() * getpid() * getpid()) & 134217727, .z = (clock()*clock()) & 134217727, .w = rdtsc() & 134217727};
+
+	printf("Seeds: %d, %d, %d, %d\n", seeds.x, seeds.y, seeds.z, seeds.w);
+
+
+	const char *imageName = "result.ppm";
+	struct imgInfo resultInfo;
+	resultInfo.channels = 4;
+	resultInfo.depth = 8;
+	resultInfo.maxval = 0xff;
+	resultInfo.width = img_width;
+	resultInfo.height = img_height;	
+	resultInfo.data_size = resultInfo.width*resultInfo.height*resultInfo.channels;
+	resultInfo.data = malloc(resultInfo.data_size);
+	printf("Processing image %dx%d with data size %ld bytes\n", resultInfo.width, resultInfo.height, resultInfo.data_size);
+
+	//Big frames are rendered in tiles streamed back into resultInfo.data (see ../tiles.h)
+	const double tile_ms = tile_target_ms(d, resultInfo.data_size);
+	cl_mem d_render = NULL;
+	cl_command_queue read_que = NULL;
+	if(tile_ms > 0){
+		read_que = create_queue(ctx, d);
+	}
+	else{
+		d_render = clCreateBuffer(ctx,
+			CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+			resultInfo.data_size, NULL,
+			&err);
+		ocl_check(err, "create buffer d_render");
+	}
+	
+	cl_float4 zVect = { .x = 0, .y = 0, .z = -1, .w = 0 };
+
+	cl_float4 cam_forward = { .x = -6, .y = -16, .z = 0, .w = 0 };
+	cam_forward = Normalize(cam_forward);
+	cl_float4 cam_up = ScalarTimesVector(0.002, Normalize(CrossProduct(zVect, cam_forward)));
+	cl_float4 cam_right = ScalarTimesVector(0.002, Normalize(CrossProduct(cam_forward, cam_up)));
+
+	cl_float4 eye_offset = VectorSum(ScalarTimesVector((float)(-256), VectorSum(cam_up, cam_right)), cam_forward);
+	
+	/*
+	cl_float4 cam_up = { .x = 0.001873f, .y = -0.000702f, .z = 0.0f, .w = 0 };
+	cl_float4 cam_right = { .x = 0.0f, .y = 0.0f, .z = 0.002f, .w = 0 };
+	cl_float4 eye_offset = { .x = -0.830524f, .y = -0.756554f, .z = -0.512f, .w = 0 };
+	*/
+
+	printf("Cam values:\nCam_forward %f %f %f\nCam_up %f %f %f\nCam_right %f %f %f\n eye_offset %f %f %f\n", cam_forward.x, cam_forward.y, cam_forward.z, cam_up.x, cam_up.y, cam_up.z, cam_right.x, cam_right.y, cam_right.z, eye_offset.x, eye_offset.y, eye_offset.z);
+
+	//Point lights coordinates and intensity
+	cl_float4 * scenelights = malloc(sizeof(cl_float4)*MAX_LIGHTS);
+
+	//Geometries
+	cl_int * Spheres = malloc(sizeof(cl_int)*9);
+	cl_int * Squares = malloc(sizeof(cl_int)*9);
+	cl_Triangle * Triangles = NULL;
+	cl_int ntriangles, nlights;
+
+	//Prefer the memory-mapped binary scene (see ../SceneConverter), fall back to the text files
+	SceneFile scene;
+	const int use_scene_bin = (load_scene_bin("scene.bin", &scene) == 0);
+	if(use_scene_bin){
+		memcpy(Spheres, scene.header->Spheres, sizeof(cl_int)*9);
+		memcpy(Squares, scene.header->Squares, sizeof(cl_int)*9);
+		Triangles = scene.triangles;
+		ntriangles = scene.header->ntriangles;
+		nlights = scene.header->nlights < MAX_LIGHTS ? scene.header->nlights : MAX_LIGHTS;
+		memcpy(scenelights, scene.lights, sizeof(cl_float4)*nlights);
+	}
+	else{
+		//Size the triangles array from the file contents
+		ntriangles = countTrianglesInFile("triangles.txt");
+		Triangles = malloc(sizeof(cl_Triangle)*ntriangles);
+		parseArrayFromFile("spheres.txt", Spheres);
+		parseArrayFromFile("squares.txt", Squares);
+		ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles);
+		nlights = parseLightsFromFile("lights.txt", scenelights);
+	}
+
+	printf("Number of triangles: %d\n", ntriangles);
+	printf("Number of lights: %d\n", nlights);
+
+	//Whether the kernel is specialized on the scene is known before placing it (see ../specialize.h)
+	char defines[BUFSIZE + 1];
+	scene_defines(defines, Spheres, Squares, nlights, ntriangles);
+	const int specialized = use_specialization("pathtracer.ocl", defines);
+
+	ScenePlacement placement;
+	placeScene(d, ntriangles, nlights, specialized, &placement);
+
+	cl_mem d_Spheres = clCreateBuffer(ctx,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int)*9, Spheres,
+		&err);
+	ocl_check(err, "create buffer d_Spheres");
+
+	cl_mem d_Squares = clCreateBuffer(ctx,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int)*9, Squares,
+		&err);
+	ocl_check(err, "create buffer d_Squares");
+
+	//Triangles from scene.bin are used in place, without a copy
+	cl_mem d_Triangles = clCreateBuffer(ctx,
+		CL_MEM_READ_ONLY | (use_scene_bin ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
+		sizeof(cl_float4)*3*ntriangles, Triangles,
+		&err);
+	ocl_check(err, "create buffer d_Triangles");
+
+	cl_mem d_scenelights = clCreateBuffer(ctx,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_float4)*nlights, scenelights,
+		&err);
+	ocl_check(err, "create buffer d_scenelights");
+
+	//The kernels are built once the scene is known, specialized on it (see ../specialize.h)
+	//and with the address spaces of its placement
+	char build_options[BUFSIZE];
+	snprintf(build_options, BUFSIZE, "-DSCENE_MEM=%d -DLIGHTS_MEM=%d -DTRIANGLES_MEM=%d -DTRIANGLE_CHUNK=%d%s%s",
+		placement.scene, placement.lights, placement.triangles, placement.triangle_chunk > 0 ? placement.triangle_chunk : 1,
+		specialized ? " " : "", specialized ? defines : "");
+	cl_program prog = create_program_with_options("pathtracer.ocl", ctx, d, build_options);
+
+	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
+	ocl_check(err, "create kernel pathtracer_k");
+
+	cl_event pathtracer_evt = NULL;
+	TileScheduler ts;
+	if(tile_ms > 0){
+		//Tiles of whole 16x16 blocks, so the work-groups stay big enough for the local memory copies
+		tile_scheduler_init(&ts, img_width, img_height, 16, 16, tile_max_pixels(d, sizeof(cl_uchar4)), tile_ms);
+		TileRing ring;
+		tile_ring_init(&ring, ctx, sizeof(cl_uchar4)*ts.max_pixels);
+		Tile tile;
+		cl_mem d_tile;
+		while((d_tile = tile_begin(&ring, &ts, &tile))){
+			cl_event tile_evt = pathTracer(pathtracer_k, que, d_tile, 
+				d_Spheres, d_Squares, placement.scene, d_Triangles, ntriangles, placement.triangle_chunk, 
+				d_scenelights, nlights, seeds, 
+				cam_forward, cam_up, cam_right, eye_offset, 
+				tile.x, tile.y, tile.w, tile.h);
+			tile_end(&ring, &ts, &tile, que, tile_evt, tile_evt, read_que, resultInfo.data, sizeof(cl_uchar4));
+		}
+		tile_ring_finish(&ring, &ts);
+	}
+	else{
+		pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
+		d_Spheres, d_Squares, placement.scene, d_Triangles, ntriangles, placement.triangle_chunk, 
+		d_scenelights, nlights, seeds, 
+		cam_forward, cam_up, cam_right, eye_offset, 
+		0, 0, resultInfo.width, resultInfo.height);
+	}
+
+	cl_event getRender_evt = NULL;
+	
+	if(tile_ms == 0){
+		resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
+			CL_MAP_READ,
+			0, resultInfo.data_size,
+			1, &pathtracer_evt, &getRender_evt, &err);
+		ocl_check(err, "enqueue map d_render");
+	}
+
+	err = save_pam(imageName, &resultInfo);
+	if (err != 0) {
+		fprintf(stderr, "error writing %s\n", imageName);
+		exit(1);
+	}
+	else printf("\nSuccessfully created render image %s in the current directory\n\n", imageName);
+
+	double runtime_pathtracer_ms = tile_ms > 0 ? ts.render_ms : runtime_ms(pathtracer_evt);
+	double runtime_getRender_ms = tile_ms > 0 ? ts.read_ms : runtime_ms(getRender_evt);
+	double total_time_ms = runtime_pathtracer_ms + runtime_getRender_ms;
+
+	double getRender_bw_gbs = resultInfo.data_size/1.0e6/runtime_getRender_ms;
+	double pathtracer_bw_gbs = resultInfo.data_size/1.0e6/runtime_pathtracer_ms;
+
+	printf("rendering : %d pixels in %gms: %g GB/s\n",
+		img_width*img_height, runtime_pathtracer_ms, pathtracer_bw_gbs);
+	printf("read render data : %ld uchar in %gms: %g GB/s\n",
+		resultInfo.data_size, runtime_getRender_ms, getRender_bw_gbs);
+	if(tile_ms > 0) tile_report(&ts);
+	printf("\nTotal time: %g ms.\n", total_time_ms);
+
+	if(tile_ms > 0){
+		free(resultInfo.data);
+		clReleaseCommandQueue(read_que);
+	}
+	else{
+		err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
+		ocl_check(err, "unmap render");
+		clReleaseMemObject(d_render);
+	}
+
+	free(Spheres);
+	free(Squares);
+	clReleaseMemObject(d_Triangles);
+	if(use_scene_bin) unload_scene_bin(&scene);
+	else free(Triangles);
+	free(scenelights);
+
+	clReleaseKernel(pathtracer_k);
+	clReleaseProgram(prog);
+	clReleaseCommandQueue(que);
+	clReleaseContext(ctx);
+}
\ No newline at end of file
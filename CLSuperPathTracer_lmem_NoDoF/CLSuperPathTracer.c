@@ -12,11 +12,15 @@
 
 #define CL_TARGET_OPENCL_VERSION 120
 #define MAX 256
-#define MAX_TRIANGLES 512
 #define MAX_LIGHTS 5
+#define TRIANGLE_CHUNK 128	//Triangles per local memory chunk, unless OCL_TRIANGLE_CHUNK says otherwise
+#define MAX_TRIANGLE_CHUNKS 8
 
 #include "../ocl_boiler.h"
 #include "../pamalign.h"
+#include "../scenebin.h"
+#include "../specialize.h"
+#include "../tiles.h"
 
 typedef struct{
 	cl_float4 v0;
@@ -74,13 +78,30 @@ int parseArrayFromFile(char * fileName, cl_int * arr){
 	return 1;
 }
 
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
 //Method to retrieve vertices from triangles.txt
-int parseTrianglesFromFile(char * fileName, cl_Triangle * arr){
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles){
 	FILE * textFile;
 	char x[MAX], y[MAX], z[MAX];
 	int curr_triangle = 0;
 	textFile = fopen(fileName, "r");
-	while(!feof(textFile) && curr_triangle < MAX_TRIANGLES){
+	while(!feof(textFile) && curr_triangle < ntriangles){
 		fgets(x, MAX, textFile);
 		fgets(y, MAX, textFile);
 		fgets(z, MAX, textFile);
@@ -140,13 +161,56 @@ int parseLightsFromFile(char * fileName, cl_float4 * arr){
 	return curr_light;
 }
 
-//Setting up the kernel to render the image
+//Chunk sizes from OCL_TRIANGLE_CHUNK, a comma-separated list of triangles per local memory chunk,
+//0 reading them from global memory: with more than one the frame is rendered with each, to compare them.
+//Chunks are limited to max_chunk triangles. Returns how many sizes
+int parseTriangleChunks(cl_int * chunks, cl_int max_chunk){
+	const char * env = getenv("OCL_TRIANGLE_CHUNK");
+	int nchunks = 0;
+	if(!env || env[0] == '\0') chunks[nchunks++] = TRIANGLE_CHUNK;
+	else while(nchunks < MAX_TRIANGLE_CHUNKS){
+		chunks[nchunks++] = atoi(env);
+		env = strchr(env, ',');
+		if(!env) break;
+		++env;
+	}
+	for(int c = 0; c < nchunks; ++c){
+		if(chunks[c] < 0) chunks[c] = 0;
+		if(chunks[c] > max_chunk){
+			printf("Triangle chunk of %d too big for local memory: reducing to %d\n", chunks[c], max_chunk);
+			chunks[c] = max_chunk;
+		}
+	}
+	return nchunks;
+}
+
+//Rendering time of the frame with each chunk size, against the triangles from global memory when measured
+void triangleChunksReport(const cl_int * chunks, const double * chunk_ms, int nchunks, int npixels, size_t render_bytes){
+	if(nchunks < 2) return;
+	double global_ms = 0;
+	for(int c = 0; c < nchunks; ++c)
+		if(chunks[c] == 0) global_ms = chunk_ms[c];
+	for(int c = 0; c < nchunks; ++c){
+		if(chunks[c] == 0)
+			printf("triangles from global memory : %d pixels in %gms: %g GB/s\n",
+				npixels, chunk_ms[c], render_bytes/1.0e6/chunk_ms[c]);
+		else if(global_ms > 0)
+			printf("triangle chunks of %d : %d pixels in %gms: %g GB/s, %.2fx speedup over global memory\n",
+				chunks[c], npixels, chunk_ms[c], render_bytes/1.0e6/chunk_ms[c], global_ms/chunk_ms[c]);
+		else
+			printf("triangle chunks of %d : %d pixels in %gms: %g GB/s\n",
+				chunks[c], npixels, chunk_ms[c], render_bytes/1.0e6/chunk_ms[c]);
+	}
+}
+
+//Setting up the kernel to render the image, or the renderWidth x renderHeight tile at tileX, tileY
 cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_temprender,
-	cl_mem d_Spheres, cl_mem d_Planes, cl_mem d_Triangles, cl_int ntriangles, 
+	cl_mem d_Spheres, cl_mem d_Planes, cl_mem d_Triangles, cl_int ntriangles, cl_int triangle_chunk, 
 	cl_mem d_scenelights, cl_int nlights,
 	cl_uint4 seeds, cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, 
-	cl_float4 eye_offset, cl_int renderWidth, cl_int renderHeight){
+	cl_float4 eye_offset, cl_int tileX, cl_int tileY, cl_int renderWidth, cl_int renderHeight){
 
+	const size_t gwo[] = { tileX*8, tileY*8 };
 	const size_t gws[] = { renderWidth*8, renderHeight*8 };
 
 	cl_event pathtracer_evt;
@@ -181,12 +245,12 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_tempr
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_int)*9 , NULL);	//lPlanes
 	ocl_check(err, "set path tracer arg %d", i-1);
-	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_Triangle)*ntriangles , NULL);	//lTriangles
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_Triangle)*(triangle_chunk > 0 ? triangle_chunk : 1) , NULL);	//lTriangles
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*nlights , NULL);	//lScenelights
 	ocl_check(err, "set path tracer arg %d", i-1);
 
-	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, NULL, gws, NULL,
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, gwo, gws, NULL,
 		0, NULL, &pathtracer_evt);
 	ocl_check(err, "enqueue path tracer");
 
@@ -220,7 +284,7 @@ int main(int argc, char* argv[]){
 
 	int img_width = 512, img_height = 512;
 	const int samplesPerPixel = 64;
-	printf("Usage: %s [img_width] [img_height]\nLoads data from triangles.txt, lights.txt, spheres.txt and planes.txt", argv[0]);
+	printf("Usage: %s [img_width] [img_height]\nLoads data from scene.bin if present, otherwise from triangles.txt, lights.txt, spheres.txt and planes.txt", argv[0]);
 
 	if(argc > 1){
 		img_width = atoi(argv[1]);
@@ -233,23 +297,13 @@ int main(int argc, char* argv[]){
 	cl_device_id d = select_device(p);
 	cl_context ctx = create_context(p, d);
 	cl_command_queue que = create_queue(ctx, d);
-	cl_program prog = create_program("pathtracer.ocl", ctx, d);
 	cl_int err;
-
-	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
-	ocl_check(err, "create kernel pathtracer_k");
-	cl_kernel reduceimg_k = clCreateKernel(prog, "reduce4img_lmem", &err);
-	ocl_check(err, "create kernel reduceimg_k");
 	
 	//seeds for the edited MWC64X
 	cl_uint4 seeds = {.x = time(0) & 134217727, .y = (getpid() * getpid() * getpid()) & 134217727, .z = (clock()*clock()) & 134217727, .w = rdtsc() & 134217727};
 
 	printf("Seeds: %d, %d, %d, %d\n", seeds.x, seeds.y, seeds.z, seeds.w);
 
-	size_t lws_max;
-	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
-		sizeof(lws_max), &lws_max, NULL);
-	ocl_check(err, "Max lws for pathtracer");
 
 	const char *imageName = "result.ppm";
 	struct imgInfo resultInfo;
@@ -262,17 +316,34 @@ int main(int argc, char* argv[]){
 	resultInfo.data = malloc(resultInfo.data_size);
 	printf("Processing image %dx%d with data size %ld bytes\n", resultInfo.width, resultInfo.height, resultInfo.data_size);
 
+	//Big frames are rendered in tiles streamed back into resultInfo.data (see ../tiles.h)
+	//The temp render, 64 float4 for each pixel, is what has to fit on the device
+	const double tile_ms = tile_target_ms(d, resultInfo.data_size*samplesPerPixel*sizeof(float));
+	TileScheduler ts;
+	cl_mem d_render = NULL;
+	cl_command_queue read_que = NULL;
+	size_t temprender_size = resultInfo.data_size*samplesPerPixel*sizeof(float);
+	if(tile_ms > 0){
+		//Tiles of whole 2x2 pixel blocks, 16x16 samples, so the work-groups stay big enough for the local memory copies
+		tile_scheduler_init(&ts, img_width, img_height, 2, 2, tile_max_pixels(d, sizeof(cl_float4)*samplesPerPixel), tile_ms);
+		//The temp render is shared by all the tiles: the queue is in order
+		temprender_size = sizeof(cl_float4)*samplesPerPixel*ts.max_pixels;
+		read_que = create_queue(ctx, d);
+	}
+
 	cl_mem d_temprender = clCreateBuffer(ctx,	//Temp render with 64 float4 for each pixel
 		CL_MEM_READ_WRITE,
-		resultInfo.data_size*samplesPerPixel*sizeof(float), NULL,
+		temprender_size, NULL,
 		&err);
 	ocl_check(err, "create buffer d_temprender");
 
-	cl_mem d_render = clCreateBuffer(ctx,
-		CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		resultInfo.data_size, NULL,
-		&err);
-	ocl_check(err, "create buffer d_render");
+	if(tile_ms == 0){
+		d_render = clCreateBuffer(ctx,
+			CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+			resultInfo.data_size, NULL,
+			&err);
+		ocl_check(err, "create buffer d_render");
+	}
 	
 	cl_float4 zVect = { .x = 0, .y = 0, .z = -1, .w = 0 };
 
@@ -297,22 +368,42 @@ int main(int argc, char* argv[]){
 	//Geometries
 	cl_int * Spheres = malloc(sizeof(cl_int)*9);
 	cl_int * Planes = malloc(sizeof(cl_int)*9);
-	cl_Triangle * Triangles = malloc(sizeof(cl_float4)*3*MAX_TRIANGLES);
-
-	parseArrayFromFile("spheres.txt", Spheres);
-	parseArrayFromFile("planes.txt", Planes);
-	
-	cl_int ntriangles = parseTrianglesFromFile("triangles.txt", Triangles);
-	if(ntriangles > lws_max){
-		printf("Too many triangles for local memory: reducing from %d to to %ld\n", ntriangles, lws_max);
-		ntriangles = lws_max;
+	cl_Triangle * Triangles = NULL;
+	cl_int ntriangles, nlights;
+
+	//Prefer the memory-mapped binary scene (see ../SceneConverter), fall back to the text files
+	SceneFile scene;
+	const int use_scene_bin = (load_scene_bin("scene.bin", &scene) == 0);
+	if(use_scene_bin){
+		memcpy(Spheres, scene.header->Spheres, sizeof(cl_int)*9);
+		memcpy(Planes, scene.header->Squares, sizeof(cl_int)*9);
+		Triangles = scene.triangles;
+		ntriangles = scene.header->ntriangles;
+		nlights = scene.header->nlights < MAX_LIGHTS ? scene.header->nlights : MAX_LIGHTS;
+		memcpy(scenelights, scene.lights, sizeof(cl_float4)*nlights);
+	}
+	else{
+		//Size the triangles array from the file contents
+		ntriangles = countTrianglesInFile("triangles.txt");
+		Triangles = malloc(sizeof(cl_Triangle)*ntriangles);
+		parseArrayFromFile("spheres.txt", Spheres);
+		parseArrayFromFile("planes.txt", Planes);
+		ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles);
+		nlights = parseLightsFromFile("lights.txt", scenelights);
 	}
-
-	cl_int nlights = parseLightsFromFile("lights.txt", scenelights);
 
 	printf("Number of triangles: %d\n", ntriangles);
 	printf("Number of lights: %d\n", nlights);
 
+	//The triangles are streamed through local memory in chunks, whatever their number:
+	//a chunk gets the local memory left by the bitmasks and the lights
+	cl_ulong local_mem_size;
+	err = clGetDeviceInfo(d, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL);
+	ocl_check(err, "local memory size");
+	cl_int triangle_chunks[MAX_TRIANGLE_CHUNKS];
+	const int ntriangle_chunks = parseTriangleChunks(triangle_chunks,
+		(local_mem_size - sizeof(cl_int)*2*9 - sizeof(cl_float4)*nlights)/sizeof(cl_Triangle));
+
 	cl_mem d_Spheres = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 		sizeof(cl_int)*9, Spheres,
@@ -325,8 +416,9 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_Planes");
 
+	//Triangles from scene.bin are used in place, without a copy
 	cl_mem d_Triangles = clCreateBuffer(ctx,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		CL_MEM_READ_ONLY | (use_scene_bin ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
 		sizeof(cl_float4)*3*ntriangles, Triangles,
 		&err);
 	ocl_check(err, "create buffer d_Triangles");
@@ -337,22 +429,79 @@ int main(int argc, char* argv[]){
 		&err);
 	ocl_check(err, "create buffer d_scenelights");
 
-	cl_event pathtracer_evt = pathTracer(pathtracer_k, que, d_temprender, 
-	d_Spheres, d_Planes, d_Triangles, ntriangles, 
-	d_scenelights, nlights, seeds, 
-	cam_forward, cam_up, cam_right, eye_offset, 
-	resultInfo.width, resultInfo.height);
-
-	cl_event reduceimg_evt = reduceimg(reduceimg_k, que, d_temprender, 
-	d_render, resultInfo.width, resultInfo.height, pathtracer_evt);
+	//The frame is rendered once per chunk size, the image kept is the one of the last
+	cl_program prog = NULL;
+	cl_kernel pathtracer_k = NULL, reduceimg_k = NULL;
+	cl_event pathtracer_evt = NULL, reduceimg_evt = NULL;
+	double runtime_pathtracer_ms = 0, runtime_reduceimg_ms = 0;
+	double triangle_chunk_ms[MAX_TRIANGLE_CHUNKS];
+	for(int c = 0; c < ntriangle_chunks; ++c){
+		if(c > 0){
+			if(tile_ms == 0){
+				clReleaseEvent(pathtracer_evt);
+				clReleaseEvent(reduceimg_evt);
+			}
+			else tile_scheduler_init(&ts, img_width, img_height, 2, 2, ts.max_pixels, tile_ms);
+			clReleaseKernel(pathtracer_k);
+			clReleaseKernel(reduceimg_k);
+			clReleaseProgram(prog);
+		}
+		//The kernels are built once the scene is known, specialized on it (see ../specialize.h)
+		char build_options[BUFSIZE];
+		snprintf(build_options, BUFSIZE, "-DTRIANGLE_CHUNK=%d", triangle_chunks[c]);
+		prog = create_program_specialized("pathtracer.ocl", ctx, d, build_options, Spheres, Planes, nlights, ntriangles);
+
+		pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
+		ocl_check(err, "create kernel pathtracer_k");
+		reduceimg_k = clCreateKernel(prog, "reduce4img_lmem", &err);
+		ocl_check(err, "create kernel reduceimg_k");
+
+		if(tile_ms > 0){
+			TileRing ring;
+			tile_ring_init(&ring, ctx, sizeof(cl_uchar4)*ts.max_pixels);
+			Tile tile;
+			cl_mem d_tile;
+			while((d_tile = tile_begin(&ring, &ts, &tile))){
+				cl_event tile_evt = pathTracer(pathtracer_k, que, d_temprender, 
+					d_Spheres, d_Planes, d_Triangles, ntriangles, triangle_chunks[c], 
+					d_scenelights, nlights, seeds, 
+					cam_forward, cam_up, cam_right, eye_offset, 
+					tile.x, tile.y, tile.w, tile.h);
+				cl_event reduce_evt = reduceimg(reduceimg_k, que, d_temprender, 
+					d_tile, tile.w, tile.h, tile_evt);
+				tile_end(&ring, &ts, &tile, que, tile_evt, reduce_evt, read_que, resultInfo.data, sizeof(cl_uchar4));
+			}
+			tile_ring_finish(&ring, &ts);
+			//Tiles are timed from the path tracer to the reduction
+			runtime_pathtracer_ms = ts.render_ms;
+		}
+		else{
+			pathtracer_evt = pathTracer(pathtracer_k, que, d_temprender, 
+			d_Spheres, d_Planes, d_Triangles, ntriangles, triangle_chunks[c], 
+			d_scenelights, nlights, seeds, 
+			cam_forward, cam_up, cam_right, eye_offset, 
+			0, 0, resultInfo.width, resultInfo.height);
+
+			reduceimg_evt = reduceimg(reduceimg_k, que, d_temprender, 
+			d_render, resultInfo.width, resultInfo.height, pathtracer_evt);
+			err = clWaitForEvents(1, &pathtracer_evt);
+			ocl_check(err, "wait path tracer");
+			runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
+		}
+		triangle_chunk_ms[c] = runtime_pathtracer_ms;
+	}
 
-	cl_event getRender_evt;
+	cl_event getRender_evt = NULL;
 	
-	resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
-		CL_MAP_READ,
-		0, resultInfo.data_size,
-		1, &reduceimg_evt, &getRender_evt, &err);
-	ocl_check(err, "enqueue map d_render");
+	if(tile_ms == 0){
+		resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
+			CL_MAP_READ,
+			0, resultInfo.data_size,
+			1, &reduceimg_evt, &getRender_evt, &err);
+		ocl_check(err, "enqueue map d_render");
+		runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
+		runtime_reduceimg_ms = runtime_ms(reduceimg_evt);
+	}
 
 	err = save_pam(imageName, &resultInfo);
 	if (err != 0) {
@@ -361,9 +510,7 @@ int main(int argc, char* argv[]){
 	}
 	else printf("\nSuccessfully created render image %s in the current directory\n\n", imageName);
 
-	double runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
-	double runtime_reduceimg_ms = runtime_ms(reduceimg_evt);
-	double runtime_getRender_ms = runtime_ms(getRender_evt);
+	double runtime_getRender_ms = tile_ms > 0 ? ts.read_ms : runtime_ms(getRender_evt);
 	double total_time_ms = runtime_pathtracer_ms + runtime_reduceimg_ms + runtime_getRender_ms;
 
 	double pathtracer_bw_gbs = resultInfo.data_size*samplesPerPixel*sizeof(float)/1.0e6/runtime_pathtracer_ms;
@@ -372,19 +519,30 @@ int main(int argc, char* argv[]){
 
 	printf("rendering : %d pixels (with %d samples) in %gms: %g GB/s\n",
 		img_width*img_height, samplesPerPixel, runtime_pathtracer_ms, pathtracer_bw_gbs);
-	printf("reduce img samples : %d pixels (with %d samples) in %gms: %g GB/s\n",
+	if(tile_ms == 0) printf("reduce img samples : %d pixels (with %d samples) in %gms: %g GB/s\n",
 		img_width*img_height, samplesPerPixel, runtime_reduceimg_ms, reduceimg_bw_gbs);
 	printf("read render data : %ld uchar in %gms: %g GB/s\n",
 		resultInfo.data_size, runtime_getRender_ms, getRender_bw_gbs);
+	if(tile_ms > 0) tile_report(&ts);
+	triangleChunksReport(triangle_chunks, triangle_chunk_ms, ntriangle_chunks, img_width*img_height, resultInfo.data_size*samplesPerPixel*sizeof(float));
 	printf("\nTotal time: %g ms.\n", total_time_ms);
 
-	err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
-	ocl_check(err, "unmap render");
-	clReleaseMemObject(d_render);
+	if(tile_ms > 0){
+		free(resultInfo.data);
+		clReleaseCommandQueue(read_que);
+	}
+	else{
+		err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
+		ocl_check(err, "unmap render");
+		clReleaseMemObject(d_render);
+	}
+	clReleaseMemObject(d_temprender);
 
 	free(Spheres);
 	free(Planes);
-	free(Triangles);
+	clReleaseMemObject(d_Triangles);
+	if(use_scene_bin) unload_scene_bin(&scene);
+	else free(Triangles);
 	free(scenelights);
 
 	clReleaseKernel(pathtracer_k);
@@ -12,12 +12,30 @@
 
 #define CL_TARGET_OPENCL_VERSION 120
 #define MAX 256
-#define MAX_TRIANGLES 65536
 #define MAX_LIGHTS 5
-#define MAX_NELS_PER_CELL 62 //Should be a power of two minus two for better alignment
 
 #include "../ocl_boiler.h"
 #include "../pamalign.h"
+#include "../scenebin.h"
+#include "../bvh.h"
+#include "../specialize.h"
+#include "../tiles.h"
+
+#define RADIX_BITS 4	//Must match pathtracer.ocl
+#define RADIX_BLOCK 16
+#define LBVH_STACK_SIZE 64	//A Karras tree over 30 bit codes (ties broken by 32 bit indices) is at most 64 levels deep
+#define SAMPLES 64	//Must match pathtracer.ocl
+#define MAX_BOUNCES 5
+#define PERSISTENT_LWS 64	//Pixels fetched per batch by a work-group of pathTracerPersistent
+#define PERSISTENT_GROUPS_PER_CU 4	//Resident work-groups per compute unit, enough to hide the latency of the batch fetches
+#define WAVEFRONT_LWS 64	//At least 9, the wavefront tracing kernels copy the scene bitmasks to local memory
+#define WAVEFRONT_HITS 0	//Queue counters, must match pathtracer.ocl
+#define WAVEFRONT_SHADOWS 1
+#define WAVEFRONT_RAYS 2
+#define WAVEFRONT_COHERENT 3
+#define WAVEFRONT_COUNTERS 4
+#define PRIMITIVE_SPHERE 0	//Must match pathtracer.ocl
+#define PRIMITIVE_QUAD 1
 
 typedef struct{
 	cl_float4 v0;
@@ -30,10 +48,39 @@ typedef struct{
 	cl_float4 vmax;
 } cl_Box;
 
+//Sphere or axis-aligned quad of the primitive lists, see pathtracer.ocl
 typedef struct{
-	cl_uint nels;
-	cl_ushort elem_index[MAX_NELS_PER_CELL];
-} cl_Cell;
+	cl_float4 center;	//w: radius of a sphere
+	cl_float4 half_size;	//Half extents of a quad, 0 along its normal
+	cl_int type;
+	cl_int pad[3];
+} cl_Primitive;
+
+//Wavefront path and shadow ray, see pathtracer.ocl
+typedef struct{
+	cl_float4 origin;
+	cl_float4 direction;
+	cl_float4 normal;
+	cl_float4 colorFact;
+	cl_float4 light_dir;
+	cl_uint2 rng_x, rng_c;
+	cl_float t;
+	cl_float illumination;
+	cl_int material;
+	cl_int divFact;
+	cl_uint first_shadow;
+	cl_uint nshadows;
+	cl_int pad[2];
+} cl_PathState;
+
+typedef struct{
+	cl_float4 origin;
+	cl_float4 direction;
+	cl_float tmax;
+	cl_float contribution;
+	cl_uint path;
+	cl_int pad;
+} cl_ShadowRay;
 
 int max(int x, int y){
 	if(x > y) return x;
@@ -131,9 +178,26 @@ int parseArrayFromFile(char * fileName, cl_int * arr){
 	return 1;
 }
 
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
 //Method to retrieve vertices from triangles.txt
 //Also computes the min and max positions for the bounding box that contains all the triangles
-int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, cl_Box * trianglesBox){
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles, cl_Box * trianglesBox){
 	FILE * textFile;
 	char x[MAX], y[MAX], z[MAX];
 	int curr_triangle = 0;
@@ -141,7 +205,7 @@ int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, cl_Box * triangle
 	cl_float4 curr_max = { .x = CL_FLT_MIN, .y = CL_FLT_MIN, .z = CL_FLT_MIN, .w = 0};
 	cl_float4 curr_min = { .x = CL_FLT_MAX, .y = CL_FLT_MAX, .z = CL_FLT_MAX, .w = 0};
 	textFile = fopen(fileName, "r");
-	while(!feof(textFile) && curr_triangle < MAX_TRIANGLES){
+	while(!feof(textFile) && curr_triangle < ntriangles){
 		fgets(x, MAX, textFile);
 		fgets(y, MAX, textFile);
 		fgets(z, MAX, textFile);
@@ -230,104 +294,474 @@ int parseLightsFromFile(char * fileName, cl_float4 * arr){
 	return curr_light;
 }
 
-void initTrianglesGrid_host(cl_Cell * TrianglesGrid, cl_Triangle * Triangles, cl_int4 grid_res, cl_float4 cell_size, cl_Box trianglesBox, cl_int ntriangles){
-	cl_int4 unitVec = { .x = 1, .y = 1, .z = 1, .w = 0};
-	cl_int4 zeroVec = { .x = 0, .y = 0, .z = 0, .w = 0};
-	for(int curr_triangle=0; curr_triangle < ntriangles; ++curr_triangle){
-		const cl_Triangle t = Triangles[curr_triangle];
-		//Compute triangle bounding box
-		cl_float4 fmin = { .x = CL_FLT_MAX, .y = CL_FLT_MAX, .z = CL_FLT_MAX, .w = 0};
-		cl_float4 fmax = { .x = CL_FLT_MIN, .y = CL_FLT_MIN, .z = CL_FLT_MIN, .w = 0};
-		for (int k = 0; k < 3; ++k){
-			if (t.v0.s[k] < fmin.s[k]) fmin.s[k] = t.v0.s[k];
-			if (t.v1.s[k] < fmin.s[k]) fmin.s[k] = t.v1.s[k];
-			if (t.v2.s[k] < fmin.s[k]) fmin.s[k] = t.v2.s[k];
-
-			if (t.v0.s[k] > fmax.s[k]) fmax.s[k] = t.v0.s[k];
-			if (t.v1.s[k] > fmax.s[k]) fmax.s[k] = t.v1.s[k];
-			if (t.v2.s[k] > fmax.s[k]) fmax.s[k] = t.v2.s[k];
+//Method to retrieve spheres and quads from primitives.txt, one per line:
+//"sphere x y z radius" or "quad x y z hx hy hz" with the half extents of the quad, 0 along its normal
+//Returns the number of primitives in *arr, 0 without the file
+int parsePrimitivesFromFile(char * fileName, cl_Primitive ** arr){
+	FILE * textFile;
+	char str[MAX], type[MAX];
+	int nprimitives = 0;
+	*arr = NULL;
+	textFile = fopen(fileName, "r");
+	if(!textFile) return 0;
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') nprimitives++;
+	}
+	*arr = malloc(sizeof(cl_Primitive)*nprimitives);
+	rewind(textFile);
+	int curr_primitive = 0;
+	while(curr_primitive < nprimitives && fgets(str, MAX, textFile)){
+		cl_Primitive * p = *arr + curr_primitive;
+		memset(p, 0, sizeof(*p));
+		float x, y, z, a, b, c;
+		const int n = sscanf(str, "%s %f %f %f %f %f %f", type, &x, &y, &z, &a, &b, &c);
+		if(n == 5 && strcmp(type, "sphere") == 0){
+			p->type = PRIMITIVE_SPHERE;
+			p->center = (cl_float4){ .x = x, .y = y, .z = z, .w = a };
+		}
+		else if(n == 7 && strcmp(type, "quad") == 0){
+			p->type = PRIMITIVE_QUAD;
+			p->center = (cl_float4){ .x = x, .y = y, .z = z, .w = 0 };
+			p->half_size = (cl_float4){ .x = a, .y = b, .z = c, .w = 0 };
 		}
-		//Convert to cell coordinates
-		fmin = VectorDivision(VectorDifference(fmin, trianglesBox.vmin), cell_size);
-		fmax = VectorDivision(VectorDifference(fmax, trianglesBox.vmin), cell_size);
-		const cl_int4 min = clampVec(convert_int4(fmin), zeroVec, VectorDifferenceInt(grid_res, unitVec));
-		const cl_int4 max = clampVec(convert_int4(fmax), zeroVec, VectorDifferenceInt(grid_res, unitVec));
-		for(int z = min.z; z <= max.z; ++z){
-			for(int y = min.y; y <= max.y; ++y){
-				for(int x = min.x; x <= max.x; ++x){
-					const int index = z*grid_res.x*grid_res.y + y*grid_res.x + x;
-					if (TrianglesGrid[index].nels == MAX_NELS_PER_CELL) continue;
-					TrianglesGrid[index].elem_index[TrianglesGrid[index].nels++] = curr_triangle;
-				}
+		else continue;
+		curr_primitive++;
+	}
+	fclose(textFile);
+	return curr_primitive;
+}
+
+//Move the spheres and squares of the bitmasks to the primitive lists, from arr[0] on, and clear the bitmasks
+//Returns the number of primitives added
+int bitmaskPrimitives(cl_int * Spheres, cl_int * Squares, cl_Primitive * arr){
+	int nprimitives = 0;
+	for(int j = 0; j < 9; ++j){
+		for(int k = 0; k < 19; ++k){
+			const cl_float4 center = { .x = k, .y = 0, .z = j + 4, .w = 0 };
+			if(Spheres[j] & 1 << k){
+				memset(arr + nprimitives, 0, sizeof(cl_Primitive));
+				arr[nprimitives].type = PRIMITIVE_SPHERE;
+				arr[nprimitives].center = center;
+				arr[nprimitives].center.w = 1;
+				nprimitives++;
+			}
+			if(Squares[j] & 1 << k){
+				memset(arr + nprimitives, 0, sizeof(cl_Primitive));
+				arr[nprimitives].type = PRIMITIVE_QUAD;
+				arr[nprimitives].center = center;
+				arr[nprimitives].half_size = (cl_float4){ .x = 1, .y = 1, .z = 0, .w = 0 };
+				nprimitives++;
 			}
 		}
+		Spheres[j] = Squares[j] = 0;
+	}
+	return nprimitives;
+}
+
+//Triangle standing for a primitive in the grid and BVH builds: its bounds are those of the primitive
+//and its centroid is the center of the primitive
+cl_Triangle primitiveBounds(const cl_Primitive p){
+	const cl_float4 half = p.type == PRIMITIVE_SPHERE ?
+		(cl_float4){ .x = p.center.w, .y = p.center.w, .z = p.center.w, .w = 0 } : p.half_size;
+	const cl_float4 center = { .x = p.center.x, .y = p.center.y, .z = p.center.z, .w = 0 };
+	cl_Triangle t = { .v0 = VectorDifference(center, half), .v1 = VectorSum(center, half), .v2 = center };
+	return t;
+}
+
+//Range of cells overlapped by the bounding box of a triangle
+void triangleCells_host(const cl_Triangle t, cl_int4 grid_res, cl_float4 cell_size, cl_Box trianglesBox, cl_int4 * min, cl_int4 * max){
+	cl_int4 unitVec = { .x = 1, .y = 1, .z = 1, .w = 0};
+	cl_int4 zeroVec = { .x = 0, .y = 0, .z = 0, .w = 0};
+	//Compute triangle bounding box
+	cl_float4 fmin = { .x = CL_FLT_MAX, .y = CL_FLT_MAX, .z = CL_FLT_MAX, .w = 0};
+	cl_float4 fmax = { .x = -CL_FLT_MAX, .y = -CL_FLT_MAX, .z = -CL_FLT_MAX, .w = 0};
+	for (int k = 0; k < 3; ++k){
+		if (t.v0.s[k] < fmin.s[k]) fmin.s[k] = t.v0.s[k];
+		if (t.v1.s[k] < fmin.s[k]) fmin.s[k] = t.v1.s[k];
+		if (t.v2.s[k] < fmin.s[k]) fmin.s[k] = t.v2.s[k];
+
+		if (t.v0.s[k] > fmax.s[k]) fmax.s[k] = t.v0.s[k];
+		if (t.v1.s[k] > fmax.s[k]) fmax.s[k] = t.v1.s[k];
+		if (t.v2.s[k] > fmax.s[k]) fmax.s[k] = t.v2.s[k];
+	}
+	//Convert to cell coordinates
+	fmin = VectorDivision(VectorDifference(fmin, trianglesBox.vmin), cell_size);
+	fmax = VectorDivision(VectorDifference(fmax, trianglesBox.vmin), cell_size);
+	*min = clampVec(convert_int4(fmin), zeroVec, VectorDifferenceInt(grid_res, unitVec));
+	*max = clampVec(convert_int4(fmax), zeroVec, VectorDifferenceInt(grid_res, unitVec));
+}
+
+//Host version of the count/scan/scatter grid build (32 bit indices)
+//CellOffsets must hold ncells+1 zeroed elements, returns the cell triangle indices
+cl_uint * initTrianglesGrid_host(cl_uint * CellOffsets, cl_Triangle * Triangles, cl_int4 grid_res, cl_float4 cell_size, cl_Box trianglesBox, cl_int ntriangles){
+	const int ncells = grid_res.x*grid_res.y*grid_res.z;
+	cl_int4 min, max;
+	for(int curr_triangle=0; curr_triangle < ntriangles; ++curr_triangle){
+		triangleCells_host(Triangles[curr_triangle], grid_res, cell_size, trianglesBox, &min, &max);
+		for(int z = min.z; z <= max.z; ++z)
+			for(int y = min.y; y <= max.y; ++y)
+				for(int x = min.x; x <= max.x; ++x)
+					CellOffsets[z*grid_res.x*grid_res.y + y*grid_res.x + x]++;
 	}
+	cl_uint sum = 0;
+	for(int c = 0; c <= ncells; ++c){
+		const cl_uint count = CellOffsets[c];
+		CellOffsets[c] = sum;
+		sum += count;
+	}
+	cl_uint * CellCursor = malloc(sizeof(cl_uint)*ncells);
+	memcpy(CellCursor, CellOffsets, sizeof(cl_uint)*ncells);
+	cl_uint * CellTriangles = malloc(sizeof(cl_uint)*(sum > 0 ? sum : 1));
+	for(int curr_triangle=0; curr_triangle < ntriangles; ++curr_triangle){
+		triangleCells_host(Triangles[curr_triangle], grid_res, cell_size, trianglesBox, &min, &max);
+		for(int z = min.z; z <= max.z; ++z)
+			for(int y = min.y; y <= max.y; ++y)
+				for(int x = min.x; x <= max.x; ++x)
+					CellTriangles[CellCursor[z*grid_res.x*grid_res.y + y*grid_res.x + x]++] = curr_triangle;
+	}
+	free(CellCursor);
+	return CellTriangles;
 }
 
-void printTrianglesGrid_host(cl_Cell * TrianglesGrid, cl_int4 grid_res){
-	int nels_count = 0;
+void printTrianglesGrid_host(cl_uint * CellOffsets, cl_uint * CellTriangles, cl_int4 grid_res){
 	int max_nels = 0;
 	for(int k=0; k<grid_res.x*grid_res.y*grid_res.z; ++k){
-		for(int i=0; i<TrianglesGrid[k].nels; ++i){
-			printf("Cell %d, triangle index %hu, nels %d\n", k, TrianglesGrid[k].elem_index[i], TrianglesGrid[k].nels);
+		const int nels = CellOffsets[k+1] - CellOffsets[k];
+		for(cl_uint i=CellOffsets[k]; i<CellOffsets[k+1]; ++i){
+			printf("Cell %d, triangle index %u, nels %d\n", k, CellTriangles[i], nels);
 		}
-		nels_count += TrianglesGrid[k].nels;
-		if (TrianglesGrid[k].nels > max_nels) max_nels = TrianglesGrid[k].nels;
+		if (nels > max_nels) max_nels = nels;
+	}
+	printf("Total nels in grid (with duplicates): %u\nMax nels: %d\n", CellOffsets[grid_res.x*grid_res.y*grid_res.z], max_nels);
+}
+
+//Grid build, first pass: count the triangles overlapping each cell
+cl_event countTrianglesGrid(cl_kernel countTrianglesGrid_k, cl_command_queue que, cl_mem d_CellCounts, cl_mem d_Triangles, cl_float4 trianglesBoxMin, cl_int4 grid_res, cl_float4 cell_size, cl_int ntriangles, cl_event prev_evt){
+
+	const size_t gws[] = { ntriangles };
+	
+	cl_event countTrianglesGrid_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(countTrianglesGrid_k, i++, sizeof(d_CellCounts), &d_CellCounts);
+	ocl_check(err, "set countTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(countTrianglesGrid_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set countTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(countTrianglesGrid_k, i++, sizeof(trianglesBoxMin), &trianglesBoxMin);
+	ocl_check(err, "set countTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(countTrianglesGrid_k, i++, sizeof(grid_res), &grid_res);
+	ocl_check(err, "set countTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(countTrianglesGrid_k, i++, sizeof(cell_size), &cell_size);
+	ocl_check(err, "set countTrianglesGrid arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, countTrianglesGrid_k, 1, NULL, gws, NULL,
+		1, &prev_evt, &countTrianglesGrid_evt);
+	ocl_check(err, "enqueue countTrianglesGrid");
+
+	return countTrianglesGrid_evt;
+}
+
+//Grid build, second pass: exclusive scan of nels uints from d_in to d_out (can be the same buffer)
+//Every work-group scans lws_ elements, the work-group totals are scanned recursively and added back
+//first_evt (if not NULL) receives the first enqueued event, for timing
+cl_event scanGrid(cl_kernel scan_k, cl_kernel scan_fixup_k, cl_command_queue que, cl_context ctx,
+	cl_mem d_out, cl_mem d_in, cl_int nels, size_t lws_, cl_event prev_evt, cl_event * first_evt){
+
+	const cl_int nwg = round_mul_up(nels, lws_)/lws_;
+	const size_t gws[] = { nwg*lws_ };
+	const size_t lws[] = { lws_ };
+
+	cl_event scan_evt, fixup_evt;
+	cl_int err;
+
+	cl_mem d_tails = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_uint)*nwg, NULL,
+		&err);
+	ocl_check(err, "create buffer d_tails");
+
+	cl_uint i = 0;
+	err = clSetKernelArg(scan_k, i++, sizeof(d_out), &d_out);
+	ocl_check(err, "set scan arg %d", i-1);
+	err = clSetKernelArg(scan_k, i++, sizeof(d_in), &d_in);
+	ocl_check(err, "set scan arg %d", i-1);
+	err = clSetKernelArg(scan_k, i++, sizeof(d_tails), &d_tails);
+	ocl_check(err, "set scan arg %d", i-1);
+	err = clSetKernelArg(scan_k, i++, sizeof(cl_uint)*lws[0], NULL);
+	ocl_check(err, "set scan arg %d", i-1);
+	err = clSetKernelArg(scan_k, i++, sizeof(nels), &nels);
+	ocl_check(err, "set scan arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, scan_k, 1, NULL, gws, lws,
+		1, &prev_evt, &scan_evt);
+	ocl_check(err, "enqueue scan");
+	if (first_evt) *first_evt = scan_evt;
+
+	if (nwg == 1){
+		clReleaseMemObject(d_tails);
+		return scan_evt;
 	}
-	printf("Total nels in grid (with duplicates): %d\nMax nels: %d\n", nels_count, max_nels);
+
+	//Scan the work-group totals in place, then add them to each work-group
+	cl_event tails_evt = scanGrid(scan_k, scan_fixup_k, que, ctx, d_tails, d_tails, nwg, lws_, scan_evt, NULL);
+
+	i = 0;
+	err = clSetKernelArg(scan_fixup_k, i++, sizeof(d_out), &d_out);
+	ocl_check(err, "set scan fixup arg %d", i-1);
+	err = clSetKernelArg(scan_fixup_k, i++, sizeof(d_tails), &d_tails);
+	ocl_check(err, "set scan fixup arg %d", i-1);
+	err = clSetKernelArg(scan_fixup_k, i++, sizeof(nels), &nels);
+	ocl_check(err, "set scan fixup arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, scan_fixup_k, 1, NULL, gws, lws,
+		1, &tails_evt, &fixup_evt);
+	ocl_check(err, "enqueue scan fixup");
+
+	//Released once the enqueued commands using them are done
+	clReleaseMemObject(d_tails);
+	clReleaseEvent(tails_evt);
+	if (!first_evt) clReleaseEvent(scan_evt);
+	return fixup_evt;
 }
 
-cl_event initTrianglesGrid_device(cl_kernel initTrianglesGrid_k, cl_command_queue que, cl_mem d_TrianglesGrid, cl_mem d_Triangles, cl_float4 trianglesBoxMin, cl_int4 grid_res, cl_float4 cell_size, cl_int ntriangles){
+//Grid build, third pass: scatter the triangle indices, d_CellCursor must hold a copy of the cell offsets
+cl_event scatterTrianglesGrid(cl_kernel scatterTrianglesGrid_k, cl_command_queue que, cl_mem d_CellTriangles, cl_mem d_CellCursor, cl_mem d_Triangles, cl_float4 trianglesBoxMin, cl_int4 grid_res, cl_float4 cell_size, cl_int ntriangles, cl_event prev_evt){
 
 	const size_t gws[] = { ntriangles };
 	
-	cl_event initTrianglesGrid_evt;
+	cl_event scatterTrianglesGrid_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(scatterTrianglesGrid_k, i++, sizeof(d_CellTriangles), &d_CellTriangles);
+	ocl_check(err, "set scatterTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(scatterTrianglesGrid_k, i++, sizeof(d_CellCursor), &d_CellCursor);
+	ocl_check(err, "set scatterTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(scatterTrianglesGrid_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set scatterTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(scatterTrianglesGrid_k, i++, sizeof(trianglesBoxMin), &trianglesBoxMin);
+	ocl_check(err, "set scatterTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(scatterTrianglesGrid_k, i++, sizeof(grid_res), &grid_res);
+	ocl_check(err, "set scatterTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(scatterTrianglesGrid_k, i++, sizeof(cell_size), &cell_size);
+	ocl_check(err, "set scatterTrianglesGrid arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, scatterTrianglesGrid_k, 1, NULL, gws, NULL,
+		1, &prev_evt, &scatterTrianglesGrid_evt);
+	ocl_check(err, "enqueue scatterTrianglesGrid");
+
+	return scatterTrianglesGrid_evt;
+}
+
+//LBVH build, first pass: Morton codes of the triangle centroids in the scene box, and the identity permutation
+cl_event computeMortonCodes(cl_kernel computeMortonCodes_k, cl_command_queue que, cl_mem d_codes, cl_mem d_indices, cl_mem d_Triangles, cl_Box trianglesBox, cl_int ntriangles){
+
+	const size_t gws[] = { ntriangles };
+
+	cl_event computeMortonCodes_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(computeMortonCodes_k, i++, sizeof(d_codes), &d_codes);
+	ocl_check(err, "set computeMortonCodes arg %d", i-1);
+	err = clSetKernelArg(computeMortonCodes_k, i++, sizeof(d_indices), &d_indices);
+	ocl_check(err, "set computeMortonCodes arg %d", i-1);
+	err = clSetKernelArg(computeMortonCodes_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set computeMortonCodes arg %d", i-1);
+	err = clSetKernelArg(computeMortonCodes_k, i++, sizeof(trianglesBox), &trianglesBox);
+	ocl_check(err, "set computeMortonCodes arg %d", i-1);
+	err = clSetKernelArg(computeMortonCodes_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set computeMortonCodes arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, computeMortonCodes_k, 1, NULL, gws, NULL,
+		0, NULL, &computeMortonCodes_evt);
+	ocl_check(err, "enqueue computeMortonCodes");
+
+	return computeMortonCodes_evt;
+}
+
+//LBVH build, second pass (and wavefront ray sorting): LSD radix sort of the codes (d_keys[0]) and triangle indices (d_values[0]),
+//RADIX_BITS per pass, ping-ponging with d_keys[1] and d_values[1]: the sorted arrays end up in d_keys[0] and d_values[0]
+//Every pass counts the digits of each block, scans the counts with scanGrid and scatters
+//first_evt receives the first enqueued event, for timing
+cl_event radixSort(cl_kernel radixCount_k, cl_kernel radixScatter_k, cl_kernel scan_k, cl_kernel scan_fixup_k,
+	cl_command_queue que, cl_context ctx, cl_mem d_keys[2], cl_mem d_values[2], cl_int nkeys, size_t scan_lws,
+	cl_event prev_evt, cl_event * first_evt){
+
+	const cl_int nitems = round_mul_up(nkeys, RADIX_BLOCK)/RADIX_BLOCK;
+	const cl_int nhist = nitems << RADIX_BITS;
+	const size_t gws[] = { nitems };
+
+	cl_int err;
+
+	cl_mem d_Hist = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_uint)*nhist, NULL,
+		&err);
+	ocl_check(err, "create buffer d_Hist");
+
+	cl_event sort_evt = prev_evt;
+	for (cl_int shift = 0, src = 0; shift < 32; shift += RADIX_BITS, src ^= 1){
+		cl_event count_evt, scan_evt;
+
+		cl_uint i = 0;
+		err = clSetKernelArg(radixCount_k, i++, sizeof(d_Hist), &d_Hist);
+		ocl_check(err, "set radixCount arg %d", i-1);
+		err = clSetKernelArg(radixCount_k, i++, sizeof(d_keys[src]), &d_keys[src]);
+		ocl_check(err, "set radixCount arg %d", i-1);
+		err = clSetKernelArg(radixCount_k, i++, sizeof(nkeys), &nkeys);
+		ocl_check(err, "set radixCount arg %d", i-1);
+		err = clSetKernelArg(radixCount_k, i++, sizeof(shift), &shift);
+		ocl_check(err, "set radixCount arg %d", i-1);
+
+		err = clEnqueueNDRangeKernel(que, radixCount_k, 1, NULL, gws, NULL,
+			1, &sort_evt, &count_evt);
+		ocl_check(err, "enqueue radixCount");
+		if (shift == 0 && first_evt) *first_evt = count_evt;
+
+		scan_evt = scanGrid(scan_k, scan_fixup_k, que, ctx, d_Hist, d_Hist, nhist, scan_lws, count_evt, NULL);
+		if (!(shift == 0 && first_evt)) clReleaseEvent(count_evt);
+
+		i = 0;
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(d_keys[src^1]), &d_keys[src^1]);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(d_values[src^1]), &d_values[src^1]);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(d_keys[src]), &d_keys[src]);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(d_values[src]), &d_values[src]);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(d_Hist), &d_Hist);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(nkeys), &nkeys);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+		err = clSetKernelArg(radixScatter_k, i++, sizeof(shift), &shift);
+		ocl_check(err, "set radixScatter arg %d", i-1);
+
+		cl_event scatter_evt;
+		err = clEnqueueNDRangeKernel(que, radixScatter_k, 1, NULL, gws, NULL,
+			1, &scan_evt, &scatter_evt);
+		ocl_check(err, "enqueue radixScatter");
+		//The wavefront integrator sorts every bounce: only the first and last events are kept
+		clReleaseEvent(scan_evt);
+		if (sort_evt != prev_evt) clReleaseEvent(sort_evt);
+		sort_evt = scatter_evt;
+	}
+
+	//Released once the enqueued commands using it are done
+	clReleaseMemObject(d_Hist);
+	return sort_evt;
+}
+
+//LBVH build, third pass: one work-item per inner node finds its children (Karras) and sets the parent links
+cl_event buildLBVHHierarchy(cl_kernel buildLBVHHierarchy_k, cl_command_queue que, cl_mem d_BVHNodes, cl_mem d_parents, cl_mem d_codes, cl_int ntriangles, cl_event prev_evt){
+
+	const size_t gws[] = { ntriangles - 1 };
+
+	cl_event buildLBVHHierarchy_evt;
 	cl_int err;
 
 	cl_uint i = 0;
-	err = clSetKernelArg(initTrianglesGrid_k, i++, sizeof(d_TrianglesGrid), &d_TrianglesGrid);
-	ocl_check(err, "set initTrianglesGrid arg %d", i-1);
-	err = clSetKernelArg(initTrianglesGrid_k, i++, sizeof(d_Triangles), &d_Triangles);
-	ocl_check(err, "set initTrianglesGrid arg %d", i-1);
-	err = clSetKernelArg(initTrianglesGrid_k, i++, sizeof(trianglesBoxMin), &trianglesBoxMin);
-	ocl_check(err, "set initTrianglesGrid arg %d", i-1);
-	err = clSetKernelArg(initTrianglesGrid_k, i++, sizeof(grid_res), &grid_res);
-	ocl_check(err, "set initTrianglesGrid arg %d", i-1);
-	err = clSetKernelArg(initTrianglesGrid_k, i++, sizeof(cell_size), &cell_size);
-	ocl_check(err, "set initTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(buildLBVHHierarchy_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set buildLBVHHierarchy arg %d", i-1);
+	err = clSetKernelArg(buildLBVHHierarchy_k, i++, sizeof(d_parents), &d_parents);
+	ocl_check(err, "set buildLBVHHierarchy arg %d", i-1);
+	err = clSetKernelArg(buildLBVHHierarchy_k, i++, sizeof(d_codes), &d_codes);
+	ocl_check(err, "set buildLBVHHierarchy arg %d", i-1);
+	err = clSetKernelArg(buildLBVHHierarchy_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set buildLBVHHierarchy arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, buildLBVHHierarchy_k, 1, NULL, gws, NULL,
+		1, &prev_evt, &buildLBVHHierarchy_evt);
+	ocl_check(err, "enqueue buildLBVHHierarchy");
+
+	return buildLBVHHierarchy_evt;
+}
 
-	err = clEnqueueNDRangeKernel(que, initTrianglesGrid_k, 1, NULL, gws, NULL,
-		0, NULL, &initTrianglesGrid_evt);
-	ocl_check(err, "enqueue initTrianglesGrid");
+//LBVH build, fourth pass: fit the leaves and propagate the bounds to the root, d_flags must hold ntriangles-1 zeros
+cl_event fitLBVHBounds(cl_kernel fitLBVHBounds_k, cl_command_queue que, cl_mem d_BVHNodes, cl_mem d_parents, cl_mem d_flags, cl_mem d_indices, cl_mem d_Triangles, cl_int ntriangles, cl_event prev_evt){
 
-	return initTrianglesGrid_evt;	
+	const size_t gws[] = { ntriangles };
+
+	cl_event fitLBVHBounds_evt;
+	cl_int err;
 
+	cl_uint i = 0;
+	err = clSetKernelArg(fitLBVHBounds_k, i++, sizeof(d_BVHNodes), &d_BVHNodes);
+	ocl_check(err, "set fitLBVHBounds arg %d", i-1);
+	err = clSetKernelArg(fitLBVHBounds_k, i++, sizeof(d_parents), &d_parents);
+	ocl_check(err, "set fitLBVHBounds arg %d", i-1);
+	err = clSetKernelArg(fitLBVHBounds_k, i++, sizeof(d_flags), &d_flags);
+	ocl_check(err, "set fitLBVHBounds arg %d", i-1);
+	err = clSetKernelArg(fitLBVHBounds_k, i++, sizeof(d_indices), &d_indices);
+	ocl_check(err, "set fitLBVHBounds arg %d", i-1);
+	err = clSetKernelArg(fitLBVHBounds_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set fitLBVHBounds arg %d", i-1);
+	err = clSetKernelArg(fitLBVHBounds_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set fitLBVHBounds arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, fitLBVHBounds_k, 1, NULL, gws, NULL,
+		1, &prev_evt, &fitLBVHBounds_evt);
+	ocl_check(err, "enqueue fitLBVHBounds");
+
+	return fitLBVHBounds_evt;
 }
 
-cl_event printTrianglesGrid(cl_kernel printTrianglesGrid_k, cl_command_queue que, cl_mem d_TrianglesGrid, cl_int4 grid_res, cl_event initTrianglesGrid_evt){
-	const size_t gws[] = { grid_res.x*grid_res.y*grid_res.z };
+cl_event printTrianglesGrid(cl_kernel printTrianglesGrid_k, cl_command_queue que, cl_mem d_CellOffsets, cl_mem d_CellTriangles, cl_int ncells, cl_event TrianglesGrid_evt){
+	const size_t gws[] = { ncells };
 	cl_event printTrianglesGrid_evt;
 	cl_int err;
 
 	cl_uint i = 0;
-	err = clSetKernelArg(printTrianglesGrid_k, i++, sizeof(d_TrianglesGrid), &d_TrianglesGrid);
+	err = clSetKernelArg(printTrianglesGrid_k, i++, sizeof(d_CellOffsets), &d_CellOffsets);
+	ocl_check(err, "set printTrianglesGrid arg %d", i-1);
+	err = clSetKernelArg(printTrianglesGrid_k, i++, sizeof(d_CellTriangles), &d_CellTriangles);
 	ocl_check(err, "set printTrianglesGrid arg %d", i-1);
 
 	err = clEnqueueNDRangeKernel(que, printTrianglesGrid_k, 1, NULL, gws, NULL,
-		1, &initTrianglesGrid_evt, &printTrianglesGrid_evt);
+		TrianglesGrid_evt ? 1 : 0, TrianglesGrid_evt ? &TrianglesGrid_evt : NULL, &printTrianglesGrid_evt);
 	ocl_check(err, "enqueue printTrianglesGrid");
 
 	return printTrianglesGrid_evt;
 }
 
+//Pack the triangles in the precomputed layout of the traversal (see TRIANGLE_LAYOUT in pathtracer.ocl)
+cl_event precomputeTriangles(cl_kernel precomputeTriangles_k, cl_command_queue que, cl_mem d_TriangleData, cl_mem d_Triangles, cl_int ntriangles, cl_Box trianglesBox){
+
+	const size_t gws[] = { ntriangles };
+
+	cl_event precomputeTriangles_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(precomputeTriangles_k, i++, sizeof(d_TriangleData), &d_TriangleData);
+	ocl_check(err, "set precomputeTriangles arg %d", i-1);
+	err = clSetKernelArg(precomputeTriangles_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set precomputeTriangles arg %d", i-1);
+	err = clSetKernelArg(precomputeTriangles_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set precomputeTriangles arg %d", i-1);
+	err = clSetKernelArg(precomputeTriangles_k, i++, sizeof(trianglesBox), &trianglesBox);
+	ocl_check(err, "set precomputeTriangles arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, precomputeTriangles_k, 1, NULL, gws, NULL,
+		0, NULL, &precomputeTriangles_evt);
+	ocl_check(err, "enqueue precomputeTriangles");
+
+	return precomputeTriangles_evt;
+}
+
 //Setting up the kernel to render the image
+//d_Accel and d_AccelIndices are the cell offsets and triangle indices of the grid,
+//or the nodes and triangle indices of the BVH (host or LBVH) if use_bvh (grid_res and cell_size are then unused)
 cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_render, 
 	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles,
-	cl_Box trianglesBox, cl_mem d_TriangleGrid, cl_int4 grid_res, cl_float4 cell_size,
-	cl_mem d_scenelights, cl_int nlights,
+	cl_Box trianglesBox, int use_bvh, cl_mem d_Accel, cl_mem d_AccelIndices, cl_int4 grid_res, cl_float4 cell_size,
+	cl_mem d_Primitives, cl_mem d_scenelights, cl_int nlights,
 	cl_uint4 seeds, cl_float4 cam_forward, cl_float4 cam_up, cl_float4 cam_right, 
-	cl_float4 eye_offset, cl_int renderWidth, cl_int renderHeight, cl_event TrianglesGrid_evt){
+	cl_float4 eye_offset, cl_mem d_nrays, cl_int tileX, cl_int tileY, cl_int renderWidth, cl_int renderHeight, cl_event TrianglesGrid_evt){
 
+	const size_t gwo[] = { tileX, tileY };
 	const size_t gws[] = { renderWidth, renderHeight };
 
 	cl_event pathtracer_evt;
@@ -346,11 +780,17 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(trianglesBox), &trianglesBox);
 	ocl_check(err, "set path tracer arg %d", i-1);
-	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_TriangleGrid), &d_TriangleGrid);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Accel), &d_Accel);
 	ocl_check(err, "set path tracer arg %d", i-1);
-	err = clSetKernelArg(pathtracer_k, i++, sizeof(grid_res), &grid_res);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_AccelIndices), &d_AccelIndices);
 	ocl_check(err, "set path tracer arg %d", i-1);
-	err = clSetKernelArg(pathtracer_k, i++, sizeof(cell_size), &cell_size);
+	if(!use_bvh){
+		err = clSetKernelArg(pathtracer_k, i++, sizeof(grid_res), &grid_res);
+		ocl_check(err, "set path tracer arg %d", i-1);
+		err = clSetKernelArg(pathtracer_k, i++, sizeof(cell_size), &cell_size);
+		ocl_check(err, "set path tracer arg %d", i-1);
+	}
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Primitives), &d_Primitives);
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_scenelights), &d_scenelights);
 	ocl_check(err, "set path tracer arg %d", i-1);
@@ -372,19 +812,622 @@ cl_event pathTracer(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_rende
 	ocl_check(err, "set path tracer arg %d", i-1);
 	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*nlights , NULL);	//lScenelights
 	ocl_check(err, "set path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_nrays), &d_nrays);
+	ocl_check(err, "set path tracer arg %d", i-1);
 
-	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, NULL, gws, NULL,
-		1, &TrianglesGrid_evt, &pathtracer_evt);
+	//TrianglesGrid_evt is NULL when the grid was loaded prebuilt from scene.bin
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 2, gwo, gws, NULL,
+		TrianglesGrid_evt ? 1 : 0, TrianglesGrid_evt ? &TrianglesGrid_evt : NULL, &pathtracer_evt);
 	ocl_check(err, "enqueue path tracer");
 
 	return pathtracer_evt;	
 }
 
+//Persistent threads: ngroups 1D work-groups of lws work-items render the frame in batches of lws pixels
+//taken from d_next_pixel, which must be zero
+cl_event pathTracerPersistent(cl_kernel pathtracer_k, cl_command_queue que, cl_mem d_render, 
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles,
+	cl_Box trianglesBox, int use_bvh, cl_mem d_Accel, cl_mem d_AccelIndices, cl_int4 grid_res, cl_float4 cell_size,
+	cl_mem d_Primitives, cl_mem d_scenelights, cl_int nlights,
+	cl_uint4 seeds, cl_float4 cam_up, cl_float4 cam_right, 
+	cl_float4 eye_offset, cl_mem d_nrays, cl_mem d_next_pixel, cl_int renderWidth, cl_int renderHeight,
+	size_t ngroups, size_t lws_, cl_event prev_evt){
+
+	const size_t gws[] = { ngroups*lws_ };
+	const size_t lws[] = { lws_ };
+
+	cl_event pathtracer_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_render), &d_render);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Spheres), &d_Spheres);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Squares), &d_Squares);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(trianglesBox), &trianglesBox);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Accel), &d_Accel);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_AccelIndices), &d_AccelIndices);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	if(!use_bvh){
+		err = clSetKernelArg(pathtracer_k, i++, sizeof(grid_res), &grid_res);
+		ocl_check(err, "set persistent path tracer arg %d", i-1);
+		err = clSetKernelArg(pathtracer_k, i++, sizeof(cell_size), &cell_size);
+		ocl_check(err, "set persistent path tracer arg %d", i-1);
+	}
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_Primitives), &d_Primitives);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_scenelights), &d_scenelights);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(nlights), &nlights);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cam_up), &cam_up);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cam_right), &cam_right);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(eye_offset), &eye_offset);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(seeds), &seeds);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_int)*9 , NULL);	//lSpheres
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_int)*9 , NULL);	//lSquares
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(cl_float4)*nlights , NULL);	//lScenelights
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_nrays), &d_nrays);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(d_next_pixel), &d_next_pixel);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(renderWidth), &renderWidth);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+	err = clSetKernelArg(pathtracer_k, i++, sizeof(renderHeight), &renderHeight);
+	ocl_check(err, "set persistent path tracer arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, pathtracer_k, 1, NULL, gws, lws,
+		prev_evt ? 1 : 0, prev_evt ? &prev_evt : NULL, &pathtracer_evt);
+	ocl_check(err, "enqueue persistent path tracer");
+
+	return pathtracer_evt;
+}
+
+//Wavefront integrator (see pathtracer.ocl): stage kernels, path and queue buffers, statistics
+typedef struct{
+	cl_kernel generate_k, extend_k, shade_k, shadow_k, accumulate_k, resolve_k;
+	cl_kernel keys_k, coherence_k, radixCount_k, radixScatter_k, scan_k, scan_fixup_k;
+	cl_context ctx;
+	size_t scan_lws;
+	int sort_rays;	//Sort the rays of every bounce after the first (computeRayKeys)
+	cl_mem d_paths;
+	cl_mem d_rays[2];	//Ray queues of the current and next bounce
+	cl_mem d_hits, d_shadows, d_counters, d_accum;
+	cl_mem d_keys[2], d_sort_values;	//Ray keys and the radix sort ping-pong buffers
+	cl_uint npaths;
+	//Summed over all the launches
+	double generate_ms, extend_ms, shade_ms, shadow_ms, accumulate_ms, resolve_ms, counters_ms;
+	double keys_ms, sort_ms, coherence_ms;
+	cl_ulong nrays, nhits, nshadows;
+	cl_int nbounces;
+	//Per bounce depth
+	double depth_extend_ms[MAX_BOUNCES];
+	cl_ulong depth_rays[MAX_BOUNCES], depth_pairs[MAX_BOUNCES], depth_coherent[MAX_BOUNCES];
+} Wavefront;
+
+void initWavefront(Wavefront * wf, cl_program prog, cl_context ctx, cl_device_id d, cl_uint npaths, cl_int nlights, int sort_rays){
+	cl_int err;
+	memset(wf, 0, sizeof(*wf));
+	wf->npaths = npaths;
+	wf->ctx = ctx;
+	wf->sort_rays = sort_rays;
+
+	wf->generate_k = clCreateKernel(prog, "wavefrontGenerate", &err);
+	ocl_check(err, "create kernel wavefrontGenerate");
+	wf->extend_k = clCreateKernel(prog, "wavefrontExtend", &err);
+	ocl_check(err, "create kernel wavefrontExtend");
+	wf->shade_k = clCreateKernel(prog, "wavefrontShade", &err);
+	ocl_check(err, "create kernel wavefrontShade");
+	wf->shadow_k = clCreateKernel(prog, "wavefrontShadow", &err);
+	ocl_check(err, "create kernel wavefrontShadow");
+	wf->accumulate_k = clCreateKernel(prog, "wavefrontAccumulate", &err);
+	ocl_check(err, "create kernel wavefrontAccumulate");
+	wf->resolve_k = clCreateKernel(prog, "wavefrontResolve", &err);
+	ocl_check(err, "create kernel wavefrontResolve");
+	wf->keys_k = clCreateKernel(prog, "computeRayKeys", &err);
+	ocl_check(err, "create kernel computeRayKeys");
+	wf->coherence_k = clCreateKernel(prog, "rayCoherence", &err);
+	ocl_check(err, "create kernel rayCoherence");
+	wf->radixCount_k = clCreateKernel(prog, "radixCount", &err);
+	ocl_check(err, "create kernel radixCount");
+	wf->radixScatter_k = clCreateKernel(prog, "radixScatter", &err);
+	ocl_check(err, "create kernel radixScatter");
+	wf->scan_k = clCreateKernel(prog, "scan_lmem", &err);
+	ocl_check(err, "create kernel scan_lmem");
+	wf->scan_fixup_k = clCreateKernel(prog, "scan_fixup", &err);
+	ocl_check(err, "create kernel scan_fixup");
+	err = clGetKernelWorkGroupInfo(wf->scan_k, d, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(wf->scan_lws), &wf->scan_lws, NULL);
+	ocl_check(err, "Max lws for scan");
+
+	wf->d_paths = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_PathState)*npaths, NULL,
+		&err);
+	ocl_check(err, "create buffer d_paths");
+	for(int k=0; k<2; ++k){
+		wf->d_rays[k] = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint)*npaths, NULL,
+			&err);
+		ocl_check(err, "create buffer d_rays[%d]", k);
+	}
+	wf->d_hits = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_uint)*npaths, NULL,
+		&err);
+	ocl_check(err, "create buffer d_hits");
+	//At most one shadow ray per light and hit
+	wf->d_shadows = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_ShadowRay)*npaths*max(nlights, 1), NULL,
+		&err);
+	ocl_check(err, "create buffer d_shadows");
+	wf->d_counters = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_uint)*WAVEFRONT_COUNTERS, NULL,
+		&err);
+	ocl_check(err, "create buffer d_counters");
+	wf->d_accum = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_float4)*npaths, NULL,
+		&err);
+	ocl_check(err, "create buffer d_accum");
+	for(int k=0; k<2; ++k){
+		wf->d_keys[k] = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint)*npaths, NULL,
+			&err);
+		ocl_check(err, "create buffer d_keys[%d]", k);
+	}
+	wf->d_sort_values = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_uint)*npaths, NULL,
+		&err);
+	ocl_check(err, "create buffer d_sort_values");
+}
+
+void releaseWavefront(Wavefront * wf){
+	clReleaseMemObject(wf->d_sort_values);
+	clReleaseMemObject(wf->d_keys[1]);
+	clReleaseMemObject(wf->d_keys[0]);
+	clReleaseMemObject(wf->d_accum);
+	clReleaseMemObject(wf->d_counters);
+	clReleaseMemObject(wf->d_shadows);
+	clReleaseMemObject(wf->d_hits);
+	clReleaseMemObject(wf->d_rays[1]);
+	clReleaseMemObject(wf->d_rays[0]);
+	clReleaseMemObject(wf->d_paths);
+	clReleaseKernel(wf->resolve_k);
+	clReleaseKernel(wf->accumulate_k);
+	clReleaseKernel(wf->shadow_k);
+	clReleaseKernel(wf->shade_k);
+	clReleaseKernel(wf->extend_k);
+	clReleaseKernel(wf->generate_k);
+	clReleaseKernel(wf->scan_fixup_k);
+	clReleaseKernel(wf->scan_k);
+	clReleaseKernel(wf->radixScatter_k);
+	clReleaseKernel(wf->radixCount_k);
+	clReleaseKernel(wf->coherence_k);
+	clReleaseKernel(wf->keys_k);
+}
+
+//Queue sizes only known on the device are covered by their upper bound n, the kernels check the counters
+size_t wavefrontGws(cl_uint n){
+	return round_mul_up(n > 0 ? n : 1, WAVEFRONT_LWS);
+}
+
+//Scene arguments of the tracing kernels (extend and shadow), from argument i on
+void setTraceArgs(cl_kernel k, cl_uint i, const char * name,
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles,
+	cl_Box trianglesBox, int use_bvh, cl_mem d_Accel, cl_mem d_AccelIndices, cl_int4 grid_res, cl_float4 cell_size,
+	cl_mem d_Primitives){
+	cl_int err;
+	err = clSetKernelArg(k, i++, sizeof(d_Spheres), &d_Spheres);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(d_Squares), &d_Squares);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(d_Triangles), &d_Triangles);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(ntriangles), &ntriangles);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(trianglesBox), &trianglesBox);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(d_Accel), &d_Accel);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(d_AccelIndices), &d_AccelIndices);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	if(!use_bvh){
+		err = clSetKernelArg(k, i++, sizeof(grid_res), &grid_res);
+		ocl_check(err, "set %s arg %d", name, i-1);
+		err = clSetKernelArg(k, i++, sizeof(cell_size), &cell_size);
+		ocl_check(err, "set %s arg %d", name, i-1);
+	}
+	err = clSetKernelArg(k, i++, sizeof(d_Primitives), &d_Primitives);
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(cl_int)*9 , NULL);	//lSpheres
+	ocl_check(err, "set %s arg %d", name, i-1);
+	err = clSetKernelArg(k, i++, sizeof(cl_int)*9 , NULL);	//lSquares
+	ocl_check(err, "set %s arg %d", name, i-1);
+}
+
+cl_event wavefrontGenerate(Wavefront * wf, cl_command_queue que, cl_float4 cam_up, cl_float4 cam_right,
+	cl_float4 eye_offset, cl_uint4 seeds, cl_int renderWidth, cl_int first_sample, cl_event prev_evt){
+
+	const size_t gws[] = { wavefrontGws(wf->npaths) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event generate_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(wf->d_paths), &wf->d_paths);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(wf->d_rays[0]), &wf->d_rays[0]);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(wf->d_accum), &wf->d_accum);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(cam_up), &cam_up);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(cam_right), &cam_right);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(eye_offset), &eye_offset);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(seeds), &seeds);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(renderWidth), &renderWidth);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(wf->npaths), &wf->npaths);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+	err = clSetKernelArg(wf->generate_k, i++, sizeof(first_sample), &first_sample);
+	ocl_check(err, "set wavefrontGenerate arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, wf->generate_k, 1, NULL, gws, lws,
+		prev_evt ? 1 : 0, prev_evt ? &prev_evt : NULL, &generate_evt);
+	ocl_check(err, "enqueue wavefrontGenerate");
+
+	return generate_evt;
+}
+
+cl_event wavefrontExtend(Wavefront * wf, cl_command_queue que, cl_mem d_rays, cl_uint nrays,
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles,
+	cl_Box trianglesBox, int use_bvh, cl_mem d_Accel, cl_mem d_AccelIndices, cl_int4 grid_res, cl_float4 cell_size,
+	cl_mem d_Primitives){
+
+	const size_t gws[] = { wavefrontGws(nrays) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event extend_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->extend_k, i++, sizeof(wf->d_paths), &wf->d_paths);
+	ocl_check(err, "set wavefrontExtend arg %d", i-1);
+	err = clSetKernelArg(wf->extend_k, i++, sizeof(wf->d_accum), &wf->d_accum);
+	ocl_check(err, "set wavefrontExtend arg %d", i-1);
+	err = clSetKernelArg(wf->extend_k, i++, sizeof(wf->d_counters), &wf->d_counters);
+	ocl_check(err, "set wavefrontExtend arg %d", i-1);
+	err = clSetKernelArg(wf->extend_k, i++, sizeof(wf->d_hits), &wf->d_hits);
+	ocl_check(err, "set wavefrontExtend arg %d", i-1);
+	err = clSetKernelArg(wf->extend_k, i++, sizeof(d_rays), &d_rays);
+	ocl_check(err, "set wavefrontExtend arg %d", i-1);
+	err = clSetKernelArg(wf->extend_k, i++, sizeof(nrays), &nrays);
+	ocl_check(err, "set wavefrontExtend arg %d", i-1);
+	setTraceArgs(wf->extend_k, i, "wavefrontExtend", d_Spheres, d_Squares, d_Triangles, ntriangles,
+		trianglesBox, use_bvh, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives);
+
+	err = clEnqueueNDRangeKernel(que, wf->extend_k, 1, NULL, gws, lws,
+		0, NULL, &extend_evt);
+	ocl_check(err, "enqueue wavefrontExtend");
+
+	return extend_evt;
+}
+
+//Launched on nrays work-items, the hits are at most the extended rays
+cl_event wavefrontShade(Wavefront * wf, cl_command_queue que, cl_uint nrays, cl_mem d_scenelights, cl_int nlights){
+
+	const size_t gws[] = { wavefrontGws(nrays) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event shade_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->shade_k, i++, sizeof(wf->d_paths), &wf->d_paths);
+	ocl_check(err, "set wavefrontShade arg %d", i-1);
+	err = clSetKernelArg(wf->shade_k, i++, sizeof(wf->d_counters), &wf->d_counters);
+	ocl_check(err, "set wavefrontShade arg %d", i-1);
+	err = clSetKernelArg(wf->shade_k, i++, sizeof(wf->d_hits), &wf->d_hits);
+	ocl_check(err, "set wavefrontShade arg %d", i-1);
+	err = clSetKernelArg(wf->shade_k, i++, sizeof(wf->d_shadows), &wf->d_shadows);
+	ocl_check(err, "set wavefrontShade arg %d", i-1);
+	err = clSetKernelArg(wf->shade_k, i++, sizeof(d_scenelights), &d_scenelights);
+	ocl_check(err, "set wavefrontShade arg %d", i-1);
+	err = clSetKernelArg(wf->shade_k, i++, sizeof(nlights), &nlights);
+	ocl_check(err, "set wavefrontShade arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, wf->shade_k, 1, NULL, gws, lws,
+		0, NULL, &shade_evt);
+	ocl_check(err, "enqueue wavefrontShade");
+
+	return shade_evt;
+}
+
+//Launched on nrays*nlights work-items, the most shadow rays the hits can have
+cl_event wavefrontShadow(Wavefront * wf, cl_command_queue que, cl_uint nrays, cl_int nlights,
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles,
+	cl_Box trianglesBox, int use_bvh, cl_mem d_Accel, cl_mem d_AccelIndices, cl_int4 grid_res, cl_float4 cell_size,
+	cl_mem d_Primitives){
+
+	const size_t gws[] = { wavefrontGws(nrays*nlights) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event shadow_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->shadow_k, i++, sizeof(wf->d_shadows), &wf->d_shadows);
+	ocl_check(err, "set wavefrontShadow arg %d", i-1);
+	err = clSetKernelArg(wf->shadow_k, i++, sizeof(wf->d_counters), &wf->d_counters);
+	ocl_check(err, "set wavefrontShadow arg %d", i-1);
+	setTraceArgs(wf->shadow_k, i, "wavefrontShadow", d_Spheres, d_Squares, d_Triangles, ntriangles,
+		trianglesBox, use_bvh, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives);
+
+	err = clEnqueueNDRangeKernel(que, wf->shadow_k, 1, NULL, gws, lws,
+		0, NULL, &shadow_evt);
+	ocl_check(err, "enqueue wavefrontShadow");
+
+	return shadow_evt;
+}
+
+cl_event wavefrontAccumulate(Wavefront * wf, cl_command_queue que, cl_uint nrays, cl_mem d_next_rays){
+
+	const size_t gws[] = { wavefrontGws(nrays) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event accumulate_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->accumulate_k, i++, sizeof(wf->d_paths), &wf->d_paths);
+	ocl_check(err, "set wavefrontAccumulate arg %d", i-1);
+	err = clSetKernelArg(wf->accumulate_k, i++, sizeof(wf->d_accum), &wf->d_accum);
+	ocl_check(err, "set wavefrontAccumulate arg %d", i-1);
+	err = clSetKernelArg(wf->accumulate_k, i++, sizeof(wf->d_counters), &wf->d_counters);
+	ocl_check(err, "set wavefrontAccumulate arg %d", i-1);
+	err = clSetKernelArg(wf->accumulate_k, i++, sizeof(wf->d_hits), &wf->d_hits);
+	ocl_check(err, "set wavefrontAccumulate arg %d", i-1);
+	err = clSetKernelArg(wf->accumulate_k, i++, sizeof(wf->d_shadows), &wf->d_shadows);
+	ocl_check(err, "set wavefrontAccumulate arg %d", i-1);
+	err = clSetKernelArg(wf->accumulate_k, i++, sizeof(d_next_rays), &d_next_rays);
+	ocl_check(err, "set wavefrontAccumulate arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, wf->accumulate_k, 1, NULL, gws, lws,
+		0, NULL, &accumulate_evt);
+	ocl_check(err, "enqueue wavefrontAccumulate");
+
+	return accumulate_evt;
+}
+
+cl_event wavefrontRayKeys(Wavefront * wf, cl_command_queue que, cl_mem d_rays, cl_uint nrays, cl_Box trianglesBox){
+
+	const size_t gws[] = { wavefrontGws(nrays) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event keys_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->keys_k, i++, sizeof(wf->d_keys[0]), &wf->d_keys[0]);
+	ocl_check(err, "set computeRayKeys arg %d", i-1);
+	err = clSetKernelArg(wf->keys_k, i++, sizeof(d_rays), &d_rays);
+	ocl_check(err, "set computeRayKeys arg %d", i-1);
+	err = clSetKernelArg(wf->keys_k, i++, sizeof(nrays), &nrays);
+	ocl_check(err, "set computeRayKeys arg %d", i-1);
+	err = clSetKernelArg(wf->keys_k, i++, sizeof(wf->d_paths), &wf->d_paths);
+	ocl_check(err, "set computeRayKeys arg %d", i-1);
+	err = clSetKernelArg(wf->keys_k, i++, sizeof(trianglesBox), &trianglesBox);
+	ocl_check(err, "set computeRayKeys arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, wf->keys_k, 1, NULL, gws, lws,
+		0, NULL, &keys_evt);
+	ocl_check(err, "enqueue computeRayKeys");
+
+	return keys_evt;
+}
+
+cl_event wavefrontCoherence(Wavefront * wf, cl_command_queue que, cl_uint nrays){
+
+	const size_t gws[] = { wavefrontGws(nrays) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event coherence_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->coherence_k, i++, sizeof(wf->d_counters), &wf->d_counters);
+	ocl_check(err, "set rayCoherence arg %d", i-1);
+	err = clSetKernelArg(wf->coherence_k, i++, sizeof(wf->d_keys[0]), &wf->d_keys[0]);
+	ocl_check(err, "set rayCoherence arg %d", i-1);
+	err = clSetKernelArg(wf->coherence_k, i++, sizeof(nrays), &nrays);
+	ocl_check(err, "set rayCoherence arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, wf->coherence_k, 1, NULL, gws, lws,
+		0, NULL, &coherence_evt);
+	ocl_check(err, "enqueue rayCoherence");
+
+	return coherence_evt;
+}
+
+cl_event wavefrontResolve(Wavefront * wf, cl_command_queue que, cl_mem d_render){
+
+	const size_t gws[] = { wavefrontGws(wf->npaths) };
+	const size_t lws[] = { WAVEFRONT_LWS };
+
+	cl_event resolve_evt;
+	cl_int err;
+
+	cl_uint i = 0;
+	err = clSetKernelArg(wf->resolve_k, i++, sizeof(d_render), &d_render);
+	ocl_check(err, "set wavefrontResolve arg %d", i-1);
+	err = clSetKernelArg(wf->resolve_k, i++, sizeof(wf->d_accum), &wf->d_accum);
+	ocl_check(err, "set wavefrontResolve arg %d", i-1);
+	err = clSetKernelArg(wf->resolve_k, i++, sizeof(wf->npaths), &wf->npaths);
+	ocl_check(err, "set wavefrontResolve arg %d", i-1);
+
+	err = clEnqueueNDRangeKernel(que, wf->resolve_k, 1, NULL, gws, lws,
+		0, NULL, &resolve_evt);
+	ocl_check(err, "enqueue wavefrontResolve");
+
+	return resolve_evt;
+}
+
+//Render the frame into d_render with the wavefront integrator: SAMPLES waves of one path per pixel,
+//each extended, shaded and accumulated for up to MAX_BOUNCES bounces while reflective hits remain.
+//With wf->sort_rays the rays of the bounces after the first are sorted by computeRayKeys before extend;
+//the keys are computed in every case, for the coherence statistics.
+//The stages run in order on que, sized by the queue counters read back once per bounce
+cl_event wavefrontPathTracer(Wavefront * wf, cl_command_queue que, cl_mem d_render,
+	cl_mem d_Spheres, cl_mem d_Squares, cl_mem d_Triangles, cl_int ntriangles,
+	cl_Box trianglesBox, int use_bvh, cl_mem d_Accel, cl_mem d_AccelIndices, cl_int4 grid_res, cl_float4 cell_size,
+	cl_mem d_Primitives, cl_mem d_scenelights, cl_int nlights,
+	cl_uint4 seeds, cl_float4 cam_up, cl_float4 cam_right, cl_float4 eye_offset,
+	cl_int renderWidth, cl_event TrianglesGrid_evt){
+
+	const cl_uint zero = 0;
+	cl_uint counters[WAVEFRONT_COUNTERS];
+	cl_int err;
+
+	for(int s=0; s<SAMPLES; ++s){
+		//TrianglesGrid_evt is NULL when the grid was loaded prebuilt from scene.bin
+		cl_event generate_evt = wavefrontGenerate(wf, que, cam_up, cam_right, eye_offset, seeds,
+			renderWidth, s == 0, s == 0 ? TrianglesGrid_evt : NULL);
+		cl_uint nrays = wf->npaths;
+		int cur = 0;
+		for(int b=0; b<MAX_BOUNCES && nrays > 0; ++b){
+			err = clEnqueueFillBuffer(que, wf->d_counters, &zero, sizeof(zero), 0, sizeof(counters),
+				0, NULL, NULL);
+			ocl_check(err, "clear d_counters");
+			cl_event keys_evt = wavefrontRayKeys(wf, que, wf->d_rays[cur], nrays, trianglesBox);
+			cl_event sort_start_evt = NULL, sort_evt = NULL;
+			//Primary rays are coherent already, in pixel order
+			if(wf->sort_rays && b > 0){
+				//The queue is sorted in place: the sorted values end up in d_values[0]
+				cl_mem d_values[2] = { wf->d_rays[cur], wf->d_sort_values };
+				sort_evt = radixSort(wf->radixCount_k, wf->radixScatter_k, wf->scan_k, wf->scan_fixup_k,
+					que, wf->ctx, wf->d_keys, d_values, nrays, wf->scan_lws, keys_evt, &sort_start_evt);
+			}
+			cl_event coherence_evt = wavefrontCoherence(wf, que, nrays);
+			cl_event extend_evt = wavefrontExtend(wf, que, wf->d_rays[cur], nrays,
+				d_Spheres, d_Squares, d_Triangles, ntriangles, trianglesBox,
+				use_bvh, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives);
+			cl_event shade_evt = wavefrontShade(wf, que, nrays, d_scenelights, nlights);
+			cl_event shadow_evt = wavefrontShadow(wf, que, nrays, nlights,
+				d_Spheres, d_Squares, d_Triangles, ntriangles, trianglesBox,
+				use_bvh, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives);
+			cl_event accumulate_evt = wavefrontAccumulate(wf, que, nrays, wf->d_rays[cur ^ 1]);
+			cl_event counters_evt;
+			err = clEnqueueReadBuffer(que, wf->d_counters, CL_TRUE, 0, sizeof(counters), counters,
+				1, &accumulate_evt, &counters_evt);
+			ocl_check(err, "read d_counters");
+
+			if(generate_evt){
+				wf->generate_ms += runtime_ms(generate_evt);
+				clReleaseEvent(generate_evt);
+				generate_evt = NULL;
+			}
+			wf->keys_ms += runtime_ms(keys_evt);
+			wf->coherence_ms += runtime_ms(coherence_evt);
+			clReleaseEvent(keys_evt);
+			clReleaseEvent(coherence_evt);
+			if(sort_evt){
+				wf->sort_ms += total_runtime_ms(sort_start_evt, sort_evt);
+				clReleaseEvent(sort_start_evt);
+				clReleaseEvent(sort_evt);
+			}
+			wf->depth_extend_ms[b] += runtime_ms(extend_evt);
+			wf->depth_rays[b] += nrays;
+			wf->depth_pairs[b] += nrays - 1;
+			wf->depth_coherent[b] += counters[WAVEFRONT_COHERENT];
+			wf->extend_ms += runtime_ms(extend_evt);
+			wf->shade_ms += runtime_ms(shade_evt);
+			wf->shadow_ms += runtime_ms(shadow_evt);
+			wf->accumulate_ms += runtime_ms(accumulate_evt);
+			wf->counters_ms += runtime_ms(counters_evt);
+			clReleaseEvent(extend_evt);
+			clReleaseEvent(shade_evt);
+			clReleaseEvent(shadow_evt);
+			clReleaseEvent(accumulate_evt);
+			clReleaseEvent(counters_evt);
+
+			wf->nrays += nrays;
+			wf->nhits += counters[WAVEFRONT_HITS];
+			wf->nshadows += counters[WAVEFRONT_SHADOWS];
+			wf->nbounces++;
+			nrays = counters[WAVEFRONT_RAYS];
+			cur ^= 1;
+		}
+		if(generate_evt) clReleaseEvent(generate_evt);
+	}
+
+	return wavefrontResolve(wf, que, d_render);
+}
+
+//Kernel time of all the stages, resolve_ms must have been set from the event of wavefrontPathTracer
+//The ray keys count only when they are sorted, the coherence statistics not at all
+double wavefrontRuntime(const Wavefront * wf){
+	return wf->generate_ms + wf->extend_ms + wf->shade_ms + wf->shadow_ms + wf->accumulate_ms + wf->resolve_ms
+		+ (wf->sort_rays ? wf->keys_ms + wf->sort_ms : 0);
+}
+
+void wavefrontReport(const Wavefront * wf){
+	printf("wavefront generate : %lu paths in %gms: %g Mpaths/s\n",
+		(unsigned long)wf->npaths*SAMPLES, wf->generate_ms, (double)wf->npaths*SAMPLES/1.0e3/wf->generate_ms);
+	printf("wavefront extend : %lu rays in %gms: %g Mrays/s\n",
+		(unsigned long)wf->nrays, wf->extend_ms, wf->nrays/1.0e3/wf->extend_ms);
+	printf("wavefront shade : %lu hits in %gms: %g Mhits/s\n",
+		(unsigned long)wf->nhits, wf->shade_ms, wf->nhits/1.0e3/wf->shade_ms);
+	printf("wavefront shadow : %lu rays in %gms: %g Mrays/s\n",
+		(unsigned long)wf->nshadows, wf->shadow_ms, wf->nshadows/1.0e3/wf->shadow_ms);
+	printf("wavefront accumulate : %lu hits in %gms: %g Mhits/s\n",
+		(unsigned long)wf->nhits, wf->accumulate_ms, wf->nhits/1.0e3/wf->accumulate_ms);
+	printf("wavefront resolve : %u pixels in %gms: %g GB/s\n",
+		wf->npaths, wf->resolve_ms, (sizeof(cl_float4) + sizeof(cl_uchar4))*wf->npaths/1.0e6/wf->resolve_ms);
+	printf("wavefront counters : %d bounces, %gms reading queue sizes back\n",
+		wf->nbounces, wf->counters_ms);
+	printf("wavefront ray keys : %lu rays in %gms: %g Mrays/s\n",
+		(unsigned long)wf->nrays, wf->keys_ms, wf->nrays/1.0e3/wf->keys_ms);
+	if(wf->sort_rays)
+		printf("wavefront ray sort : %lu secondary rays in %gms: %g Mkeys/s\n",
+			(unsigned long)(wf->nrays - wf->depth_rays[0]), wf->sort_ms, (wf->nrays - wf->depth_rays[0])/1.0e3/wf->sort_ms);
+	for(int b=0; b<MAX_BOUNCES && wf->depth_rays[b] > 0; ++b)
+		printf("wavefront bounce %d%s : %lu rays in %gms: %g Mrays/s, %.1f%% coherent neighbours\n",
+			b, wf->sort_rays && b > 0 ? " (sorted)" : "", (unsigned long)wf->depth_rays[b], wf->depth_extend_ms[b],
+			wf->depth_rays[b]/1.0e3/wf->depth_extend_ms[b],
+			wf->depth_pairs[b] ? 100.0*wf->depth_coherent[b]/wf->depth_pairs[b] : 0);
+}
+
 int main(int argc, char* argv[]){
 
 	int img_width = 512, img_height = 512;
 	float CELL_SIZE_MODIFIER = 3.0f;
-	printf("Usage: %s [img_width] [img_height] [CELL_SIZE_MODIFIER]\nLoads data from triangles.txt, lights.txt, spheres.txt and squares.txt\n", argv[0]);
+	int use_bvh = 0, use_lbvh = 0, use_wavefront = 0, use_sorted_rays = 0, use_persistent = 0;
+	printf("Usage: %s [img_width] [img_height] [CELL_SIZE_MODIFIER] [grid|bvh|lbvh] [megakernel|wavefront|wavefront_sorted|persistent]\nLoads data from scene.bin if present, otherwise from triangles.txt, lights.txt, spheres.txt and squares.txt\nSpheres and quads anywhere in the scene are read from primitives.txt if present\n", argv[0]);
 
 	if(argc > 1){
 		img_width = atoi(argv[1]);
@@ -396,33 +1439,30 @@ int main(int argc, char* argv[]){
 	if(argc > 3){
 		CELL_SIZE_MODIFIER = atof(argv[3]);
 	}
+	if(argc > 4){
+		use_bvh = (strcmp(argv[4], "bvh") == 0);
+		use_lbvh = (strcmp(argv[4], "lbvh") == 0);
+	}
+	if(argc > 5){
+		use_sorted_rays = (strcmp(argv[5], "wavefront_sorted") == 0);
+		use_wavefront = use_sorted_rays || (strcmp(argv[5], "wavefront") == 0);
+		use_persistent = (strcmp(argv[5], "persistent") == 0);
+	}
+	const int use_grid = !use_bvh && !use_lbvh;
+	printf("Acceleration structure: %s\n", use_bvh ? "BVH" : use_lbvh ? "LBVH (device)" : "grid");
+	printf("Integrator: %s\n", use_sorted_rays ? "wavefront, sorted rays" : use_wavefront ? "wavefront" : use_persistent ? "megakernel, persistent threads" : "megakernel");
 
 	cl_platform_id p = select_platform();
 	cl_device_id d = select_device(p);
 	cl_context ctx = create_context(p, d);
 	cl_command_queue que = create_queue(ctx, d);
-	cl_program prog = create_program("pathtracer.ocl", ctx, d);
 	cl_int err;
-
-	cl_kernel initTrianglesGrid_k = clCreateKernel(prog, "initTrianglesGrid", &err);
-	ocl_check(err, "create kernel initTrianglesGrid_k");
-
-	cl_kernel printTrianglesGrid_k = clCreateKernel(prog, "printTrianglesGrid", &err);
-	ocl_check(err, "create kernel printTrianglesGrid_k");
-
-	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
-	ocl_check(err, "create kernel pathtracer_k");
 	
 	//seeds for the edited MWC64X
 	cl_uint4 seeds = {.x = time(0) & 134217727, .y = (getpid() * getpid() * getpid()) & 134217727, .z = (clock()*clock()) & 134217727, .w = rdtsc() & 134217727};
 
 	printf("Seeds: %d, %d, %d, %d\n", seeds.x, seeds.y, seeds.z, seeds.w);
 
-	size_t lws_max;
-	err = clGetKernelWorkGroupInfo(pathtracer_k, d, CL_KERNEL_WORK_GROUP_SIZE, 
-		sizeof(lws_max), &lws_max, NULL);
-	ocl_check(err, "Max lws for pathtracer");
-
 	const char *imageName = "result.ppm";
 	struct imgInfo resultInfo;
 	resultInfo.channels = 4;
@@ -434,11 +1474,22 @@ int main(int argc, char* argv[]){
 	resultInfo.data = malloc(resultInfo.data_size);
 	printf("Processing image %dx%d with data size %ld bytes\n", resultInfo.width, resultInfo.height, resultInfo.data_size);
 
-	cl_mem d_render = clCreateBuffer(ctx,
-		CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		resultInfo.data_size, NULL,
-		&err);
-	ocl_check(err, "create buffer d_render");
+	//Big frames are rendered in tiles streamed back into resultInfo.data (see ../tiles.h)
+	//The wavefront integrator keeps the state of every path of the frame on the device,
+	//persistent threads take their pixels from the whole frame: both always render it whole
+	const double tile_ms = use_wavefront || use_persistent ? 0 : tile_target_ms(d, resultInfo.data_size);
+	cl_mem d_render = NULL;
+	cl_command_queue read_que = NULL;
+	if(tile_ms > 0){
+		read_que = create_queue(ctx, d);
+	}
+	else{
+		d_render = clCreateBuffer(ctx,
+			CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+			resultInfo.data_size, NULL,
+			&err);
+		ocl_check(err, "create buffer d_render");
+	}
 	
 	cl_float4 zVect = { .x = 0, .y = 0, .z = -1, .w = 0 };
 
@@ -463,33 +1514,160 @@ int main(int argc, char* argv[]){
 	//Geometries
 	cl_int * Spheres = malloc(sizeof(cl_int)*9);
 	cl_int * Squares = malloc(sizeof(cl_int)*9);
-	cl_Triangle * Triangles = malloc(sizeof(cl_float4)*3*MAX_TRIANGLES);
-
-	parseArrayFromFile("spheres.txt", Spheres);
-	parseArrayFromFile("squares.txt", Squares);
-	
+	cl_Triangle * Triangles = NULL;
 	cl_Box trianglesBox;
-	cl_int ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, &trianglesBox);
+	cl_int ntriangles, nlights;
+
+	//Prefer the memory-mapped binary scene (see ../SceneConverter), fall back to the text files
+	SceneFile scene;
+	const int use_scene_bin = (load_scene_bin("scene.bin", &scene) == 0);
+	if(use_scene_bin){
+		memcpy(Spheres, scene.header->Spheres, sizeof(cl_int)*9);
+		memcpy(Squares, scene.header->Squares, sizeof(cl_int)*9);
+		Triangles = scene.triangles;
+		ntriangles = scene.header->ntriangles;
+		trianglesBox.vmin = scene.header->vmin;
+		trianglesBox.vmax = scene.header->vmax;
+		nlights = min(scene.header->nlights, MAX_LIGHTS);
+		memcpy(scenelights, scene.lights, sizeof(cl_float4)*nlights);
+	}
+	else{
+		//Size the triangles array from the file contents
+		ntriangles = countTrianglesInFile("triangles.txt");
+		Triangles = malloc(sizeof(cl_Triangle)*ntriangles);
+		parseArrayFromFile("spheres.txt", Spheres);
+		parseArrayFromFile("squares.txt", Squares);
+		ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles, &trianglesBox);
+		nlights = parseLightsFromFile("lights.txt", scenelights);
+	}
+
+	//Spheres and quads of primitives.txt, and of the bitmasks with OCL_PRIMITIVE_LISTS=1, are traced through the
+	//grid or BVH with the triangles: the builds read AccelTriangles, the triangles followed by one bounding
+	//Triangle per primitive (see primitiveBounds), and index naccel entries
+	cl_Primitive * FilePrimitives;
+	const int nfile_primitives = parsePrimitivesFromFile("primitives.txt", &FilePrimitives);
+	const char * const lists_env = getenv("OCL_PRIMITIVE_LISTS");
+	const int use_bitmask_lists = lists_env && strcmp(lists_env, "0") != 0;
+	cl_Primitive * Primitives = malloc(sizeof(cl_Primitive)*(nfile_primitives + 2*9*19));
+	cl_int nprimitives = use_bitmask_lists ? bitmaskPrimitives(Spheres, Squares, Primitives) : 0;
+	if(nfile_primitives > 0) memcpy(Primitives + nprimitives, FilePrimitives, sizeof(cl_Primitive)*nfile_primitives);
+	nprimitives += nfile_primitives;
+	free(FilePrimitives);
+	const cl_int naccel = ntriangles + nprimitives;
+	cl_Triangle * AccelTriangles = Triangles;
+	if(nprimitives > 0){
+		AccelTriangles = malloc(sizeof(cl_Triangle)*naccel);
+		memcpy(AccelTriangles, Triangles, sizeof(cl_Triangle)*ntriangles);
+		for(int k = 0; k < nprimitives; ++k){
+			const cl_Triangle b = primitiveBounds(Primitives[k]);
+			AccelTriangles[ntriangles + k] = b;
+			if(ntriangles == 0 && k == 0){
+				trianglesBox.vmin = b.v0;
+				trianglesBox.vmax = b.v1;
+			}
+			for(int i = 0; i < 3; ++i){
+				if(b.v0.s[i] < trianglesBox.vmin.s[i]) trianglesBox.vmin.s[i] = b.v0.s[i];
+				if(b.v1.s[i] > trianglesBox.vmax.s[i]) trianglesBox.vmax.s[i] = b.v1.s[i];
+			}
+		}
+	}
+	//Cells keep 16 bit triangle indices unless the scene has too many triangles for them
+	const int use_index32 = naccel > CL_USHRT_MAX + 1;
+	//Triangles (and a prebuilt grid) from scene.bin are used in place, without a copy
+	const cl_mem_flags scene_mem_flags = CL_MEM_READ_ONLY | (use_scene_bin && nprimitives == 0 ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR);
 	printf("Triangles bounding box values:\nvmax: %f %f %f, vmin: %f %f %f\n", trianglesBox.vmax.x, trianglesBox.vmax.y, trianglesBox.vmax.z, trianglesBox.vmin.x, trianglesBox.vmin.y, trianglesBox.vmin.z);
 
 	//Compute grid values
 	cl_float4 grid_size = VectorDifference(trianglesBox.vmax, trianglesBox.vmin);
-	float cubeRoot = cbrt(CELL_SIZE_MODIFIER*ntriangles/(grid_size.s0 * grid_size.s1 * grid_size.s2));
+	float cubeRoot = cbrt(CELL_SIZE_MODIFIER*naccel/(grid_size.s0 * grid_size.s1 * grid_size.s2));
 	cl_int4 grid_res;
 	for (int i=0; i<3; ++i){
 		grid_res.s[i] = (int)(floor(grid_size.s[i] * cubeRoot));
 		grid_res.s[i] = max(1, min(grid_res.s[i], 128));
 	}
 	cl_float4 cell_size = VectorDivisionFloatInt(grid_size, grid_res);
-	size_t grid_memsize = sizeof(cl_Cell)*grid_res.s0*grid_res.s1*grid_res.s2;
-	cl_Cell * TrianglesGrid = calloc(1, grid_memsize);
-	printf("Triangles grid size: %d x %d x %d\n", grid_res.x, grid_res.y, grid_res.z);
-
-	cl_int nlights = parseLightsFromFile("lights.txt", scenelights);
+	//A prebuilt grid can only be used if it was built with the same index width and CELL_SIZE_MODIFIER
+	const size_t index_bytes = use_index32 ? sizeof(cl_uint) : sizeof(cl_ushort);
+	const int use_prebuilt_grid = use_grid && use_scene_bin && nprimitives == 0 && scene.grid && scene.header->index_bytes == index_bytes
+		&& scene.header->cell_size_modifier == CELL_SIZE_MODIFIER;
+	if(use_prebuilt_grid){
+		grid_res = scene.header->grid_res;
+		cell_size = scene.header->cell_size;
+	}
+	const cl_int ncells = grid_res.s0*grid_res.s1*grid_res.s2;
+	if(use_grid) printf("Triangles grid size: %d x %d x %d%s\n", grid_res.x, grid_res.y, grid_res.z, use_prebuilt_grid ? " (prebuilt)" : "");
 
 	printf("Number of triangles: %d\n", ntriangles);
+	printf("Number of primitives: %d (spheres and quads in the %s)\n", nprimitives, use_grid ? "grid" : "BVH");
 	printf("Number of lights: %d\n", nlights);
 
+	//The BVH is built on the host, before the kernels: its depth sizes the traversal stack
+	BVH bvh;
+	double runtime_bvh_ms = 0;
+	if(use_bvh){
+		clock_t start_bvh = clock();
+		if(build_bvh((const cl_float4*)AccelTriangles, naccel, &bvh) != 0){
+			exit(1);
+		}
+		runtime_bvh_ms = (clock() - start_bvh)*1.0e3/CLOCKS_PER_SEC;
+		printf("Triangles BVH: %d nodes, depth %d\n", bvh.nnodes, bvh.depth);
+	}
+
+	//Triangle layout of the traversal, OCL_TRIANGLE_LAYOUT=0 traces the Triangle array as loaded (see pathtracer.ocl)
+	const char * const layout_env = getenv("OCL_TRIANGLE_LAYOUT");
+	const int triangle_layout = layout_env ? clamp(atoi(layout_env), 0, 3) : 1;
+	const char * const layout_names[] = { "vertices", "precomputed edges and normal (AoS)",
+		"precomputed edges and normal (SoA)", "vertices quantized to 16 bits in the triangles box" };
+	printf("Triangle layout: %s\n", layout_names[triangle_layout]);
+	//Bytes of one triangle as read by the traversal
+	const size_t triangle_bytes = triangle_layout == 3 ? 3*sizeof(cl_ushort4) : 3*sizeof(cl_float4);
+
+	//The kernels are built once the scene is known, specialized on it (see ../specialize.h)
+	char build_options[BUFSIZE];
+	snprintf(build_options, BUFSIZE, "-DTRIANGLE_LAYOUT=%d%s", triangle_layout, use_index32 ? " -DCELL_INDEX_32" : "");
+	if(!use_grid)
+		snprintf(build_options + strlen(build_options), BUFSIZE - strlen(build_options), " -DUSE_BVH -DBVH_STACK_SIZE=%d", use_bvh ? bvh.depth : LBVH_STACK_SIZE);
+	cl_program prog = create_program_specialized("pathtracer.ocl", ctx, d, build_options, Spheres, Squares, nlights, ntriangles);
+
+	cl_kernel countTrianglesGrid_k = clCreateKernel(prog, "countTrianglesGrid", &err);
+	ocl_check(err, "create kernel countTrianglesGrid_k");
+
+	cl_kernel scan_k = clCreateKernel(prog, "scan_lmem", &err);
+	ocl_check(err, "create kernel scan_k");
+
+	cl_kernel scan_fixup_k = clCreateKernel(prog, "scan_fixup", &err);
+	ocl_check(err, "create kernel scan_fixup_k");
+
+	cl_kernel scatterTrianglesGrid_k = clCreateKernel(prog, "scatterTrianglesGrid", &err);
+	ocl_check(err, "create kernel scatterTrianglesGrid_k");
+
+	cl_kernel printTrianglesGrid_k = clCreateKernel(prog, "printTrianglesGrid", &err);
+	ocl_check(err, "create kernel printTrianglesGrid_k");
+
+	cl_kernel computeMortonCodes_k = clCreateKernel(prog, "computeMortonCodes", &err);
+	ocl_check(err, "create kernel computeMortonCodes_k");
+
+	cl_kernel radixCount_k = clCreateKernel(prog, "radixCount", &err);
+	ocl_check(err, "create kernel radixCount_k");
+
+	cl_kernel radixScatter_k = clCreateKernel(prog, "radixScatter", &err);
+	ocl_check(err, "create kernel radixScatter_k");
+
+	cl_kernel buildLBVHHierarchy_k = clCreateKernel(prog, "buildLBVHHierarchy", &err);
+	ocl_check(err, "create kernel buildLBVHHierarchy_k");
+
+	cl_kernel fitLBVHBounds_k = clCreateKernel(prog, "fitLBVHBounds", &err);
+	ocl_check(err, "create kernel fitLBVHBounds_k");
+
+	cl_kernel precomputeTriangles_k = clCreateKernel(prog, "precomputeTriangles", &err);
+	ocl_check(err, "create kernel precomputeTriangles_k");
+
+	cl_kernel pathtracer_k = clCreateKernel(prog, "pathTracer", &err);
+	ocl_check(err, "create kernel pathtracer_k");
+
+	cl_kernel pathtracer_persistent_k = clCreateKernel(prog, "pathTracerPersistent", &err);
+	ocl_check(err, "create kernel pathtracer_persistent_k");
+
 	cl_mem d_Spheres = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 		sizeof(cl_int)*9, Spheres,
@@ -503,16 +1681,28 @@ int main(int argc, char* argv[]){
 	ocl_check(err, "create buffer d_Squares");
 
 	cl_mem d_Triangles = clCreateBuffer(ctx,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		sizeof(cl_float4)*3*ntriangles, Triangles,
+		scene_mem_flags,
+		sizeof(cl_float4)*3*naccel, AccelTriangles,
 		&err);
 	ocl_check(err, "create buffer d_Triangles");
 
-	cl_mem d_TrianglesGrid = clCreateBuffer(ctx,
+	cl_mem d_Primitives = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		grid_memsize, TrianglesGrid,
+		sizeof(cl_Primitive)*max(nprimitives, 1), Primitives,
 		&err);
-	ocl_check(err, "create buffer d_TrianglesGrid");
+	ocl_check(err, "create buffer d_Primitives");
+
+	//Triangles as traced by the path tracing kernels, the builds read d_Triangles
+	cl_mem d_TriangleData = d_Triangles;
+	cl_event precomputeTriangles_evt = NULL;
+	if(triangle_layout > 0){
+		d_TriangleData = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			triangle_bytes*max(ntriangles, 1), NULL,
+			&err);
+		ocl_check(err, "create buffer d_TriangleData");
+		precomputeTriangles_evt = precomputeTriangles(precomputeTriangles_k, que, d_TriangleData, d_Triangles, ntriangles, trianglesBox);
+	}
 
 	cl_mem d_scenelights = clCreateBuffer(ctx,
 		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
@@ -521,26 +1711,254 @@ int main(int argc, char* argv[]){
 	ocl_check(err, "create buffer d_scenelights");
 	//clock_t start_initTrianglesGrid, end_initTrianglesGrid;
   	//start_initTrianglesGrid = clock();
-	//initTrianglesGrid(TrianglesGrid, Triangles, grid_res, cell_size, trianglesBox, ntriangles);
+	//cl_uint * CellOffsets = calloc(ncells+1, sizeof(cl_uint));
+	//cl_uint * CellTriangles = initTrianglesGrid_host(CellOffsets, Triangles, grid_res, cell_size, trianglesBox, ntriangles);
 	//end_initTrianglesGrid = clock();
-	//printTrianglesGrid_host(TrianglesGrid, grid_res);
-
-	cl_event initTrianglesGrid_evt = initTrianglesGrid_device(initTrianglesGrid_k, que, d_TrianglesGrid, d_Triangles, trianglesBox.vmin, grid_res, cell_size, ntriangles);
-	cl_event printTrianglesGrid_evt = printTrianglesGrid(printTrianglesGrid_k, que, d_TrianglesGrid, grid_res, initTrianglesGrid_evt);
-
-	cl_event pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
-	d_Spheres, d_Squares, d_Triangles, ntriangles, trianglesBox,
-	d_TrianglesGrid, grid_res, cell_size, d_scenelights, nlights, seeds, 
-	cam_forward, cam_up, cam_right, eye_offset, 
-	resultInfo.width, resultInfo.height, printTrianglesGrid_evt);
+	//printTrianglesGrid_host(CellOffsets, CellTriangles, grid_res);
+
+	size_t scan_lws;
+	err = clGetKernelWorkGroupInfo(scan_k, d, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(scan_lws), &scan_lws, NULL);
+	ocl_check(err, "Max lws for scan");
+
+	//Grid: cell offsets (ncells+1 elements, the last one is the total number of indices) and cell triangle indices
+	//BVH and LBVH: nodes and leaf triangle indices
+	cl_mem d_Accel, d_AccelIndices;
+	cl_uint nindices = 0;
+	const cl_int lbvh_nnodes = 2*naccel - 1;
+	cl_event countTrianglesGrid_evt = NULL, scan_start_evt = NULL, scan_evt = NULL, scatterTrianglesGrid_evt = NULL, printTrianglesGrid_evt = NULL;
+	cl_event computeMortonCodes_evt = NULL, sort_start_evt = NULL, sort_evt = NULL, buildLBVHHierarchy_evt = NULL, fitLBVHBounds_evt = NULL;
+	if(use_bvh){
+		d_Accel = clCreateBuffer(ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_BVHNode)*bvh.nnodes, bvh.nodes,
+			&err);
+		ocl_check(err, "create buffer d_BVHNodes");
+
+		d_AccelIndices = clCreateBuffer(ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_uint)*naccel, bvh.indices,
+			&err);
+		ocl_check(err, "create buffer d_BVHIndices");
+	}
+	else if(use_lbvh){
+		d_Accel = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_BVHNode)*lbvh_nnodes, NULL,
+			&err);
+		ocl_check(err, "create buffer d_BVHNodes");
+
+		//Morton codes and triangle indices, sorted in place of [0]: the sorted indices are the leaf indices
+		cl_mem d_codes[2], d_indices[2];
+		for(int k=0; k<2; ++k){
+			d_codes[k] = clCreateBuffer(ctx,
+				CL_MEM_READ_WRITE,
+				sizeof(cl_uint)*naccel, NULL,
+				&err);
+			ocl_check(err, "create buffer d_codes[%d]", k);
+			d_indices[k] = clCreateBuffer(ctx,
+				CL_MEM_READ_WRITE,
+				sizeof(cl_uint)*naccel, NULL,
+				&err);
+			ocl_check(err, "create buffer d_indices[%d]", k);
+		}
+		d_AccelIndices = d_indices[0];
+
+		//Parent of every node (-1 for the root) and arrival counters of the inner nodes
+		cl_mem d_parents = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_int)*lbvh_nnodes, NULL,
+			&err);
+		ocl_check(err, "create buffer d_parents");
+
+		cl_mem d_flags = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint)*max(naccel-1, 1), NULL,
+			&err);
+		ocl_check(err, "create buffer d_flags");
+
+		const cl_int no_parent = -1;
+		const cl_uint zero = 0;
+		err = clEnqueueFillBuffer(que, d_parents, &no_parent, sizeof(no_parent), 0, sizeof(cl_int)*lbvh_nnodes,
+			0, NULL, NULL);
+		ocl_check(err, "clear d_parents");
+		err = clEnqueueFillBuffer(que, d_flags, &zero, sizeof(zero), 0, sizeof(cl_uint)*max(naccel-1, 1),
+			0, NULL, NULL);
+		ocl_check(err, "clear d_flags");
+
+		computeMortonCodes_evt = computeMortonCodes(computeMortonCodes_k, que, d_codes[0], d_indices[0], d_Triangles, trianglesBox, naccel);
+		sort_evt = radixSort(radixCount_k, radixScatter_k, scan_k, scan_fixup_k, que, ctx, d_codes, d_indices, naccel, scan_lws, computeMortonCodes_evt, &sort_start_evt);
+		//A single triangle is a leaf root, with no inner nodes
+		buildLBVHHierarchy_evt = naccel > 1 ? buildLBVHHierarchy(buildLBVHHierarchy_k, que, d_Accel, d_parents, d_codes[0], naccel, sort_evt) : sort_evt;
+		fitLBVHBounds_evt = fitLBVHBounds(fitLBVHBounds_k, que, d_Accel, d_parents, d_flags, d_indices[0], d_Triangles, naccel, buildLBVHHierarchy_evt);
+
+		//Released once the enqueued commands using them are done
+		clReleaseMemObject(d_codes[0]);
+		clReleaseMemObject(d_codes[1]);
+		clReleaseMemObject(d_indices[1]);
+		clReleaseMemObject(d_parents);
+		clReleaseMemObject(d_flags);
+	}
+	else if(use_prebuilt_grid){
+		nindices = scene.header->grid_nindices;
+		d_Accel = clCreateBuffer(ctx,
+			scene_mem_flags,
+			sizeof(cl_uint)*(ncells+1), scene.grid,
+			&err);
+		ocl_check(err, "create buffer d_CellOffsets");
+
+		d_AccelIndices = clCreateBuffer(ctx,
+			scene_mem_flags,
+			index_bytes*max(nindices, 1), scene.cell_indices,
+			&err);
+		ocl_check(err, "create buffer d_CellTriangles");
+	}
+	else{
+		d_Accel = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint)*(ncells+1), NULL,
+			&err);
+		ocl_check(err, "create buffer d_CellOffsets");
+
+		//Triangle counts per cell, later reused as the scatter cursor
+		cl_mem d_CellCounts = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint)*(ncells+1), NULL,
+			&err);
+		ocl_check(err, "create buffer d_CellCounts");
+
+		const cl_uint zero = 0;
+		cl_event clearCounts_evt;
+		err = clEnqueueFillBuffer(que, d_CellCounts, &zero, sizeof(zero), 0, sizeof(cl_uint)*(ncells+1),
+			0, NULL, &clearCounts_evt);
+		ocl_check(err, "clear d_CellCounts");
+
+		countTrianglesGrid_evt = countTrianglesGrid(countTrianglesGrid_k, que, d_CellCounts, d_Triangles, trianglesBox.vmin, grid_res, cell_size, naccel, clearCounts_evt);
+		scan_evt = scanGrid(scan_k, scan_fixup_k, que, ctx, d_Accel, d_CellCounts, ncells+1, scan_lws, countTrianglesGrid_evt, &scan_start_evt);
+
+		//The last offset sizes the index array
+		err = clEnqueueReadBuffer(que, d_Accel, CL_TRUE, sizeof(cl_uint)*ncells, sizeof(nindices), &nindices,
+			1, &scan_evt, NULL);
+		ocl_check(err, "read number of grid indices");
+
+		d_AccelIndices = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			index_bytes*max(nindices, 1), NULL,
+			&err);
+		ocl_check(err, "create buffer d_CellTriangles");
+
+		cl_event copyCursor_evt;
+		err = clEnqueueCopyBuffer(que, d_Accel, d_CellCounts, 0, 0, sizeof(cl_uint)*ncells,
+			1, &scan_evt, &copyCursor_evt);
+		ocl_check(err, "copy cell offsets to cursor");
+
+		scatterTrianglesGrid_evt = scatterTrianglesGrid(scatterTrianglesGrid_k, que, d_AccelIndices, d_CellCounts, d_Triangles, trianglesBox.vmin, grid_res, cell_size, naccel, copyCursor_evt);
+		printTrianglesGrid_evt = printTrianglesGrid(printTrianglesGrid_k, que, d_Accel, d_AccelIndices, ncells, scatterTrianglesGrid_evt);
+		clReleaseMemObject(d_CellCounts);
+	}
+	const size_t grid_memsize = sizeof(cl_uint)*(ncells+1) + index_bytes*nindices;
+	if(use_bvh)
+		printf("Triangles BVH: %zu bytes\n", sizeof(cl_BVHNode)*bvh.nnodes + sizeof(cl_uint)*naccel);
+	else if(use_lbvh)
+		printf("Triangles LBVH: %d nodes, %zu bytes\n", lbvh_nnodes, sizeof(cl_BVHNode)*lbvh_nnodes + sizeof(cl_uint)*naccel);
+	else
+		printf("Triangles grid: %u triangle indices, %zu bytes\n", nindices, grid_memsize);
+
+
+	//Traced rays per image row
+	cl_mem d_nrays = clCreateBuffer(ctx,
+		CL_MEM_READ_WRITE,
+		sizeof(cl_uint)*resultInfo.height, NULL,
+		&err);
+	ocl_check(err, "create buffer d_nrays");
+	const cl_uint zero = 0;
+	err = clEnqueueFillBuffer(que, d_nrays, &zero, sizeof(zero), 0, sizeof(cl_uint)*resultInfo.height,
+		0, NULL, NULL);
+	ocl_check(err, "clear d_nrays");
+
+	cl_event pathtracer_evt = NULL, static_evt = NULL;
+	TileScheduler ts;
+	Wavefront wf;
+	cl_mem d_next_pixel = NULL;
+	size_t persistent_lws = 0, persistent_groups = 0;
+	if(use_wavefront){
+		initWavefront(&wf, prog, ctx, d, resultInfo.width*resultInfo.height, nlights, use_sorted_rays);
+		pathtracer_evt = wavefrontPathTracer(&wf, que, d_render,
+			d_Spheres, d_Squares, d_TriangleData, ntriangles, trianglesBox,
+			!use_grid, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives, d_scenelights, nlights, seeds,
+			cam_up, cam_right, eye_offset, resultInfo.width, use_lbvh ? fitLBVHBounds_evt : printTrianglesGrid_evt);
+	}
+	else if(use_persistent){
+		//The static mapping renders the frame first, for comparison: the pixels draw the same
+		//random numbers, so both trace the same rays and write the same image
+		static_evt = pathTracer(pathtracer_k, que, d_render, 
+			d_Spheres, d_Squares, d_TriangleData, ntriangles, trianglesBox,
+			!use_grid, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives, d_scenelights, nlights, seeds, 
+			cam_forward, cam_up, cam_right, eye_offset, d_nrays,
+			0, 0, resultInfo.width, resultInfo.height, use_lbvh ? fitLBVHBounds_evt : printTrianglesGrid_evt);
+		err = clEnqueueFillBuffer(que, d_nrays, &zero, sizeof(zero), 0, sizeof(cl_uint)*resultInfo.height,
+			1, &static_evt, NULL);
+		ocl_check(err, "clear d_nrays");
+
+		//Enough work-groups to fill every compute unit, no more
+		cl_uint ncu;
+		err = clGetDeviceInfo(d, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(ncu), &ncu, NULL);
+		ocl_check(err, "get device compute units");
+		err = clGetKernelWorkGroupInfo(pathtracer_persistent_k, d, CL_KERNEL_WORK_GROUP_SIZE,
+			sizeof(persistent_lws), &persistent_lws, NULL);
+		ocl_check(err, "Max lws for persistent path tracer");
+		if(persistent_lws > PERSISTENT_LWS) persistent_lws = PERSISTENT_LWS;
+		persistent_groups = (size_t)ncu*PERSISTENT_GROUPS_PER_CU;
+
+		d_next_pixel = clCreateBuffer(ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint), NULL,
+			&err);
+		ocl_check(err, "create buffer d_next_pixel");
+		err = clEnqueueFillBuffer(que, d_next_pixel, &zero, sizeof(zero), 0, sizeof(cl_uint),
+			0, NULL, NULL);
+		ocl_check(err, "clear d_next_pixel");
+
+		pathtracer_evt = pathTracerPersistent(pathtracer_persistent_k, que, d_render, 
+			d_Spheres, d_Squares, d_TriangleData, ntriangles, trianglesBox,
+			!use_grid, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives, d_scenelights, nlights, seeds, 
+			cam_up, cam_right, eye_offset, d_nrays, d_next_pixel,
+			resultInfo.width, resultInfo.height, persistent_groups, persistent_lws, NULL);
+	}
+	else if(tile_ms > 0){
+		//Tiles of whole 16x16 blocks, so the work-groups stay big enough for the local memory copies
+		tile_scheduler_init(&ts, img_width, img_height, 16, 16, tile_max_pixels(d, sizeof(cl_uchar4)), tile_ms);
+		TileRing ring;
+		tile_ring_init(&ring, ctx, sizeof(cl_uchar4)*ts.max_pixels);
+		Tile tile;
+		cl_mem d_tile;
+		while((d_tile = tile_begin(&ring, &ts, &tile))){
+			cl_event tile_evt = pathTracer(pathtracer_k, que, d_tile, 
+				d_Spheres, d_Squares, d_TriangleData, ntriangles, trianglesBox,
+				!use_grid, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives, d_scenelights, nlights, seeds, 
+				cam_forward, cam_up, cam_right, eye_offset, d_nrays,
+				tile.x, tile.y, tile.w, tile.h, use_lbvh ? fitLBVHBounds_evt : printTrianglesGrid_evt);
+			tile_end(&ring, &ts, &tile, que, tile_evt, tile_evt, read_que, resultInfo.data, sizeof(cl_uchar4));
+		}
+		tile_ring_finish(&ring, &ts);
+	}
+	else{
+		pathtracer_evt = pathTracer(pathtracer_k, que, d_render, 
+		d_Spheres, d_Squares, d_TriangleData, ntriangles, trianglesBox,
+		!use_grid, d_Accel, d_AccelIndices, grid_res, cell_size, d_Primitives, d_scenelights, nlights, seeds, 
+		cam_forward, cam_up, cam_right, eye_offset, d_nrays,
+		0, 0, resultInfo.width, resultInfo.height, use_lbvh ? fitLBVHBounds_evt : printTrianglesGrid_evt);
+	}
 
-	cl_event getRender_evt;
+	cl_event getRender_evt = NULL;
 	
-	resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
-		CL_MAP_READ,
-		0, resultInfo.data_size,
-		1, &pathtracer_evt, &getRender_evt, &err);
-	ocl_check(err, "enqueue map d_render");
+	if(tile_ms == 0){
+		resultInfo.data = clEnqueueMapBuffer(que, d_render, CL_TRUE,
+			CL_MAP_READ,
+			0, resultInfo.data_size,
+			1, &pathtracer_evt, &getRender_evt, &err);
+		ocl_check(err, "enqueue map d_render");
+	}
 
 	err = save_pam(imageName, &resultInfo);
 	if (err != 0) {
@@ -549,35 +1967,130 @@ int main(int argc, char* argv[]){
 	}
 	else printf("\nSuccessfully created render image %s in the current directory\n\n", imageName);
 
-	double runtime_initTrianglesGrid_ms = runtime_ms(initTrianglesGrid_evt);
+	cl_uint * nrays = malloc(sizeof(cl_uint)*resultInfo.height);
+	err = clEnqueueReadBuffer(que, d_nrays, CL_TRUE, 0, sizeof(cl_uint)*resultInfo.height, nrays,
+		pathtracer_evt ? 1 : 0, pathtracer_evt ? &pathtracer_evt : NULL, NULL);
+	ocl_check(err, "read d_nrays");
+	cl_ulong total_rays = 0;
+	for(int k=0; k<resultInfo.height; ++k) total_rays += nrays[k];
+	free(nrays);
+	//The wavefront stages count their queues instead
+	if(use_wavefront){
+		total_rays = wf.nrays + wf.nshadows;
+		wf.resolve_ms = runtime_ms(pathtracer_evt);
+	}
+
+	const int device_grid = use_grid && !use_prebuilt_grid;
+	double runtime_countTrianglesGrid_ms = device_grid ? runtime_ms(countTrianglesGrid_evt) : 0;
+	double runtime_scan_ms = device_grid ? total_runtime_ms(scan_start_evt, scan_evt) : 0;
+	double runtime_scatterTrianglesGrid_ms = device_grid ? runtime_ms(scatterTrianglesGrid_evt) : 0;
+	double runtime_initTrianglesGrid_ms = runtime_countTrianglesGrid_ms + runtime_scan_ms + runtime_scatterTrianglesGrid_ms;
+	double runtime_computeMortonCodes_ms = use_lbvh ? runtime_ms(computeMortonCodes_evt) : 0;
+	double runtime_sort_ms = use_lbvh ? total_runtime_ms(sort_start_evt, sort_evt) : 0;
+	double runtime_buildLBVHHierarchy_ms = use_lbvh && naccel > 1 ? runtime_ms(buildLBVHHierarchy_evt) : 0;
+	double runtime_fitLBVHBounds_ms = use_lbvh ? runtime_ms(fitLBVHBounds_evt) : 0;
+	double runtime_buildLBVH_ms = use_lbvh ? total_runtime_ms(computeMortonCodes_evt, fitLBVHBounds_evt) : 0;
 	//double runtime_initTrianglesGrid_ms = (end_initTrianglesGrid - start_initTrianglesGrid)*1.0e3/CLOCKS_PER_SEC;
-	double runtime_pathtracer_ms = runtime_ms(pathtracer_evt);
-	double runtime_getRender_ms = runtime_ms(getRender_evt);
+	double runtime_pathtracer_ms = use_wavefront ? wavefrontRuntime(&wf) : tile_ms > 0 ? ts.render_ms : runtime_ms(pathtracer_evt);
+	double runtime_getRender_ms = tile_ms > 0 ? ts.read_ms : runtime_ms(getRender_evt);
+	double runtime_precomputeTriangles_ms = triangle_layout > 0 ? runtime_ms(precomputeTriangles_evt) : 0;
 	double total_time_ms = runtime_pathtracer_ms + runtime_getRender_ms;
 
 	double pathtracer_bw_gbs = resultInfo.data_size/1.0e6/runtime_pathtracer_ms;
+	double pathtracer_mrays = total_rays/1.0e3/runtime_pathtracer_ms;
+	double countTrianglesGrid_bw_gbs = (sizeof(cl_Triangle)*naccel + sizeof(cl_uint)*nindices)/1.0e6/runtime_countTrianglesGrid_ms;
+	double scan_bw_gbs = 2*sizeof(cl_uint)*(ncells+1)/1.0e6/runtime_scan_ms;
+	double scatterTrianglesGrid_bw_gbs = (sizeof(cl_Triangle)*naccel + (sizeof(cl_uint) + index_bytes)*nindices)/1.0e6/runtime_scatterTrianglesGrid_ms;
 	double initTrianglesGrid_bw_gbs = grid_memsize/1.0e6/runtime_initTrianglesGrid_ms;
+	double computeMortonCodes_bw_gbs = (sizeof(cl_Triangle) + 2*sizeof(cl_uint))*naccel/1.0e6/runtime_computeMortonCodes_ms;
+	//Every pass reads and writes keys and values, plus the digit counts
+	double sort_bw_gbs = (32/RADIX_BITS)*4*2*sizeof(cl_uint)*naccel/1.0e6/runtime_sort_ms;
+	double buildLBVHHierarchy_bw_gbs = (sizeof(cl_BVHNode) + 2*sizeof(cl_int))*(naccel-1)/1.0e6/runtime_buildLBVHHierarchy_ms;
+	double fitLBVHBounds_bw_gbs = ((sizeof(cl_Triangle) + sizeof(cl_uint))*naccel + sizeof(cl_BVHNode)*lbvh_nnodes)/1.0e6/runtime_fitLBVHBounds_ms;
+	double buildLBVH_bw_gbs = (sizeof(cl_BVHNode)*lbvh_nnodes + sizeof(cl_uint)*naccel)/1.0e6/runtime_buildLBVH_ms;
 	double getRender_bw_gbs = resultInfo.data_size/1.0e6/runtime_getRender_ms;
-
-	printf("init triangles grid : %d cells in %gms: %g GB/s\n",
-		grid_res.x*grid_res.y*grid_res.z, runtime_initTrianglesGrid_ms, initTrianglesGrid_bw_gbs);
+	double precomputeTriangles_bw_gbs = (sizeof(cl_Triangle) + triangle_bytes)*ntriangles/1.0e6/runtime_precomputeTriangles_ms;
+
+	if(triangle_layout > 0)
+		printf("precompute triangles : %d triangles in %gms: %g GB/s\n",
+			ntriangles, runtime_precomputeTriangles_ms, precomputeTriangles_bw_gbs);
+	printf("triangle storage : %zu bytes traced, %zu bytes as Triangle (%.1f%% saved)\n",
+		triangle_bytes*ntriangles, sizeof(cl_Triangle)*ntriangles,
+		100.0 - 100.0*triangle_bytes/sizeof(cl_Triangle));
+	if(use_bvh)
+		printf("build triangles BVH : %d nodes in %gms (host)\n", bvh.nnodes, runtime_bvh_ms);
+	else if(use_lbvh){
+		printf("morton codes : %d triangles in %gms: %g GB/s\n",
+			naccel, runtime_computeMortonCodes_ms, computeMortonCodes_bw_gbs);
+		printf("radix sort : %d keys in %gms: %g GB/s\n",
+			naccel, runtime_sort_ms, sort_bw_gbs);
+		printf("LBVH hierarchy : %d inner nodes in %gms: %g GB/s\n",
+			naccel-1, runtime_buildLBVHHierarchy_ms, buildLBVHHierarchy_bw_gbs);
+		printf("LBVH bounds : %d leaves in %gms: %g GB/s\n",
+			naccel, runtime_fitLBVHBounds_ms, fitLBVHBounds_bw_gbs);
+		printf("build triangles LBVH : %d nodes in %gms: %g GB/s\n",
+			lbvh_nnodes, runtime_buildLBVH_ms, buildLBVH_bw_gbs);
+	}
+	else if(use_prebuilt_grid)
+		printf("init triangles grid : %d cells prebuilt in scene.bin\n", ncells);
+	else{
+		printf("count triangles grid : %d triangles in %gms: %g GB/s\n",
+			naccel, runtime_countTrianglesGrid_ms, countTrianglesGrid_bw_gbs);
+		printf("scan cell counts : %d cells in %gms: %g GB/s\n",
+			ncells+1, runtime_scan_ms, scan_bw_gbs);
+		printf("scatter triangles grid : %u indices in %gms: %g GB/s\n",
+			nindices, runtime_scatterTrianglesGrid_ms, scatterTrianglesGrid_bw_gbs);
+		printf("init triangles grid : %d cells in %gms: %g GB/s\n",
+			ncells, runtime_initTrianglesGrid_ms, initTrianglesGrid_bw_gbs);
+	}
 	printf("rendering : %d pixels in %gms: %g GB/s\n",
 		img_width*img_height, runtime_pathtracer_ms, pathtracer_bw_gbs);
+	printf("%s traversal : %lu rays in %gms: %g Mrays/s\n",
+		use_bvh ? "BVH" : use_lbvh ? "LBVH" : "grid", (unsigned long)total_rays, runtime_pathtracer_ms, pathtracer_mrays);
 	printf("read render data : %ld uchar in %gms: %g GB/s\n",
 		resultInfo.data_size, runtime_getRender_ms, getRender_bw_gbs);
+	if(tile_ms > 0) tile_report(&ts);
+	if(use_wavefront) wavefrontReport(&wf);
+	if(use_persistent){
+		const double runtime_static_ms = runtime_ms(static_evt);
+		printf("static mapping : %lu rays in %gms: %g Mrays/s\n",
+			(unsigned long)total_rays, runtime_static_ms, total_rays/1.0e3/runtime_static_ms);
+		printf("persistent threads : %zu work-groups of %zu, %lu rays in %gms: %g Mrays/s (%.2fx the static mapping)\n",
+			persistent_groups, persistent_lws, (unsigned long)total_rays, runtime_pathtracer_ms, pathtracer_mrays,
+			runtime_static_ms/runtime_pathtracer_ms);
+	}
 	printf("\nTotal time: %g ms.\n", total_time_ms);
 
-	err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
-	ocl_check(err, "unmap render");
-	clReleaseMemObject(d_render);
+	if(tile_ms > 0){
+		free(resultInfo.data);
+		clReleaseCommandQueue(read_que);
+	}
+	else{
+		err = clEnqueueUnmapMemObject(que, d_render, resultInfo.data, 0, NULL, NULL);
+		ocl_check(err, "unmap render");
+		clReleaseMemObject(d_render);
+	}
+	clReleaseMemObject(d_Triangles);
+	clReleaseMemObject(d_Primitives);
+	if(triangle_layout > 0) clReleaseMemObject(d_TriangleData);
+	clReleaseMemObject(d_Accel);
+	clReleaseMemObject(d_AccelIndices);
+	clReleaseMemObject(d_nrays);
+	if(use_wavefront) releaseWavefront(&wf);
+	if(use_persistent) clReleaseMemObject(d_next_pixel);
+	if(use_bvh) free_bvh(&bvh);
 
 	free(Spheres);
 	free(Squares);
-	free(Triangles);
-	free(TrianglesGrid);
+	if(use_scene_bin) unload_scene_bin(&scene);
+	else free(Triangles);
+	if(AccelTriangles != Triangles) free(AccelTriangles);
+	free(Primitives);
 	free(scenelights);
 
+	clReleaseKernel(pathtracer_persistent_k);
 	clReleaseKernel(pathtracer_k);
+	clReleaseKernel(precomputeTriangles_k);
 	clReleaseProgram(prog);
 	clReleaseCommandQueue(que);
 	clReleaseContext(ctx);
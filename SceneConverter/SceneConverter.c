@@ -0,0 +1,243 @@
+//Converts the text scene files (triangles.txt, lights.txt, spheres.txt, squares.txt)
+//into the binary, memory-mappable scene container described in ../scenebin.h
+//Optionally stores a prebuilt triangle grid, so the grid path tracer can skip its build step
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#define MAX 256
+#define MAX_LIGHTS 5
+
+#include "../scenebin.h"
+
+typedef struct{
+	cl_float4 v0;
+	cl_float4 v1;
+	cl_float4 v2;
+} cl_Triangle;
+
+typedef struct{
+	cl_float4 vmin;
+	cl_float4 vmax;
+} cl_Box;
+
+int max(int x, int y){
+	if(x > y) return x;
+	return y;
+}
+
+int min(int x, int y){
+	if(x < y) return x;
+	return y;
+}
+
+//Method to retrieve spheres/squares information from file
+int parseArrayFromFile(char * fileName, cl_int * arr){
+	FILE * textFile;
+	char str[MAX];
+	int linectr = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	do{
+		fgets(str, MAX, textFile);
+		arr[linectr] = atoi(str);
+		linectr++;
+	}while(!feof(textFile) && linectr < 9);
+	fclose(textFile);
+	return 1;
+}
+
+//Count the triangles in triangles.txt (9 coordinates each, blank lines are separators)
+int countTrianglesInFile(char * fileName){
+	FILE * textFile;
+	char str[MAX];
+	int ncoords = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(fgets(str, MAX, textFile)){
+		if(str[0] != '\n' && str[0] != '\r' && str[0] != '\0') ncoords++;
+	}
+	fclose(textFile);
+	return ncoords/9;
+}
+
+//Method to retrieve vertices from triangles.txt
+//Also computes the min and max positions for the bounding box that contains all the triangles
+int parseTrianglesFromFile(char * fileName, cl_Triangle * arr, int ntriangles, cl_Box * trianglesBox){
+	FILE * textFile;
+	char str[MAX];
+	int curr_coord = 0;
+	float value;
+	cl_float4 curr_max = { .x = -CL_FLT_MAX, .y = -CL_FLT_MAX, .z = -CL_FLT_MAX, .w = 0};
+	cl_float4 curr_min = { .x = CL_FLT_MAX, .y = CL_FLT_MAX, .z = CL_FLT_MAX, .w = 0};
+	textFile = fopen(fileName, "r");
+	while(fgets(str, MAX, textFile) && curr_coord < ntriangles*9){
+		if(str[0] == '\n' || str[0] == '\r' || str[0] == '\0') continue;	//END_VERTEX and END_TRIANGLE
+		value = atof(str);
+		const int axis = curr_coord % 3;
+		cl_float4 * vertex = &arr[curr_coord/9].v0 + (curr_coord/3) % 3;
+		vertex->s[axis] = value;
+		vertex->w = 0.0f;
+		if (value < curr_min.s[axis]) curr_min.s[axis] = value;
+		if (value > curr_max.s[axis]) curr_max.s[axis] = value;
+		curr_coord++;
+	}
+	fclose(textFile);
+	trianglesBox->vmax = curr_max;
+	trianglesBox->vmin = curr_min;
+	return curr_coord/9;
+}
+
+//Method to retrieve point lights from lights.txt
+int parseLightsFromFile(char * fileName, cl_float4 * arr){
+	FILE * textFile;
+	char x[MAX], y[MAX], z[MAX], w[MAX];
+	int curr_light = 0;
+	textFile = fopen(fileName, "r");
+	if(!textFile){
+		fprintf(stderr, "could not open %s\n", fileName);
+		exit(1);
+	}
+	while(!feof(textFile) && curr_light < MAX_LIGHTS){
+		fgets(x, MAX, textFile);
+		fgets(y, MAX, textFile);
+		fgets(z, MAX, textFile);
+		fgets(w, MAX, textFile);
+		arr[curr_light].x = atof(x);
+		arr[curr_light].y = atof(y);
+		arr[curr_light].z = atof(z);
+		arr[curr_light].w = atof(w);
+		curr_light++;
+	}
+	fclose(textFile);
+	return curr_light;
+}
+
+//Range of cells overlapped by the bounding box of a triangle
+void triangleCells_host(const cl_Triangle t, cl_int4 grid_res, cl_float4 cell_size, cl_Box trianglesBox, int * cmin, int * cmax){
+	for (int k = 0; k < 3; ++k){
+		const float fmin = fminf(t.v0.s[k], fminf(t.v1.s[k], t.v2.s[k]));
+		const float fmax = fmaxf(t.v0.s[k], fmaxf(t.v1.s[k], t.v2.s[k]));
+		//Convert to cell coordinates
+		cmin[k] = max(0, min((int)((fmin - trianglesBox.vmin.s[k])/cell_size.s[k]), grid_res.s[k]-1));
+		cmax[k] = max(0, min((int)((fmax - trianglesBox.vmin.s[k])/cell_size.s[k]), grid_res.s[k]-1));
+	}
+}
+
+//Same count/scan/scatter build as the grid kernels in CLSuperPathTracer_trianglegrid
+//CellOffsets must hold ncells+1 zeroed elements, returns the cell triangle indices
+//(cl_ushort, or cl_uint if the scene has more than 65536 triangles)
+void * initTrianglesGrid_host(cl_uint * CellOffsets, cl_uint * nindices, cl_Triangle * Triangles, cl_int4 grid_res, cl_float4 cell_size, cl_Box trianglesBox, cl_int ntriangles){
+	const int ncells = grid_res.x*grid_res.y*grid_res.z;
+	const int use_index32 = ntriangles > CL_USHRT_MAX + 1;
+	int cmin[3], cmax[3];
+	//Count
+	for(int curr_triangle=0; curr_triangle < ntriangles; ++curr_triangle){
+		triangleCells_host(Triangles[curr_triangle], grid_res, cell_size, trianglesBox, cmin, cmax);
+		for(int z = cmin[2]; z <= cmax[2]; ++z)
+			for(int y = cmin[1]; y <= cmax[1]; ++y)
+				for(int x = cmin[0]; x <= cmax[0]; ++x)
+					CellOffsets[z*grid_res.x*grid_res.y + y*grid_res.x + x]++;
+	}
+	//Exclusive scan
+	cl_uint sum = 0;
+	for(int c = 0; c <= ncells; ++c){
+		const cl_uint count = CellOffsets[c];
+		CellOffsets[c] = sum;
+		sum += count;
+	}
+	*nindices = sum;
+	//Scatter
+	cl_uint * CellCursor = malloc(sizeof(cl_uint)*ncells);
+	memcpy(CellCursor, CellOffsets, sizeof(cl_uint)*ncells);
+	void * CellTriangles = malloc((use_index32 ? sizeof(cl_uint) : sizeof(cl_ushort))*(sum > 0 ? sum : 1));
+	for(int curr_triangle=0; curr_triangle < ntriangles; ++curr_triangle){
+		triangleCells_host(Triangles[curr_triangle], grid_res, cell_size, trianglesBox, cmin, cmax);
+		for(int z = cmin[2]; z <= cmax[2]; ++z){
+			for(int y = cmin[1]; y <= cmax[1]; ++y){
+				for(int x = cmin[0]; x <= cmax[0]; ++x){
+					const cl_uint pos = CellCursor[z*grid_res.x*grid_res.y + y*grid_res.x + x]++;
+					if (use_index32) ((cl_uint*)CellTriangles)[pos] = curr_triangle;
+					else ((cl_ushort*)CellTriangles)[pos] = curr_triangle;
+				}
+			}
+		}
+	}
+	free(CellCursor);
+	return CellTriangles;
+}
+
+int main(int argc, char* argv[]){
+
+	const char * outName = "scene.bin";
+	float CELL_SIZE_MODIFIER = 3.0f;
+	printf("Usage: %s [output_file] [CELL_SIZE_MODIFIER]\nLoads data from triangles.txt, lights.txt, spheres.txt and squares.txt\nA CELL_SIZE_MODIFIER of 0 stores no prebuilt grid\n", argv[0]);
+
+	if(argc > 1){
+		outName = argv[1];
+	}
+	if(argc > 2){
+		CELL_SIZE_MODIFIER = atof(argv[2]);
+	}
+
+	SceneHeader header;
+	memset(&header, 0, sizeof(header));
+
+	cl_float4 scenelights[MAX_LIGHTS];
+	parseArrayFromFile("spheres.txt", header.Spheres);
+	parseArrayFromFile("squares.txt", header.Squares);
+	header.nlights = parseLightsFromFile("lights.txt", scenelights);
+
+	cl_int ntriangles = countTrianglesInFile("triangles.txt");
+	cl_Triangle * Triangles = calloc(ntriangles > 0 ? ntriangles : 1, sizeof(cl_Triangle));
+	cl_Box trianglesBox;
+	ntriangles = parseTrianglesFromFile("triangles.txt", Triangles, ntriangles, &trianglesBox);
+	header.ntriangles = ntriangles;
+	header.vmin = trianglesBox.vmin;
+	header.vmax = trianglesBox.vmax;
+
+	printf("Number of triangles: %d\n", ntriangles);
+	printf("Number of lights: %d\n", header.nlights);
+	printf("Triangles bounding box values:\nvmax: %f %f %f, vmin: %f %f %f\n", trianglesBox.vmax.x, trianglesBox.vmax.y, trianglesBox.vmax.z, trianglesBox.vmin.x, trianglesBox.vmin.y, trianglesBox.vmin.z);
+
+	cl_uint * CellOffsets = NULL;
+	void * CellTriangles = NULL;
+	if(CELL_SIZE_MODIFIER > 0 && ntriangles > 0){
+		//Same grid sizing as CLSuperPathTracer_trianglegrid
+		cl_float4 grid_size;
+		for (int i=0; i<3; ++i) grid_size.s[i] = trianglesBox.vmax.s[i] - trianglesBox.vmin.s[i];
+		float cubeRoot = cbrt(CELL_SIZE_MODIFIER*ntriangles/(grid_size.s0 * grid_size.s1 * grid_size.s2));
+		for (int i=0; i<3; ++i){
+			header.grid_res.s[i] = (int)(floor(grid_size.s[i] * cubeRoot));
+			header.grid_res.s[i] = max(1, min(header.grid_res.s[i], 128));
+			header.cell_size.s[i] = grid_size.s[i]/header.grid_res.s[i];
+		}
+		const int ncells = header.grid_res.x*header.grid_res.y*header.grid_res.z;
+		header.cell_size_modifier = CELL_SIZE_MODIFIER;
+		header.index_bytes = ntriangles > CL_USHRT_MAX + 1 ? sizeof(cl_uint) : sizeof(cl_ushort);
+		CellOffsets = calloc(ncells+1, sizeof(cl_uint));
+		CellTriangles = initTrianglesGrid_host(CellOffsets, &header.grid_nindices, Triangles, header.grid_res, header.cell_size, trianglesBox, ntriangles);
+		header.grid_memsize = sizeof(cl_uint)*(ncells+1);
+		header.cell_indices_memsize = (cl_ulong)header.index_bytes*header.grid_nindices;
+		printf("Triangles grid size: %d x %d x %d, %u triangle indices\n", header.grid_res.x, header.grid_res.y, header.grid_res.z, header.grid_nindices);
+	}
+
+	if(save_scene_bin(outName, &header, Triangles, scenelights, CellOffsets, CellTriangles) != 0){
+		exit(1);
+	}
+	printf("\nSuccessfully created scene file %s\n", outName);
+
+	free(Triangles);
+	free(CellOffsets);
+	free(CellTriangles);
+	return 0;
+}
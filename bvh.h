@@ -0,0 +1,256 @@
+#ifndef BVH_H
+#define BVH_H
+
+/* Bounding volume hierarchy over triangles, built on the host with binned SAH.
+ * Nodes are stored depth-first (a node is always followed by its left subtree)
+ * so the traversal kernel can walk them with a small explicit stack.
+ * Leaves do not reorder the triangles: they point into an index array instead,
+ * so the same triangle buffer can be shared with the other acceleration structures.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 4	//Always split bigger nodes if SAH finds a split
+#define BVH_MAX_DEPTH 48	//Deeper nodes become leaves, bounds the kernel stack
+
+typedef struct{
+	cl_float4 vmin;	//w: split axis of inner nodes
+	cl_float4 vmax;
+	cl_int left;	//Child node indices (inner nodes)
+	cl_int right;
+	cl_int first;	//Range in the index array (leaves, count > 0)
+	cl_int count;
+} cl_BVHNode;
+
+typedef struct{
+	cl_BVHNode * nodes;
+	cl_uint * indices;
+	cl_int nnodes;
+	cl_int depth;	//Number of levels, the traversal stack needs depth entries
+} BVH;
+
+typedef struct{
+	float vmin[3];
+	float vmax[3];
+} bvh_aabb;
+
+typedef struct{
+	bvh_aabb * boxes;	//Per-triangle bounds
+	float * centroids;
+	cl_uint * indices;
+	cl_BVHNode * nodes;
+	cl_int nnodes;
+	cl_int depth;
+} bvh_builder;
+
+static void bvh_aabb_empty(bvh_aabb *b)
+{
+	for (int k = 0; k < 3; ++k) {
+		b->vmin[k] = CL_FLT_MAX;
+		b->vmax[k] = -CL_FLT_MAX;
+	}
+}
+
+static void bvh_aabb_grow(bvh_aabb *b, const bvh_aabb *other)
+{
+	for (int k = 0; k < 3; ++k) {
+		if (other->vmin[k] < b->vmin[k]) b->vmin[k] = other->vmin[k];
+		if (other->vmax[k] > b->vmax[k]) b->vmax[k] = other->vmax[k];
+	}
+}
+
+static float bvh_aabb_area(const bvh_aabb *b)
+{
+	const float dx = b->vmax[0] - b->vmin[0];
+	const float dy = b->vmax[1] - b->vmin[1];
+	const float dz = b->vmax[2] - b->vmin[2];
+	if (dx < 0 || dy < 0 || dz < 0)
+		return 0;
+	return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+static void bvh_make_leaf(bvh_builder *b, cl_int node, cl_int begin, cl_int end)
+{
+	b->nodes[node].left = b->nodes[node].right = -1;
+	b->nodes[node].first = begin;
+	b->nodes[node].count = end - begin;
+}
+
+/* Build the subtree of the triangles indices[begin..end) and return its node index */
+static cl_int bvh_build_node(bvh_builder *b, cl_int begin, cl_int end, cl_int depth)
+{
+	const cl_int node = b->nnodes++;
+	const cl_int n = end - begin;
+	if (depth + 1 > b->depth)
+		b->depth = depth + 1;
+
+	bvh_aabb bounds, cbounds;
+	bvh_aabb_empty(&bounds);
+	bvh_aabb_empty(&cbounds);
+	for (cl_int i = begin; i < end; ++i) {
+		const cl_uint t = b->indices[i];
+		bvh_aabb c;
+		memcpy(c.vmin, b->centroids + 3*t, sizeof(c.vmin));
+		memcpy(c.vmax, b->centroids + 3*t, sizeof(c.vmax));
+		bvh_aabb_grow(&bounds, b->boxes + t);
+		bvh_aabb_grow(&cbounds, &c);
+	}
+	cl_BVHNode *nd = b->nodes + node;
+	for (int k = 0; k < 3; ++k) {
+		nd->vmin.s[k] = bounds.vmin[k];
+		nd->vmax.s[k] = bounds.vmax[k];
+	}
+	nd->vmin.s[3] = nd->vmax.s[3] = 0;
+
+	if (n <= 1 || depth + 1 >= BVH_MAX_DEPTH) {
+		bvh_make_leaf(b, node, begin, end);
+		return node;
+	}
+
+	/* Binned SAH: pick the bin boundary with the lowest
+	 * count_left*area_left + count_right*area_right over the three axes */
+	float best_cost = CL_FLT_MAX;
+	int best_axis = -1, best_split = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		const float cmin = cbounds.vmin[axis];
+		const float extent = cbounds.vmax[axis] - cmin;
+		if (extent <= 0)
+			continue;
+		int counts[BVH_BINS] = {0};
+		bvh_aabb bins[BVH_BINS];
+		for (int i = 0; i < BVH_BINS; ++i)
+			bvh_aabb_empty(bins + i);
+		for (cl_int i = begin; i < end; ++i) {
+			const cl_uint t = b->indices[i];
+			int bin = (int)(BVH_BINS*(b->centroids[3*t + axis] - cmin)/extent);
+			if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+			counts[bin]++;
+			bvh_aabb_grow(bins + bin, b->boxes + t);
+		}
+		//Sweep from the right to get the cost of the right side of every split
+		float right_area[BVH_BINS];
+		int right_count[BVH_BINS];
+		bvh_aabb acc;
+		bvh_aabb_empty(&acc);
+		int count = 0;
+		for (int i = BVH_BINS - 1; i > 0; --i) {
+			bvh_aabb_grow(&acc, bins + i);
+			count += counts[i];
+			right_area[i] = bvh_aabb_area(&acc);
+			right_count[i] = count;
+		}
+		bvh_aabb_empty(&acc);
+		count = 0;
+		for (int i = 0; i < BVH_BINS - 1; ++i) {
+			bvh_aabb_grow(&acc, bins + i);
+			count += counts[i];
+			if (count == 0 || right_count[i+1] == 0)
+				continue;
+			const float cost = count*bvh_aabb_area(&acc) + right_count[i+1]*right_area[i+1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i + 1;
+			}
+		}
+	}
+
+	//Splitting costs one extra box test per ray, in units of triangle tests relative to the node area
+	const float leaf_cost = n*bvh_aabb_area(&bounds);
+	if (best_axis < 0 || (n <= BVH_MAX_LEAF_SIZE && best_cost + bvh_aabb_area(&bounds) >= leaf_cost)) {
+		bvh_make_leaf(b, node, begin, end);
+		return node;
+	}
+
+	//Partition the indices around the chosen bin boundary
+	const float cmin = cbounds.vmin[best_axis];
+	const float extent = cbounds.vmax[best_axis] - cmin;
+	cl_int mid = begin;
+	for (cl_int i = begin; i < end; ++i) {
+		const cl_uint t = b->indices[i];
+		int bin = (int)(BVH_BINS*(b->centroids[3*t + best_axis] - cmin)/extent);
+		if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+		if (bin < best_split) {
+			b->indices[i] = b->indices[mid];
+			b->indices[mid++] = t;
+		}
+	}
+
+	b->nodes[node].vmin.s[3] = best_axis;
+	b->nodes[node].first = b->nodes[node].count = 0;
+	const cl_int left = bvh_build_node(b, begin, mid, depth + 1);
+	const cl_int right = bvh_build_node(b, mid, end, depth + 1);
+	b->nodes[node].left = left;
+	b->nodes[node].right = right;
+	return node;
+}
+
+/* Build a BVH over ntriangles triangles, given as 3 cl_float4 vertices each.
+ * Returns 0 on success.
+ */
+int build_bvh(const cl_float4 *vertices, cl_int ntriangles, BVH *bvh)
+{
+	memset(bvh, 0, sizeof(*bvh));
+	if (ntriangles <= 0) {
+		fprintf(stderr, "can't build a BVH without triangles\n");
+		return 1;
+	}
+
+	bvh_builder b;
+	b.boxes = malloc(sizeof(bvh_aabb)*ntriangles);
+	b.centroids = malloc(sizeof(float)*3*ntriangles);
+	b.indices = malloc(sizeof(cl_uint)*ntriangles);
+	b.nodes = malloc(sizeof(cl_BVHNode)*(2*ntriangles - 1));
+	b.nnodes = 0;
+	b.depth = 0;
+	if (!b.boxes || !b.centroids || !b.indices || !b.nodes) {
+		fprintf(stderr, "can't allocate memory for the BVH of %d triangles\n", ntriangles);
+		free(b.boxes);
+		free(b.centroids);
+		free(b.indices);
+		free(b.nodes);
+		return 1;
+	}
+
+	for (cl_int t = 0; t < ntriangles; ++t) {
+		bvh_aabb_empty(b.boxes + t);
+		for (int v = 0; v < 3; ++v) {
+			for (int k = 0; k < 3; ++k) {
+				const float x = vertices[3*t + v].s[k];
+				if (x < b.boxes[t].vmin[k]) b.boxes[t].vmin[k] = x;
+				if (x > b.boxes[t].vmax[k]) b.boxes[t].vmax[k] = x;
+			}
+		}
+		for (int k = 0; k < 3; ++k)
+			b.centroids[3*t + k] = 0.5f*(b.boxes[t].vmin[k] + b.boxes[t].vmax[k]);
+		b.indices[t] = t;
+	}
+
+	bvh_build_node(&b, 0, ntriangles, 0);
+
+	free(b.boxes);
+	free(b.centroids);
+	bvh->nodes = b.nodes;
+	bvh->indices = b.indices;
+	bvh->nnodes = b.nnodes;
+	bvh->depth = b.depth;
+	return 0;
+}
+
+void free_bvh(BVH *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->indices);
+	memset(bvh, 0, sizeof(*bvh));
+}
+
+#endif
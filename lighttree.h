@@ -0,0 +1,149 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+/* Light tree over the virtual point lights, built on the host after the light tracing pass.
+ * Every node bounds a cluster of VLPs and carries their total intensity. A shading point
+ * walks it from the root, choosing a child with probability proportional to an estimate
+ * of its contribution, and divides the contribution of the VLP it reaches by the product
+ * of those probabilities: an unbiased estimate of the sum over all the VLPs, in a number
+ * of steps logarithmic in their count.
+ * Every node also names a representative, its brightest VLP, for the Lightcuts shading
+ * of the path tracers: a cut through the tree is refined from the root until the error
+ * bound of each cluster, shaded as its representative with the total intensity, is small.
+ * Nodes are stored depth-first (a node is always followed by its left subtree), leaves
+ * hold a single VLP. VLPs of zero intensity are left out.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct{
+	cl_float4 vmin;	//w: total intensity of the VLPs below
+	cl_float4 vmax;
+	cl_int left;	//Child node indices (inner nodes), -1 for leaves
+	cl_int right;
+	cl_int light;	//Index of the representative VLP in the VLP buffer, the VLP of a leaf
+	cl_int count;	//VLPs below
+} cl_LightNode;
+
+typedef struct{
+	cl_LightNode * nodes;
+	cl_int nnodes;
+	cl_int nlights;	//VLPs in the tree, those of non-zero intensity
+	cl_int depth;
+} LightTree;
+
+typedef struct{
+	const cl_float4 * lights;
+	cl_int * indices;
+	cl_LightNode * nodes;
+	cl_int nnodes;
+	cl_int depth;
+} lighttree_builder;
+
+/* Build the subtree of the lights indices[begin..end) and return its node index */
+static cl_int lighttree_build_node(lighttree_builder *b, cl_int begin, cl_int end, cl_int depth)
+{
+	const cl_int node = b->nnodes++;
+	if (depth + 1 > b->depth)
+		b->depth = depth + 1;
+
+	cl_LightNode *nd = b->nodes + node;
+	float intensity = 0;
+	cl_int brightest = b->indices[begin];
+	for (int k = 0; k < 3; ++k) {
+		nd->vmin.s[k] = CL_FLT_MAX;
+		nd->vmax.s[k] = -CL_FLT_MAX;
+	}
+	for (cl_int i = begin; i < end; ++i) {
+		const cl_float4 l = b->lights[b->indices[i]];
+		for (int k = 0; k < 3; ++k) {
+			if (l.s[k] < nd->vmin.s[k]) nd->vmin.s[k] = l.s[k];
+			if (l.s[k] > nd->vmax.s[k]) nd->vmax.s[k] = l.s[k];
+		}
+		intensity += l.s[3];
+		if (l.s[3] > b->lights[brightest].s[3])
+			brightest = b->indices[i];
+	}
+	nd->vmin.s[3] = intensity;
+	nd->vmax.s[3] = 0;
+	nd->light = brightest;
+	nd->count = end - begin;
+
+	if (end - begin == 1) {
+		nd->left = nd->right = -1;
+		return node;
+	}
+
+	//Split at the middle of the longest axis, or in two halves if the lights are all on one side
+	int axis = 0;
+	for (int k = 1; k < 3; ++k)
+		if (nd->vmax.s[k] - nd->vmin.s[k] > nd->vmax.s[axis] - nd->vmin.s[axis])
+			axis = k;
+	const float middle = 0.5f*(nd->vmin.s[axis] + nd->vmax.s[axis]);
+	cl_int mid = begin;
+	for (cl_int i = begin; i < end; ++i) {
+		const cl_int l = b->indices[i];
+		if (b->lights[l].s[axis] < middle) {
+			b->indices[i] = b->indices[mid];
+			b->indices[mid++] = l;
+		}
+	}
+	if (mid == begin || mid == end)
+		mid = begin + (end - begin)/2;
+
+	const cl_int left = lighttree_build_node(b, begin, mid, depth + 1);
+	const cl_int right = lighttree_build_node(b, mid, end, depth + 1);
+	b->nodes[node].left = left;
+	b->nodes[node].right = right;
+	return node;
+}
+
+/* Build the light tree of the nlights VLPs in lights (position, intensity in w).
+ * A tree without lights has no nodes. Returns 0 on success.
+ */
+int build_light_tree(const cl_float4 *lights, cl_int nlights, LightTree *tree)
+{
+	memset(tree, 0, sizeof(*tree));
+	lighttree_builder b;
+	b.lights = lights;
+	b.indices = malloc(sizeof(cl_int)*(nlights > 0 ? nlights : 1));
+	b.nodes = malloc(sizeof(cl_LightNode)*(nlights > 0 ? 2*nlights - 1 : 1));
+	b.nnodes = 0;
+	b.depth = 0;
+	if (!b.indices || !b.nodes) {
+		fprintf(stderr, "can't allocate memory for the light tree of %d lights\n", nlights);
+		free(b.indices);
+		free(b.nodes);
+		return 1;
+	}
+
+	cl_int n = 0;
+	for (cl_int l = 0; l < nlights; ++l)
+		if (lights[l].s[3] > 0)
+			b.indices[n++] = l;
+	if (n > 0)
+		lighttree_build_node(&b, 0, n, 0);
+
+	free(b.indices);
+	tree->nodes = b.nodes;
+	tree->nnodes = b.nnodes;
+	tree->nlights = n;
+	tree->depth = b.depth;
+	return 0;
+}
+
+void free_light_tree(LightTree *tree)
+{
+	free(tree->nodes);
+	memset(tree, 0, sizeof(*tree));
+}
+
+#endif
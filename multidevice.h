@@ -0,0 +1,154 @@
+#ifndef MULTIDEVICE_H
+#define MULTIDEVICE_H
+
+/* Multi-device rendering with dynamic tile stealing.
+ * Every device (see select_devices in ocl_boiler.h) gets its own context,
+ * queues and program, and a host thread running the tile loop of tiles.h.
+ * The tile cursor is shared: a device takes the next tile of the frame as soon
+ * as one of its ring buffers is free, so faster devices render more tiles.
+ * Tile sizes adapt per device, to the same target time.
+ *
+ * Enabled by OCL_MULTIDEVICE=1 in the environment. On a single CPU device,
+ * OCL_SUBDEVICES=n splits it in n sub-devices to exercise the scheduling.
+ */
+
+#include <pthread.h>
+
+#include "tiles.h"
+
+#define MAX_RENDER_DEVICES 16
+
+typedef struct RenderDevice RenderDevice;
+
+/* Enqueue the kernels rendering tile into d_tile on rd->que, returning
+ * the first and last of them (the same event for a single kernel) */
+typedef void (*render_tile_fn)(RenderDevice *rd, cl_mem d_tile, const Tile *tile,
+	cl_event *first_evt, cl_event *last_evt);
+
+struct RenderDevice{
+	cl_device_id dev;
+	cl_context ctx;
+	cl_command_queue que;
+	cl_command_queue read_que;
+	char name[BUFSIZE];
+	void *data;	//Program, kernels and buffers of the path tracer on this device
+	TileScheduler ts;
+	//Shared by all the devices
+	pthread_mutex_t *lock;
+	render_tile_fn render;
+	void *img;
+	size_t bytes_per_pixel;
+};
+
+int use_multidevice()
+{
+	const char * const env = getenv("OCL_MULTIDEVICE");
+	return env && env[0] != '\0' && strcmp(env, "0") != 0;
+}
+
+/* Select the devices of platform p, with a context and two queues each
+ * (rendering and reading tiles back), and return how many */
+cl_uint create_render_devices(cl_platform_id p, RenderDevice *rd, cl_uint max_devs)
+{
+	cl_device_id devs[MAX_RENDER_DEVICES];
+	const cl_uint ndevs = select_devices(p, devs, max_devs < MAX_RENDER_DEVICES ? max_devs : MAX_RENDER_DEVICES);
+	for (cl_uint i = 0; i < ndevs; ++i) {
+		memset(rd + i, 0, sizeof(*rd));
+		rd[i].dev = devs[i];
+		cl_int err = clGetDeviceInfo(devs[i], CL_DEVICE_NAME, BUFSIZE, rd[i].name, NULL);
+		ocl_check(err, "device name");
+		rd[i].ctx = create_context(p, devs[i]);
+		rd[i].que = create_queue(rd[i].ctx, devs[i]);
+		rd[i].read_que = create_queue(rd[i].ctx, devs[i]);
+	}
+	return ndevs;
+}
+
+static void *render_device_thread(void *arg)
+{
+	RenderDevice *rd = arg;
+	TileRing ring;
+	tile_ring_init(&ring, rd->ctx, rd->bytes_per_pixel*rd->ts.max_pixels);
+	Tile tile;
+	for (;;) {
+		tile_ring_retire(&ring, &rd->ts, ring.next);
+		pthread_mutex_lock(rd->lock);
+		const int more = tile_next(&rd->ts, &tile);
+		pthread_mutex_unlock(rd->lock);
+		if (!more)
+			break;
+		cl_event first_evt, last_evt;
+		rd->render(rd, ring.buf[ring.next], &tile, &first_evt, &last_evt);
+		tile_end(&ring, &rd->ts, &tile, rd->que, first_evt, last_evt,
+			rd->read_que, rd->img, rd->bytes_per_pixel);
+	}
+	tile_ring_finish(&ring, &rd->ts);
+	return NULL;
+}
+
+/* Render a width x height frame of bytes_per_pixel pixels into img on the
+ * ndevs devices, tiles being multiples of align_x x align_y pixels and
+ * tile_bytes_per_pixel the device memory a tile needs per pixel.
+ * Returns the wall-clock time in milliseconds */
+double render_multidevice(RenderDevice *rd, cl_uint ndevs, cl_int width, cl_int height,
+	cl_int align_x, cl_int align_y, size_t tile_bytes_per_pixel, double target_ms,
+	void *img, size_t bytes_per_pixel, render_tile_fn render)
+{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_t threads[MAX_RENDER_DEVICES];
+	TileCursor cursor;
+	memset(&cursor, 0, sizeof(cursor));
+
+	//The devices share the bands of the cursor, so they all take the tile size limit of the
+	//smallest: a band opened by one is never too tall for the aligned tiles of another (see tile_next)
+	cl_int max_pixels = CL_INT_MAX;
+	for (cl_uint i = 0; i < ndevs; ++i) {
+		const cl_int dev_pixels = tile_max_pixels(rd[i].dev, tile_bytes_per_pixel);
+		if (dev_pixels < max_pixels) max_pixels = dev_pixels;
+	}
+
+	const double start_ms = wtime_ms();
+	for (cl_uint i = 0; i < ndevs; ++i) {
+		tile_scheduler_init(&rd[i].ts, width, height, align_x, align_y,
+			max_pixels, target_ms);
+		rd[i].ts.cursor = &cursor;
+		rd[i].lock = &lock;
+		rd[i].render = render;
+		rd[i].img = img;
+		rd[i].bytes_per_pixel = bytes_per_pixel;
+		if (pthread_create(threads + i, NULL, render_device_thread, rd + i) != 0) {
+			fprintf(stderr, "can't start the thread of device %u\n", i);
+			exit(1);
+		}
+	}
+	for (cl_uint i = 0; i < ndevs; ++i)
+		pthread_join(threads[i], NULL);
+	return wtime_ms() - start_ms;
+}
+
+void multidevice_report(const RenderDevice *rd, cl_uint ndevs, double wall_ms)
+{
+	cl_long pixels = 0;
+	for (cl_uint i = 0; i < ndevs; ++i)
+		pixels += rd[i].ts.pixels;
+	for (cl_uint i = 0; i < ndevs; ++i) {
+		const TileScheduler *ts = &rd[i].ts;
+		printf("device %u (%s) : %d tiles, %.1f%% of the frame, %gms rendering: %g Mpixel/s\n",
+			i, rd[i].name, ts->ntiles, pixels ? 100.0*ts->pixels/pixels : 0,
+			ts->render_ms, ts->render_ms > 0 ? ts->pixels/1.0e3/ts->render_ms : 0);
+	}
+	printf("all devices : %ld pixels in %gms wall clock: %g Mpixel/s\n",
+		(long)pixels, wall_ms, pixels/1.0e3/wall_ms);
+}
+
+void release_render_devices(RenderDevice *rd, cl_uint ndevs)
+{
+	for (cl_uint i = 0; i < ndevs; ++i) {
+		clReleaseCommandQueue(rd[i].read_que);
+		clReleaseCommandQueue(rd[i].que);
+		clReleaseContext(rd[i].ctx);
+		clReleaseDevice(rd[i].dev);	//No-op unless it is a sub-device
+	}
+}
+
+#endif
@@ -20,6 +20,9 @@ int main(int argc, char *argv[])
 }
 #endif
 
+#ifndef OCL_BOILER_H
+#define OCL_BOILER_H
+
 /* Include the headers defining the OpenCL host API */
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -32,9 +35,18 @@ int main(int argc, char *argv[])
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define BUFSIZE 4096
 
+/* Compiled programs are cached in this directory, one binary per hash of
+ * kernel source, build options, platform, device and driver version.
+ * The OCL_CACHE environment variable overrides the directory, an empty
+ * OCL_CACHE disables the cache */
+#define OCL_CACHE_DIR ".ocl_cache"
+
 /* Check an OpenCL error status, printing a message and exiting
  * in case of failure
  */
@@ -130,6 +142,54 @@ cl_device_id select_device(cl_platform_id p)
 	return choice;
 }
 
+// Fill devs with up to max_devs devices for multi-device rendering and return
+// how many: all the devices of the platform p or, if OCL_SUBDEVICES=n is set,
+// the device chosen by select_device partitioned in n sub-devices with the
+// same number of compute units
+cl_uint select_devices(cl_platform_id p, cl_device_id *devs, cl_uint max_devs)
+{
+	cl_uint ndevs;
+	cl_int err;
+	const char * const env = getenv("OCL_SUBDEVICES");
+	cl_uint nsub = 0;
+	if (env && env[0] != '\0')
+		nsub = atoi(env);
+
+	if (nsub > 0) {
+		cl_device_id parent = select_device(p);
+		cl_uint ncu;
+		err = clGetDeviceInfo(parent, CL_DEVICE_MAX_COMPUTE_UNITS,
+			sizeof(ncu), &ncu, NULL);
+		ocl_check(err, "compute units of device to partition");
+		if (nsub > max_devs) nsub = max_devs;
+		if (nsub > ncu) nsub = ncu;
+
+		cl_device_partition_property *props = malloc((nsub + 2)*sizeof(*props));
+		props[0] = CL_DEVICE_PARTITION_BY_COUNTS;
+		for (cl_uint i = 0; i < nsub; ++i)
+			props[i + 1] = ncu/nsub;
+		props[nsub + 1] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+		err = clCreateSubDevices(parent, props, nsub, devs, &ndevs);
+		ocl_check(err, "create %u sub-devices of %u compute units", nsub, ncu/nsub);
+		free(props);
+		printf("partitioned into %u sub-devices of %u compute units\n", ndevs, ncu/nsub);
+		return ndevs;
+	}
+
+	err = clGetDeviceIDs(p, CL_DEVICE_TYPE_ALL, max_devs, devs, &ndevs);
+	ocl_check(err, "getting device IDs");
+	if (ndevs > max_devs) ndevs = max_devs;
+
+	for (cl_uint i = 0; i < ndevs; ++i) {
+		char buffer[BUFSIZE];
+		err = clGetDeviceInfo(devs[i], CL_DEVICE_NAME, BUFSIZE,
+			buffer, NULL);
+		ocl_check(err, "device name");
+		printf("selected device %u: %s\n", i, buffer);
+	}
+	return ndevs;
+}
+
 // Create a one-device context
 cl_context create_context(cl_platform_id p, cl_device_id d)
 {
@@ -157,29 +217,207 @@ cl_command_queue create_queue(cl_context ctx, cl_device_id d)
 	return que;
 }
 
+// Wall-clock time in milliseconds, for the program cache log
+double wtime_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1.0e3 + ts.tv_nsec*1.0e-6;
+}
+
+// 64-bit FNV-1a of len bytes of data, continuing from hash h
+cl_ulong fnv1a(cl_ulong h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+// Directory of the program cache, NULL if disabled
+const char *program_cache_dir()
+{
+	const char * const env = getenv("OCL_CACHE");
+	const char * const dir = env ? env : OCL_CACHE_DIR;
+	return dir[0] == '\0' ? NULL : dir;
+}
+
+// Create the program cache directory if it does not exist yet
+void program_cache_mkdir(const char * const dir)
+{
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		fprintf(stderr, "program cache: can't create %s\n", dir);
+}
+
+// Write the name of the cached binary of `fname` built with `opts` for
+// device `dev` into `path`. Returns 0 on success, 1 if the cache is
+// disabled or the source can't be read
+int program_cache_path(char *path, const char * const fname,
+	cl_device_id dev, const char * const opts)
+{
+	const char * const dir = program_cache_dir();
+	if (!dir)
+		return 1;
+
+	/* The kernels have no #include of their own: the source text and
+	 * the -D options in opts determine the preprocessed source */
+	FILE *fp = fopen(fname, "rb");
+	if (!fp)
+		return 1;
+	cl_ulong h = 0xcbf29ce484222325ULL;
+	char buf[BUFSIZE];
+	size_t nread;
+	while ((nread = fread(buf, 1, BUFSIZE, fp)) > 0)
+		h = fnv1a(h, buf, nread);
+	fclose(fp);
+	h = fnv1a(h, opts, strlen(opts) + 1);
+
+	cl_int err;
+	cl_platform_id p;
+	err = clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(p), &p, NULL);
+	ocl_check(err, "get device platform");
+	const cl_platform_info plat_info[] = { CL_PLATFORM_NAME, CL_PLATFORM_VERSION };
+	for (int i = 0; i < 2; ++i) {
+		memset(buf, 0, BUFSIZE);
+		err = clGetPlatformInfo(p, plat_info[i], BUFSIZE, buf, NULL);
+		ocl_check(err, "get platform info");
+		h = fnv1a(h, buf, strlen(buf) + 1);
+	}
+	const cl_device_info dev_info[] = { CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION };
+	for (int i = 0; i < 3; ++i) {
+		memset(buf, 0, BUFSIZE);
+		err = clGetDeviceInfo(dev, dev_info[i], BUFSIZE, buf, NULL);
+		ocl_check(err, "get device info");
+		h = fnv1a(h, buf, strlen(buf) + 1);
+	}
+
+	snprintf(path, BUFSIZE, "%s/%016llx.bin", dir, (unsigned long long)h);
+	return 0;
+}
+
+// Create and build the program from the binary cached in `path`.
+// Returns NULL if there is none or the runtime rejects it
+cl_program load_program_binary(const char * const path, cl_context ctx,
+	cl_device_id dev, const char * const opts)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	const long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	unsigned char *bin = size > 0 ? malloc(size) : NULL;
+	if (!bin || fread(bin, 1, size, fp) != (size_t)size) {
+		free(bin);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	cl_int err, status;
+	size_t bin_size = size;
+	const unsigned char *bin_ptr = bin;
+	cl_program prg = clCreateProgramWithBinary(ctx, 1, &dev, &bin_size, &bin_ptr,
+		&status, &err);
+	free(bin);
+	if (err != CL_SUCCESS || status != CL_SUCCESS)
+		return NULL;
+	if (clBuildProgram(prg, 1, &dev, opts, NULL, NULL) != CL_SUCCESS) {
+		clReleaseProgram(prg);
+		return NULL;
+	}
+	return prg;
+}
+
+// Store the binary of the built program `prg` in `path`, creating the
+// cache directory if needed. Failures only cost a rebuild next time
+void save_program_binary(const char * const path, cl_program prg)
+{
+	size_t bin_size;
+	cl_int err = clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES,
+		sizeof(bin_size), &bin_size, NULL);
+	if (err != CL_SUCCESS || bin_size == 0)
+		return;
+	unsigned char *bin = malloc(bin_size);
+	err = clGetProgramInfo(prg, CL_PROGRAM_BINARIES,
+		sizeof(bin), &bin, NULL);
+	if (err != CL_SUCCESS) {
+		free(bin);
+		return;
+	}
+
+	program_cache_mkdir(program_cache_dir());
+
+	/* Write to a temporary file and rename it, so that concurrent
+	 * runs never load a partial binary */
+	char tmp[BUFSIZE + 32];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	FILE *fp = fopen(tmp, "wb");
+	if (fp) {
+		const size_t written = fwrite(bin, 1, bin_size, fp);
+		fclose(fp);
+		if (written != bin_size || rename(tmp, path) != 0) {
+			remove(tmp);
+			fp = NULL;
+		}
+	}
+	if (fp)
+		printf("program cache: stored %zu bytes in %s\n", bin_size, path);
+	else
+		fprintf(stderr, "program cache: can't write %s\n", path);
+	free(bin);
+}
+
 // Compile the device part of the program, stored in the external
-// file `fname`, for device `dev` in context `ctx`
-cl_program create_program(const char * const fname, cl_context ctx,
-	cl_device_id dev)
+// file `fname`, for device `dev` in context `ctx`, passing the extra
+// build `options` (e.g. -D defines, may be NULL) to the compiler.
+// The compiled binary is cached (see OCL_CACHE_DIR), later runs with
+// the same source, options and device load it instead
+cl_program create_program_with_options(const char * const fname, cl_context ctx,
+	cl_device_id dev, const char * const options)
 {
 	cl_int err, errlog;
 	cl_program prg;
 
 	char src_buf[BUFSIZE + 1];
+	char opt_buf[BUFSIZE + 1];
 	char *log_buf = NULL;
 	size_t logsize;
 	const char* buf_ptr = src_buf;
 	time_t now = time(NULL);
 
+	char cache_path[BUFSIZE + 1];
+	double start_ms;
+
 	memset(src_buf, 0, BUFSIZE);
 
+	snprintf(opt_buf, BUFSIZE, "-I. %s", options ? options : "");
+	if (options && options[0] != '\0')
+		printf("build options: %s\n", opt_buf);
+
+	const int use_cache = (program_cache_path(cache_path, fname, dev, opt_buf) == 0);
+	if (use_cache) {
+		start_ms = wtime_ms();
+		prg = load_program_binary(cache_path, ctx, dev, opt_buf);
+		if (prg) {
+			printf("program cache: hit %s, loaded in %gms\n", cache_path, wtime_ms() - start_ms);
+			return prg;
+		}
+		printf("program cache: miss %s\n", cache_path);
+	}
+
 	snprintf(src_buf, BUFSIZE, "// %s#include \"%s\"\n",
 		ctime(&now), fname);
 	printf("compiling:\n%s", src_buf);
 	prg = clCreateProgramWithSource(ctx, 1, &buf_ptr, NULL, &err);
 	ocl_check(err, "create program");
 
-	err = clBuildProgram(prg, 1, &dev, "-I.", NULL, NULL);
+	start_ms = wtime_ms();
+	err = clBuildProgram(prg, 1, &dev, opt_buf, NULL, NULL);
+	if (err == CL_SUCCESS)
+		printf("compiled in %gms\n", wtime_ms() - start_ms);
 	errlog = clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG,
 		0, NULL, &logsize);
 	ocl_check(errlog, "get program build log size");
@@ -199,11 +437,23 @@ cl_program create_program(const char * const fname, cl_context ctx,
 		log_buf[logsize] = '\0';
 	}
 	printf("=== BUILD LOG ===\n%s\n=========\n", log_buf);
+	free(log_buf);
 	ocl_check(err, "build program");
 
+	if (use_cache)
+		save_program_binary(cache_path, prg);
+
 	return prg;
 }
 
+// Compile the device part of the program, stored in the external
+// file `fname`, for device `dev` in context `ctx`
+cl_program create_program(const char * const fname, cl_context ctx,
+	cl_device_id dev)
+{
+	return create_program_with_options(fname, ctx, dev, NULL);
+}
+
 // Runtime of an event, in nanoseconds. Note that if NS is the
 // runtimen of an event in nanoseconds and NB is the number of byte
 // read and written during the event, NB/NS is the effective bandwidth
@@ -251,3 +501,5 @@ size_t round_mul_up(size_t gws, size_t lws)
 {
 	return ((gws + lws - 1)/lws)*lws;
 }
+
+#endif
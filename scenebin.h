@@ -0,0 +1,221 @@
+#ifndef SCENEBIN_H
+#define SCENEBIN_H
+
+/* Binary scene container shared by the host programs.
+ * The file is memory-mapped and the triangle (and grid) sections are handed
+ * straight to clCreateBuffer with CL_MEM_USE_HOST_PTR, so loading a scene
+ * costs a page-fault walk instead of parsing text.
+ *
+ * Layout (every section starts on a SCENE_ALIGN boundary):
+ *   SceneHeader | triangles (3 float4 per triangle) | lights (float4) |
+ *   grid cell offsets (ncells+1 uint) | grid cell triangle indices
+ *
+ * Use SceneConverter to build a scene.bin from the .txt files.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SCENE_MAGIC 0x4E435353 /* "SSCN" */
+#define SCENE_VERSION 2
+#define SCENE_ALIGN 4096
+
+typedef struct{
+	cl_uint magic;
+	cl_uint version;
+	cl_int ntriangles;
+	cl_int nlights;
+	cl_int Spheres[9];
+	cl_int Squares[9];
+	cl_float4 vmin;	//Triangles bounding box
+	cl_float4 vmax;
+	cl_int4 grid_res;	//All zero if the file holds no prebuilt grid
+	cl_float4 cell_size;
+	cl_float cell_size_modifier;	//CELL_SIZE_MODIFIER the grid was built with
+	cl_uint index_bytes;	//sizeof(cell_index_t) the grid was built with (2 or 4)
+	cl_uint grid_nindices;	//Length of the cell triangle index array
+	cl_ulong triangles_offset;
+	cl_ulong lights_offset;
+	cl_ulong grid_offset;	//Cell offsets
+	cl_ulong grid_memsize;
+	cl_ulong cell_indices_offset;	//Cell triangle indices
+	cl_ulong cell_indices_memsize;
+} SceneHeader;
+
+typedef struct{
+	const SceneHeader * header;
+	void * triangles;	//ntriangles * 3 cl_float4
+	cl_float4 * lights;
+	void * grid;	//Cell offsets, NULL if the file holds no prebuilt grid
+	void * cell_indices;
+	void * map;
+	size_t map_size;
+} SceneFile;
+
+static size_t scene_align_up(size_t offset)
+{
+	return ((offset + SCENE_ALIGN - 1)/SCENE_ALIGN)*SCENE_ALIGN;
+}
+
+/* 1 if size bytes at offset lie within a file of file_size bytes,
+ * without overflowing on the values read from a corrupt header */
+static int scene_section_fits(cl_ulong offset, cl_ulong size, cl_ulong file_size)
+{
+	return offset <= file_size && size <= file_size - offset;
+}
+
+/* 1 if the counts and sections of the header describe data within
+ * a file of file_size bytes, so that nothing past the mapping is read */
+static int scene_header_valid(const SceneHeader *hdr, cl_ulong file_size)
+{
+	if (hdr->ntriangles < 0 || hdr->nlights < 0)
+		return 0;
+	if (!scene_section_fits(hdr->triangles_offset, sizeof(cl_float4)*3*(cl_ulong)hdr->ntriangles, file_size) ||
+		!scene_section_fits(hdr->lights_offset, sizeof(cl_float4)*(cl_ulong)hdr->nlights, file_size) ||
+		!scene_section_fits(hdr->grid_offset, hdr->grid_memsize, file_size) ||
+		!scene_section_fits(hdr->cell_indices_offset, hdr->cell_indices_memsize, file_size))
+		return 0;
+	if (!hdr->grid_memsize)
+		return 1;
+
+	/* The cell offsets (ncells+1 uint) and the cell indices the grid is read with */
+	const cl_ulong max_offsets = hdr->grid_memsize/sizeof(cl_uint);
+	cl_ulong ncells = 1;
+	for (int i = 0; i < 3; ++i) {
+		if (hdr->grid_res.s[i] <= 0 || (cl_ulong)hdr->grid_res.s[i] > max_offsets/ncells)
+			return 0;
+		ncells *= hdr->grid_res.s[i];
+	}
+	return ncells + 1 <= max_offsets &&
+		(hdr->index_bytes == 2 || hdr->index_bytes == 4) &&
+		(cl_ulong)hdr->index_bytes*hdr->grid_nindices <= hdr->cell_indices_memsize;
+}
+
+/* Map a scene file in memory. Returns 0 on success, 1 if the file
+ * does not exist or is not a valid scene (the caller should then fall
+ * back to the text files).
+ */
+int load_scene_bin(const char *fname, SceneFile *scene)
+{
+	memset(scene, 0, sizeof(*scene));
+	const int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SceneHeader)) {
+		fprintf(stderr, "%s is not a valid scene file\n", fname);
+		close(fd);
+		return 1;
+	}
+
+	/* Private writable mapping: pages are shared with the page cache
+	 * until someone writes to them, which the read-only buffers never do */
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "could not map %s\n", fname);
+		return 1;
+	}
+
+	const SceneHeader *hdr = (const SceneHeader*)map;
+	if (hdr->magic != SCENE_MAGIC || hdr->version != SCENE_VERSION) {
+		fprintf(stderr, "%s: bad magic or unsupported version %u\n", fname, hdr->version);
+		munmap(map, st.st_size);
+		return 1;
+	}
+	if (!scene_header_valid(hdr, st.st_size)) {
+		fprintf(stderr, "%s is truncated or corrupt\n", fname);
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	scene->header = hdr;
+	scene->map = map;
+	scene->map_size = st.st_size;
+	scene->triangles = (char*)map + hdr->triangles_offset;
+	scene->lights = (cl_float4*)((char*)map + hdr->lights_offset);
+	scene->grid = hdr->grid_memsize ? (char*)map + hdr->grid_offset : NULL;
+	scene->cell_indices = hdr->grid_memsize ? (char*)map + hdr->cell_indices_offset : NULL;
+
+	/* Touch the triangle pages ahead of the buffer creation */
+	madvise(scene->triangles, sizeof(cl_float4)*3*hdr->ntriangles, MADV_WILLNEED);
+
+	printf("Loaded %s: %d triangles, %d lights%s\n", fname, hdr->ntriangles, hdr->nlights,
+		scene->grid ? ", prebuilt grid" : "");
+	return 0;
+}
+
+void unload_scene_bin(SceneFile *scene)
+{
+	if (scene->map)
+		munmap(scene->map, scene->map_size);
+	memset(scene, 0, sizeof(*scene));
+}
+
+/* Write a scene file. `header` must have the counts, bitmasks, bounding box
+ * and grid parameters filled in: the section offsets are computed here.
+ * Pass grid = NULL to store no grid, otherwise grid holds the cell offsets
+ * and cell_indices the triangle indices they point into.
+ */
+int save_scene_bin(const char *fname, SceneHeader *header,
+	const void *triangles, const cl_float4 *lights, const void *grid,
+	const void *cell_indices)
+{
+	FILE *fp = fopen(fname, "wb");
+	if (!fp) {
+		fprintf(stderr, "could not open %s for writing\n", fname);
+		return 1;
+	}
+
+	const size_t triangles_size = sizeof(cl_float4)*3*header->ntriangles;
+	const size_t lights_size = sizeof(cl_float4)*header->nlights;
+
+	header->magic = SCENE_MAGIC;
+	header->version = SCENE_VERSION;
+	header->triangles_offset = scene_align_up(sizeof(SceneHeader));
+	header->lights_offset = scene_align_up(header->triangles_offset + triangles_size);
+	header->grid_offset = scene_align_up(header->lights_offset + lights_size);
+	if (!grid) {
+		header->grid_memsize = 0;
+		header->cell_indices_memsize = 0;
+	}
+	header->cell_indices_offset = scene_align_up(header->grid_offset + header->grid_memsize);
+
+	const size_t total_size = header->cell_indices_offset + header->cell_indices_memsize;
+	char *buf = calloc(1, total_size);
+	if (!buf) {
+		fprintf(stderr, "can't allocate memory for %s\n", fname);
+		fclose(fp);
+		return 1;
+	}
+	memcpy(buf, header, sizeof(SceneHeader));
+	memcpy(buf + header->triangles_offset, triangles, triangles_size);
+	memcpy(buf + header->lights_offset, lights, lights_size);
+	if (grid) {
+		memcpy(buf + header->grid_offset, grid, header->grid_memsize);
+		memcpy(buf + header->cell_indices_offset, cell_indices, header->cell_indices_memsize);
+	}
+
+	const size_t written = fwrite(buf, 1, total_size, fp);
+	free(buf);
+	fclose(fp);
+	if (written != total_size) {
+		fprintf(stderr, "error writing %s\n", fname);
+		return 1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+
+/* Kernel specialization on the scene.
+ * The sphere and square bitmasks, the number of lights and the number of
+ * triangles are fixed for a whole run: passing them as -D options lets the
+ * compiler unroll the 19x9 bitmask loops, drop the empty primitives and
+ * give the light and triangle loops constant trip counts. The kernels fall
+ * back to their arguments when the SCENE_* macros are not defined.
+ *
+ * Every specialization is a different program binary. The last SPEC_HISTORY
+ * specializations of each kernel file are kept next to the program cache:
+ * when more than SPEC_MAX_VARIANTS of them differ, the scene changes too
+ * often for the rebuilds to pay off and the generic kernel is built instead.
+ * OCL_SPECIALIZE=0 in the environment always builds the generic kernel.
+ */
+
+#include "ocl_boiler.h"
+
+#define SPEC_HISTORY 8
+#define SPEC_MAX_VARIANTS 4
+
+/* Record the specialization `defines` of `fname` in its history and
+ * return 1 if the program should be built with them */
+int use_specialization(const char * const fname, const char * const defines)
+{
+	const char * const env = getenv("OCL_SPECIALIZE");
+	if (env && strcmp(env, "0") == 0) {
+		printf("specialization: disabled by OCL_SPECIALIZE\n");
+		return 0;
+	}
+	/* Without a cache directory there is no history: every run compiles anyway */
+	const char * const dir = program_cache_dir();
+	if (!dir)
+		return 1;
+
+	char path[BUFSIZE + 1];
+	const char * const slash = strrchr(fname, '/');
+	snprintf(path, BUFSIZE, "%s/%s.spec", dir, slash ? slash + 1 : fname);
+
+	unsigned long long history[SPEC_HISTORY + 1];
+	int nhistory = 0;
+	FILE *fp = fopen(path, "r");
+	if (fp) {
+		while (nhistory < SPEC_HISTORY && fscanf(fp, "%llx", history + nhistory) == 1)
+			nhistory++;
+		fclose(fp);
+	}
+
+	/* Append this run, keeping the most recent SPEC_HISTORY */
+	history[nhistory++] = fnv1a(0xcbf29ce484222325ULL, defines, strlen(defines));
+	const int first = nhistory > SPEC_HISTORY ? nhistory - SPEC_HISTORY : 0;
+
+	int nvariants = 0;
+	for (int i = first; i < nhistory; ++i) {
+		int seen = 0;
+		for (int j = first; j < i && !seen; ++j)
+			seen = (history[j] == history[i]);
+		nvariants += !seen;
+	}
+
+	program_cache_mkdir(dir);
+	fp = fopen(path, "w");
+	if (fp) {
+		for (int i = first; i < nhistory; ++i)
+			fprintf(fp, "%016llx\n", history[i]);
+		fclose(fp);
+	}
+
+	const int specialize = (nvariants <= SPEC_MAX_VARIANTS);
+	printf("specialization: %s (%d different scenes in the last %d runs)\n",
+		specialize ? "on" : "off, the scene changes too often",
+		nvariants, nhistory - first);
+	return specialize;
+}
+
+/* Write the scene defines (SCENE_SPHERES, SCENE_SQUARES, SCENE_NLIGHTS,
+ * SCENE_NTRIANGLES) to `defines`, of BUFSIZE + 1 chars.
+ * A negative ntriangles leaves the number of triangles generic */
+void scene_defines(char * const defines,
+	const cl_int *Spheres, const cl_int *Squares, cl_int nlights, cl_int ntriangles)
+{
+	int n = snprintf(defines, BUFSIZE, "-DSCENE_NLIGHTS=%d", nlights);
+	if (ntriangles >= 0)
+		n += snprintf(defines + n, BUFSIZE - n, " -DSCENE_NTRIANGLES=%d", ntriangles);
+	n += snprintf(defines + n, BUFSIZE - n, " -DSCENE_SPHERES=");
+	for (int k = 0; k < 9; ++k)
+		n += snprintf(defines + n, BUFSIZE - n, "%d%s", Spheres[k], k < 8 ? "," : "");
+	n += snprintf(defines + n, BUFSIZE - n, " -DSCENE_SQUARES=");
+	for (int k = 0; k < 9; ++k)
+		n += snprintf(defines + n, BUFSIZE - n, "%d%s", Squares[k], k < 8 ? "," : "");
+}
+
+/* Same as create_program_with_options, adding the scene defines
+ * (see scene_defines) to `options` unless use_specialization says otherwise */
+cl_program create_program_specialized(const char * const fname, cl_context ctx,
+	cl_device_id dev, const char * const options,
+	const cl_int *Spheres, const cl_int *Squares, cl_int nlights, cl_int ntriangles)
+{
+	char defines[BUFSIZE + 1];
+	scene_defines(defines, Spheres, Squares, nlights, ntriangles);
+
+	char opt_buf[BUFSIZE + 1];
+	if (use_specialization(fname, defines))
+		snprintf(opt_buf, BUFSIZE, "%s %s", options ? options : "", defines);
+	else
+		snprintf(opt_buf, BUFSIZE, "%s", options ? options : "");
+	return create_program_with_options(fname, ctx, dev, opt_buf);
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef TILES_H
+#define TILES_H
+
+/* Tile scheduler for the path tracers.
+ * Instead of one {width, height} launch writing a whole-frame d_render, the frame
+ * is cut into tiles, each rendered with a global offset into a small device
+ * buffer and streamed back into the host image with a rectangular read on a
+ * second queue, so the read of a tile overlaps the rendering of the next ones.
+ * Tiles go round a ring of TILE_BUFFERS device buffers: before a buffer is
+ * reused its previous tile must have been read back, and the kernel time of
+ * that tile resizes the next ones to take about target_ms each.
+ *
+ * Tiling is enabled by OCL_TILES=<milliseconds per tile> in the environment,
+ * or automatically (with TILE_TARGET_MS) when the frame does not fit in a
+ * single device allocation. OCL_TILES=0 always renders the frame in one launch.
+ *
+ * Usage:
+ *	TileScheduler ts; TileRing ring; Tile tile; cl_mem d_tile;
+ *	tile_scheduler_init(&ts, width, height, lws_x, lws_y, max_pixels, target_ms);
+ *	tile_ring_init(&ring, ctx, max_pixels*bytes_per_pixel);
+ *	while ((d_tile = tile_begin(&ring, &ts, &tile)))
+ *		tile_end(&ring, &ts, &tile, que, first_evt, last_evt, read_que, img, bytes_per_pixel);
+ * where first_evt and last_evt are the first and last kernels rendering the tile into d_tile
+ * (the same event for a single kernel), in order on que.
+ *	tile_ring_finish(&ring, &ts);
+ */
+
+#include "ocl_boiler.h"
+
+#include <math.h>
+
+#define TILE_BUFFERS 3	//Tiles in flight: rendering, reading back, waiting
+#define TILE_TARGET_MS 50.0
+#define TILE_START_SIDE 64
+#define TILE_MAX_SIDE 2048
+
+typedef struct{
+	cl_int x, y;	//Offset in the frame, in pixels
+	cl_int w, h;
+} Tile;
+
+//Row-major cursor over the frame, tiles of a band share its height
+typedef struct{
+	cl_int next_x, next_y, band_h;
+} TileCursor;
+
+typedef struct{
+	cl_int width, height;
+	cl_int align_x, align_y;	//Tile sizes are multiples of the kernel lws
+	cl_int max_pixels;
+	double target_ms;
+	cl_int tile_w, tile_h;	//Size of the next tiles, adapted from the measured runtimes
+	TileCursor own_cursor;
+	TileCursor *cursor;	//&own_cursor, or shared by the schedulers of several devices
+	//Statistics
+	cl_int ntiles;
+	cl_long pixels;
+	double render_ms, read_ms;
+	double start_ms, wall_ms;
+	cl_int min_side, max_side;
+} TileScheduler;
+
+typedef struct{
+	cl_mem buf[TILE_BUFFERS];
+	Tile tile[TILE_BUFFERS];
+	cl_event first_evt[TILE_BUFFERS];
+	cl_event last_evt[TILE_BUFFERS];	//NULL if the slot is free
+	cl_event read_evt[TILE_BUFFERS];
+	int next;
+} TileRing;
+
+/* Milliseconds per tile from OCL_TILES, 0 to render the frame in one launch.
+ * Without OCL_TILES, frames of more than the maximum allocation on the device are tiled */
+double tile_target_ms(cl_device_id d, size_t frame_bytes)
+{
+	const char * const env = getenv("OCL_TILES");
+	if (env)
+		return atof(env) > 0 ? atof(env) : 0;
+
+	cl_ulong max_alloc;
+	cl_int err = clGetDeviceInfo(d, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+	ocl_check(err, "get device max alloc size");
+	if (frame_bytes <= max_alloc)
+		return 0;
+	printf("tiles: a %zu bytes frame does not fit in a %llu bytes allocation, tiling\n",
+		frame_bytes, (unsigned long long)max_alloc);
+	return TILE_TARGET_MS;
+}
+
+/* Largest tile, in pixels, given the device memory needed per pixel of a tile:
+ * all TILE_BUFFERS tiles must fit in a quarter of the device memory */
+cl_int tile_max_pixels(cl_device_id d, size_t bytes_per_pixel)
+{
+	cl_ulong max_alloc, global_mem;
+	cl_int err = clGetDeviceInfo(d, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+	ocl_check(err, "get device max alloc size");
+	err = clGetDeviceInfo(d, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+	ocl_check(err, "get device global mem size");
+
+	cl_ulong max_pixels = (cl_ulong)TILE_MAX_SIDE*TILE_MAX_SIDE;
+	if (max_alloc/bytes_per_pixel < max_pixels)
+		max_pixels = max_alloc/bytes_per_pixel;
+	if (global_mem/4/TILE_BUFFERS/bytes_per_pixel < max_pixels)
+		max_pixels = global_mem/4/TILE_BUFFERS/bytes_per_pixel;
+	return max_pixels;
+}
+
+static cl_int tile_round(cl_int side, cl_int align, cl_int limit)
+{
+	side -= side % align;
+	if (side < align) side = align;
+	if (side > limit) side = limit;
+	return side;
+}
+
+void tile_scheduler_init(TileScheduler *ts, cl_int width, cl_int height,
+	cl_int align_x, cl_int align_y, cl_int max_pixels, double target_ms)
+{
+	memset(ts, 0, sizeof(*ts));
+	ts->width = width;
+	ts->height = height;
+	ts->align_x = align_x;
+	ts->align_y = align_y;
+	ts->max_pixels = max_pixels;
+	ts->target_ms = target_ms;
+	ts->tile_w = tile_round(TILE_START_SIDE, align_x, width);
+	ts->tile_h = tile_round(TILE_START_SIDE, align_y, height);
+	while ((cl_long)ts->tile_w*ts->tile_h > max_pixels && (ts->tile_w > align_x || ts->tile_h > align_y)) {
+		if (ts->tile_w >= ts->tile_h) ts->tile_w = tile_round(ts->tile_w/2, align_x, width);
+		else ts->tile_h = tile_round(ts->tile_h/2, align_y, height);
+	}
+	ts->cursor = &ts->own_cursor;
+	ts->min_side = CL_INT_MAX;
+	ts->start_ms = wtime_ms();
+}
+
+/* Next tile in row-major order, 0 when the frame is done */
+int tile_next(TileScheduler *ts, Tile *tile)
+{
+	TileCursor *c = ts->cursor;
+	if (c->next_x >= ts->width) {
+		c->next_x = 0;
+		c->next_y += c->band_h;
+		c->band_h = 0;
+	}
+	if (c->next_y >= ts->height)
+		return 0;
+	//A new band takes the current tile height
+	if (c->band_h == 0)
+		c->band_h = ts->tile_h < ts->height - c->next_y ? ts->tile_h : ts->height - c->next_y;
+	tile->x = c->next_x;
+	tile->y = c->next_y;
+	tile->w = ts->tile_w < ts->width - c->next_x ? ts->tile_w : ts->width - c->next_x;
+	tile->h = c->band_h;
+	//The band may be taller than this scheduler's tiles (an older tile size, or another device
+	//sharing the cursor): narrow the tile so it still fits the ring buffers of max_pixels
+	if ((cl_long)tile->w*tile->h > ts->max_pixels) {
+		tile->w = ts->max_pixels/tile->h;
+		tile->w -= tile->w % ts->align_x;
+		if (tile->w < ts->align_x) tile->w = ts->align_x;
+	}
+	c->next_x += tile->w;
+	return 1;
+}
+
+/* Account a finished tile and resize the next ones to about target_ms,
+ * at most halving or doubling their side each time */
+void tile_done(TileScheduler *ts, const Tile *tile, double render_ms, double read_ms)
+{
+	ts->ntiles++;
+	ts->pixels += (cl_long)tile->w*tile->h;
+	ts->render_ms += render_ms;
+	ts->read_ms += read_ms;
+	const cl_int side = tile->w < tile->h ? tile->w : tile->h;
+	if (side < ts->min_side) ts->min_side = side;
+	if (side > ts->max_side) ts->max_side = side;
+	if (render_ms <= 0)
+		return;
+
+	double scale = sqrt(ts->target_ms/render_ms);
+	if (scale > 2) scale = 2;
+	if (scale < 0.5) scale = 0.5;
+	cl_int w = tile_round(tile->w*scale, ts->align_x, ts->width);
+	cl_int h = tile_round(tile->h*scale, ts->align_y, ts->height);
+	while ((cl_long)w*h > ts->max_pixels && (w > ts->align_x || h > ts->align_y)) {
+		if (w >= h) w = tile_round(w/2, ts->align_x, ts->width);
+		else h = tile_round(h/2, ts->align_y, ts->height);
+	}
+	ts->tile_w = w;
+	ts->tile_h = h;
+}
+
+void tile_ring_init(TileRing *ring, cl_context ctx, size_t tile_bytes)
+{
+	cl_int err;
+	memset(ring, 0, sizeof(*ring));
+	for (int k = 0; k < TILE_BUFFERS; ++k) {
+		ring->buf[k] = clCreateBuffer(ctx, CL_MEM_WRITE_ONLY, tile_bytes, NULL, &err);
+		ocl_check(err, "create tile buffer %d", k);
+	}
+}
+
+/* Wait for the tile in a ring slot to be read back and account it */
+void tile_ring_retire(TileRing *ring, TileScheduler *ts, int k)
+{
+	if (!ring->last_evt[k])
+		return;
+	cl_int err = clWaitForEvents(1, ring->read_evt + k);
+	ocl_check(err, "wait for tile read");
+	tile_done(ts, ring->tile + k, total_runtime_ms(ring->first_evt[k], ring->last_evt[k]),
+		runtime_ms(ring->read_evt[k]));
+	if (ring->first_evt[k] != ring->last_evt[k])
+		clReleaseEvent(ring->first_evt[k]);
+	clReleaseEvent(ring->last_evt[k]);
+	clReleaseEvent(ring->read_evt[k]);
+	ring->first_evt[k] = ring->last_evt[k] = ring->read_evt[k] = NULL;
+}
+
+/* Free the next ring slot and get the next tile, returning the device buffer
+ * to render it into, or NULL when the frame is done */
+cl_mem tile_begin(TileRing *ring, TileScheduler *ts, Tile *tile)
+{
+	tile_ring_retire(ring, ts, ring->next);
+	if (!tile_next(ts, tile))
+		return NULL;
+	return ring->buf[ring->next];
+}
+
+/* Stream the tile rendered by first_evt..last_evt on que back into its place
+ * in the host image, a width x height frame of bytes_per_pixel pixels */
+void tile_end(TileRing *ring, TileScheduler *ts, const Tile *tile,
+	cl_command_queue que, cl_event first_evt, cl_event last_evt,
+	cl_command_queue read_que, void *img, size_t bytes_per_pixel)
+{
+	const int k = ring->next;
+	const size_t buffer_origin[] = { 0, 0, 0 };
+	const size_t host_origin[] = { tile->x*bytes_per_pixel, tile->y, 0 };
+	const size_t region[] = { tile->w*bytes_per_pixel, tile->h, 1 };
+
+	//The render must be submitted before the read queue waits on it
+	cl_int err = clFlush(que);
+	ocl_check(err, "flush render queue");
+	err = clEnqueueReadBufferRect(read_que, ring->buf[k], CL_FALSE,
+		buffer_origin, host_origin, region,
+		tile->w*bytes_per_pixel, 0, ts->width*bytes_per_pixel, 0, img,
+		1, &last_evt, ring->read_evt + k);
+	ocl_check(err, "read tile %d,%d", tile->x, tile->y);
+	err = clFlush(read_que);
+	ocl_check(err, "flush read queue");
+
+	ring->first_evt[k] = first_evt;
+	ring->last_evt[k] = last_evt;
+	ring->tile[k] = *tile;
+	ring->next = (k + 1) % TILE_BUFFERS;
+}
+
+/* Wait for the last tiles and release the ring */
+void tile_ring_finish(TileRing *ring, TileScheduler *ts)
+{
+	for (int k = 0; k < TILE_BUFFERS; ++k) {
+		tile_ring_retire(ring, ts, (ring->next + k) % TILE_BUFFERS);
+		clReleaseMemObject(ring->buf[k]);
+	}
+	ts->wall_ms = wtime_ms() - ts->start_ms;
+}
+
+void tile_report(const TileScheduler *ts)
+{
+	printf("tiles : %d tiles, %d to %d pixels a side, %gms per tile (target %gms)\n",
+		ts->ntiles, ts->min_side, ts->max_side, ts->ntiles ? ts->render_ms/ts->ntiles : 0, ts->target_ms);
+	printf("tiles : %gms rendering, %gms streaming back, %gms wall clock\n",
+		ts->render_ms, ts->read_ms, ts->wall_ms);
+}
+
+#endif